@@ -335,6 +335,7 @@ bool ArchiveFilter::next_document(const std::string &ipath)
 	off_t size = pEntryStats->st_size;
 
 	m_content.clear();
+	m_abortedContent = false;
 	m_metaData.clear();
 	m_metaData["title"] = pFileName;
 	m_metaData["ipath"] = string("f=") + pFileName;
@@ -375,9 +376,10 @@ bool ArchiveFilter::next_document(const std::string &ipath)
 #endif
 				readFile = false;
 			}
-			if (readFile == true)
+			if ((readFile == true) &&
+				(append_content(static_cast<const char*>(pBuffer), readSize) == false))
 			{
-				m_content.append(static_cast<const char*>(pBuffer), readSize);
+				readFile = false;
 			}
 		}
 #ifdef DEBUG
@@ -412,7 +414,8 @@ void ArchiveFilter::rewind(void)
 {
 	Filter::rewind();
 
-	m_parseDocument = m_isBig = false;
+	// m_isBig depends on the type, and remains valid
+	m_parseDocument = false;
 	if (m_pHandle != NULL)
 	{
 		archive_read_close(m_pHandle);
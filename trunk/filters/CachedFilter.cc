@@ -0,0 +1,363 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <sstream>
+#include <iostream>
+
+#include "CachedFilter.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::stringstream;
+using std::map;
+
+using namespace Dijon;
+
+CachedFilter::RecordingSink::RecordingSink(CachedFilter &filter) :
+	ContentSink(),
+	m_filter(filter)
+{
+}
+
+CachedFilter::RecordingSink::~RecordingSink()
+{
+}
+
+bool CachedFilter::RecordingSink::write(const char *data_ptr, unsigned int data_length)
+{
+	if ((m_filter.m_isRecording == true) &&
+		(m_filter.m_pCache->add_content(m_filter.m_pendingEntry, data_ptr, data_length) == false))
+	{
+		m_filter.stop_recording(false);
+	}
+
+	// The wrapped filter only passes text on
+	m_filter.m_metaData["mimetype"] = "text/plain";
+	if (m_filter.append_content(data_ptr, data_length) == false)
+	{
+		// What was recorded is incomplete
+		m_filter.stop_recording(false);
+
+		return false;
+	}
+
+	return true;
+}
+
+CachedFilter::CachedFilter(Filter *pFilter, FilterCache *pCache,
+	const string &version) :
+	Filter(pFilter->get_mime_type()),
+	m_pFilter(pFilter),
+	m_pCache(pCache),
+	m_version(version),
+	m_recordingSink(*this),
+	m_isCached(false),
+	m_documentNum(0),
+	m_isRecording(false)
+{
+}
+
+CachedFilter::~CachedFilter()
+{
+	rewind();
+	delete m_pFilter;
+}
+
+bool CachedFilter::is_data_input_ok(DataInput input) const
+{
+	return m_pFilter->is_data_input_ok(input);
+}
+
+bool CachedFilter::set_property(Properties prop_name, const string &prop_value)
+{
+	// Properties may change what's extracted
+	m_properties[prop_name] = prop_value;
+
+	return m_pFilter->set_property(prop_name, prop_value);
+}
+
+bool CachedFilter::set_document_data(const char *data_ptr, unsigned int data_length)
+{
+	rewind();
+	set_filter_sink();
+
+	return m_pFilter->set_document_data(data_ptr, data_length);
+}
+
+bool CachedFilter::set_document_string(const string &data_str)
+{
+	rewind();
+	set_filter_sink();
+
+	return m_pFilter->set_document_string(data_str);
+}
+
+bool CachedFilter::set_document_file(const string &file_path,
+	bool unlink_when_done)
+{
+	stringstream versionStream;
+	string key;
+
+	// The file is deleted when this filter is done, not the wrapped filter
+	if (Filter::set_document_file(file_path, unlink_when_done) == false)
+	{
+		return false;
+	}
+
+	// The key covers properties too
+	versionStream << m_version;
+	for (map<Properties, string>::const_iterator propIter = m_properties.begin();
+		propIter != m_properties.end(); ++propIter)
+	{
+		versionStream << "|" << propIter->first << "=" << propIter->second;
+	}
+
+	// Temporary files' paths and inodes get reused, so they aren't cached
+	if ((unlink_when_done == false) &&
+		(m_pCache->get_key(file_path, m_mimeType, versionStream.str(), key) == true))
+	{
+		if (m_pCache->load(key, m_entry) == true)
+		{
+#ifdef DEBUG
+			cout << "CachedFilter::set_document_file: " << file_path << " is cached" << endl;
+#endif
+			m_isCached = true;
+
+			return true;
+		}
+
+		m_isRecording = m_pCache->start_entry(key, m_pendingEntry);
+	}
+
+	set_filter_sink();
+
+	if (m_pFilter->set_document_file(file_path, false) == false)
+	{
+		stop_recording(false);
+
+		return false;
+	}
+
+	return true;
+}
+
+bool CachedFilter::set_document_uri(const string &uri)
+{
+	rewind();
+	set_filter_sink();
+
+	return m_pFilter->set_document_uri(uri);
+}
+
+bool CachedFilter::has_documents(void) const
+{
+	if (m_isCached == true)
+	{
+		return (m_documentNum < m_entry.get_documents_count());
+	}
+
+	return m_pFilter->has_documents();
+}
+
+bool CachedFilter::next_document(void)
+{
+	if (m_isCached == true)
+	{
+		if (load_document(m_documentNum) == false)
+		{
+			rewind();
+
+			return false;
+		}
+		++m_documentNum;
+
+		return true;
+	}
+
+	m_metaData.clear();
+	m_content.clear();
+
+	if (m_pFilter->next_document() == false)
+	{
+		// All documents were extracted, unless it failed or was cancelled
+		stop_recording((m_pFilter->has_documents() == false) &&
+			(m_pFilter->get_error().empty() == true) &&
+			(m_cancelled == false));
+
+		return false;
+	}
+	copy_document();
+
+	if (m_pFilter->has_documents() == false)
+	{
+		// That was the last one, unless the filter gave up on the rest
+		stop_recording((m_pFilter->get_error().empty() == true) &&
+			(m_cancelled == false));
+	}
+
+	return true;
+}
+
+bool CachedFilter::skip_to_document(const string &ipath)
+{
+	if (m_isCached == true)
+	{
+		for (unsigned int docNum = 0; docNum < m_entry.get_documents_count(); ++docNum)
+		{
+			const map<string, string> &metaData = m_entry.get_meta_data(docNum);
+			map<string, string>::const_iterator ipathIter = metaData.find("ipath");
+			string docIpath;
+
+			if (ipathIter != metaData.end())
+			{
+				docIpath = ipathIter->second;
+			}
+			if ((docIpath == ipath) &&
+				(load_document(docNum) == true))
+			{
+				m_documentNum = docNum + 1;
+
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Documents would be missing
+	stop_recording(false);
+
+	m_metaData.clear();
+	m_content.clear();
+
+	if (m_pFilter->skip_to_document(ipath) == false)
+	{
+		return false;
+	}
+	copy_document();
+
+	return true;
+}
+
+string CachedFilter::get_error(void) const
+{
+	if (m_isCached == true)
+	{
+		return "";
+	}
+
+	return m_pFilter->get_error();
+}
+
+void CachedFilter::cancel(void)
+{
+	Filter::cancel();
+	m_pFilter->cancel();
+}
+
+bool CachedFilter::reset(void)
+{
+	Filter::reset();
+
+	return m_pFilter->reset();
+}
+
+void CachedFilter::rewind(void)
+{
+	stop_recording(false);
+	m_entry.release();
+	m_isCached = false;
+	m_documentNum = 0;
+
+	Filter::rewind();
+}
+
+void CachedFilter::set_filter_sink(void)
+{
+	if (m_pContentSink != NULL)
+	{
+		m_pFilter->set_content_sink(&m_recordingSink);
+	}
+	else
+	{
+		m_pFilter->set_content_sink(NULL);
+	}
+}
+
+bool CachedFilter::load_document(unsigned int doc_num)
+{
+	unsigned int contentLength = 0;
+
+	m_metaData.clear();
+	m_content.clear();
+
+	if (doc_num >= m_entry.get_documents_count())
+	{
+		return false;
+	}
+
+	const char *pContent = m_entry.get_content(doc_num, contentLength);
+	m_metaData = m_entry.get_meta_data(doc_num);
+	if (is_content_streamed() == false)
+	{
+		m_content.assign(pContent, contentLength);
+	}
+	else
+	{
+		// Push it from the mapping
+		append_content(pContent, contentLength);
+	}
+
+	return true;
+}
+
+void CachedFilter::copy_document(void)
+{
+	m_metaData = m_pFilter->get_meta_data();
+	// Unless it went to the sink, the content was kept by the filter
+	if (is_content_streamed() == false)
+	{
+		const dstring &content = m_pFilter->get_content();
+
+		m_content.assign(content.c_str(), content.length());
+
+		if ((m_isRecording == true) &&
+			(m_pCache->add_content(m_pendingEntry, m_content.c_str(), (unsigned int)m_content.length()) == false))
+		{
+			stop_recording(false);
+		}
+	}
+
+	if ((m_isRecording == true) &&
+		(m_pCache->end_document(m_pendingEntry, m_metaData) == false))
+	{
+		stop_recording(false);
+	}
+}
+
+void CachedFilter::stop_recording(bool commit)
+{
+	if (m_isRecording == false)
+	{
+		return;
+	}
+
+	m_pCache->end_entry(m_pendingEntry, commit);
+	m_isRecording = false;
+}
@@ -0,0 +1,178 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DIJON_CACHEDFILTER_H
+#define _DIJON_CACHEDFILTER_H
+
+#include <string>
+#include <map>
+
+#include "Filter.h"
+#include "FilterCache.h"
+
+namespace Dijon
+{
+    /** A filter that gets documents from a cache rather than from
+     * the filter it wraps, when files were already extracted.
+     * Files are added to the cache once all their documents have been
+     * extracted in sequence.
+     */
+    class DIJON_FILTER_EXPORT CachedFilter : public Filter
+    {
+    public:
+	/** Builds a filter that wraps the given filter, which it then owns.
+	 * The cache isn't owned, and version should change whenever
+	 * the wrapped filter's output may.
+	 */
+	CachedFilter(Filter *pFilter, FilterCache *pCache,
+		const std::string &version);
+	/// Destroys the filter.
+	virtual ~CachedFilter();
+
+
+	// Information.
+
+	/// Returns what data the filter requires as input.
+	virtual bool is_data_input_ok(DataInput input) const;
+
+
+	// Initialization.
+
+	/** Sets a property, prior to calling set_document_XXX().
+	 * Returns false if the property is not supported.
+	 */
+	virtual bool set_property(Properties prop_name, const std::string &prop_value);
+
+	/** (Re)initializes the filter with the given data.
+	 * Caller should ensure the given pointer is valid until the
+	 * Filter object is destroyed, as some filters may not need to
+	 * do a deep copy of the data.
+	 * Call next_document() to position the filter onto the first document.
+	 * Returns false if this input is not supported or an error occured.
+	 */
+	virtual bool set_document_data(const char *data_ptr, unsigned int data_length);
+
+	/** (Re)initializes the filter with the given data.
+	 * Call next_document() to position the filter onto the first document.
+	 * Returns false if this input is not supported or an error occured.
+	 */
+	virtual bool set_document_string(const std::string &data_str);
+
+	/** (Re)initializes the filter with the given file.
+	 * Call next_document() to position the filter onto the first document.
+	 * Temporary files, that are unlinked when done, are never cached.
+	 * Returns false if this input is not supported or an error occured.
+	 */
+	virtual bool set_document_file(const std::string &file_path,
+		bool unlink_when_done = false);
+
+	/** (Re)initializes the filter with the given URI.
+	 * Call next_document() to position the filter onto the first document.
+	 * Returns false if this input is not supported or an error occured.
+	 */
+	virtual bool set_document_uri(const std::string &uri);
+
+
+	// Going from one nested document to the next.
+
+	/** Returns true if there are nested documents left to extract.
+	 * Returns false if the end of the parent document was reached
+	 * or an error occured.
+	 */
+	virtual bool has_documents(void) const;
+
+	/** Moves to the next nested document.
+	 * Returns false if there are none left.
+	 */
+	virtual bool next_document(void);
+
+	/** Skips to the nested document with the given ipath.
+	 * Returns false if no such document exists.
+	 */
+	virtual bool skip_to_document(const std::string &ipath);
+
+
+	// Accessing documents' contents.
+
+	/// Returns the message for the most recent error that has occured.
+	virtual std::string get_error(void) const;
+
+
+	// Cancellation.
+
+	/// Asks the filter to give up on the current document as soon as it can.
+	virtual void cancel(void);
+
+
+	// Reuse.
+
+	/// Resets this filter and the wrapped filter.
+	virtual bool reset(void);
+
+    protected:
+	/// Passes content on to the client's sink, and records it.
+	class RecordingSink : public ContentSink
+	{
+	public:
+		RecordingSink(CachedFilter &filter);
+		virtual ~RecordingSink();
+
+		virtual bool write(const char *data_ptr, unsigned int data_length);
+
+	protected:
+		CachedFilter &m_filter;
+
+	};
+
+	Filter *m_pFilter;
+	FilterCache *m_pCache;
+	std::string m_version;
+	std::map<Properties, std::string> m_properties;
+	RecordingSink m_recordingSink;
+	FilterCacheEntry m_entry;
+	bool m_isCached;
+	unsigned int m_documentNum;
+	FilterCache::PendingEntry m_pendingEntry;
+	bool m_isRecording;
+
+	virtual void rewind(void);
+
+	/// Lets the wrapped filter push content to the client's sink, if any.
+	void set_filter_sink(void);
+
+	/// Sets the current document from the cache entry.
+	bool load_document(unsigned int doc_num);
+
+	/// Sets the current document from the wrapped filter, and records it.
+	void copy_document(void);
+
+	/// Stops recording documents, and caches them if commit is true.
+	void stop_recording(bool commit);
+
+	friend class RecordingSink;
+
+    private:
+	/// CachedFilter objects cannot be copied.
+	CachedFilter(const CachedFilter &other);
+	/// CachedFilter objects cannot be copied.
+	CachedFilter& operator=(const CachedFilter& other);
+
+    };
+}
+
+#endif // _DIJON_CACHEDFILTER_H
@@ -166,7 +166,7 @@ bool ChmFilter::next_document(const std::string &ipath)
 {
 	struct chmUnitInfo unitInfo;
 	struct chmUnitInfo *pUnitInfo = NULL;
-	bool deleteUnitInfo = false;
+	bool deleteUnitInfo = false, gotContent = false;
 
 	if (m_pHandle == NULL)
 	{
@@ -174,6 +174,7 @@ bool ChmFilter::next_document(const std::string &ipath)
 	}
 
 	m_content.clear();
+	m_abortedContent = false;
 	m_metaData.clear();
 
 	if (ipath.empty() == false)
@@ -229,17 +230,20 @@ bool ChmFilter::next_document(const std::string &ipath)
 					(unsigned char*)pBuffer, 0, pUnitInfo->length) != 0))
 			{
 				stringstream sizeStream;
-
-				m_content = pBuffer;
+				unsigned int contentLength = strlen(pBuffer);
 
 				m_metaData["title"] = pUnitInfo->path;
 				m_metaData["ipath"] = pUnitInfo->path;
 				sizeStream << pUnitInfo->length;
 				m_metaData["size"] = sizeStream.str();
 				m_metaData["mimetype"] = "SCAN";
+
+				// This is kept for the client application to filter
+				append_content(pBuffer, contentLength);
+				gotContent = (contentLength > 0);
 #ifdef DEBUG
 				cout << "ChmFilter::next_document: returning "
-					<< pUnitInfo->path << ", size " << m_content.size() << endl;
+					<< pUnitInfo->path << ", size " << pUnitInfo->length << endl;
 #endif
 			}
 
@@ -252,7 +256,7 @@ bool ChmFilter::next_document(const std::string &ipath)
 		}
 	}
 
-	return !m_content.empty();
+	return gotContent;
 }
 
 bool ChmFilter::skip_to_document(const string &ipath)
@@ -220,10 +220,12 @@ bool ExifImageFilter::next_document(void)
 		}
 		else
 		{
-			ExifMetaData *pMetaData = new ExifMetaData(m_content);
+			dstring exifText;
+			ExifMetaData *pMetaData = new ExifMetaData(exifText);
 
 			// Get it all
 			exif_data_foreach_content(pData, contentCallback, pMetaData);
+			append_content(exifText.c_str(), exifText.length());
 
 			m_metaData["title"] = pMetaData->m_title;
 			if (pMetaData->m_date.empty() == false)
@@ -264,10 +264,10 @@ bool Exiv2ImageFilter::next_document(void)
 
 				if (valueStr.empty() == false)
 				{
-					m_content += " ";
-					m_content.append(key.c_str(), key.length());
-					m_content += " ";
-					m_content.append(valueStr.c_str(), valueStr.length());
+					append_content(" ", 1);
+					append_content(key.c_str(), key.length());
+					append_content(" ", 1);
+					append_content(valueStr.c_str(), valueStr.length());
 				}
 #ifdef DEBUG
 				cout << "Exiv2ImageFilter::next_document: " << key << "=" << value << endl;
@@ -322,10 +322,10 @@ bool Exiv2ImageFilter::next_document(void)
 				}
 				else if (valueStr.empty() == false)
 				{
-					m_content += " ";
-					m_content.append(key.c_str(), key.length());
-					m_content += " ";
-					m_content.append(valueStr.c_str(), valueStr.length());
+					append_content(" ", 1);
+					append_content(key.c_str(), key.length());
+					append_content(" ", 1);
+					append_content(valueStr.c_str(), valueStr.length());
 				}
 			}
 
@@ -378,10 +378,10 @@ bool Exiv2ImageFilter::next_document(void)
 				}
 				else if (valueStr.empty() == false)
 				{
-					m_content += " ";
-					m_content.append(key.c_str(), key.length());
-					m_content += " ";
-					m_content.append(valueStr.c_str(), valueStr.length());
+					append_content(" ", 1);
+					append_content(key.c_str(), key.length());
+					append_content(" ", 1);
+					append_content(valueStr.c_str(), valueStr.length());
 				}
 			}
 
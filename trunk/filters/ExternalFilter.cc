@@ -36,7 +36,9 @@
 #endif
 #endif
 #include <unistd.h>
+#include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <sstream>
 #include <algorithm>
 #include <iostream>
@@ -51,18 +53,32 @@ using std::string;
 using std::stringstream;
 using std::set;
 using std::map;
+using std::vector;
 
 using namespace Dijon;
 
+// How much continue_command() reads at once, and at most before it returns
+static const size_t CONTINUE_READ_SIZE = 65536;
+static const size_t CONTINUE_MAX_SIZE = 1048576;
+
 #ifdef _DYNAMIC_DIJON_FILTERS
-DIJON_FILTER_EXPORT bool get_filter_types(std::set<std::string> &mime_types)
-{
 #ifdef _DIJON_EXTERNALFILTER_CONFFILE
-	ExternalFilter::initialize(_DIJON_EXTERNALFILTER_CONFFILE, mime_types);
+#define EXTERNALFILTER_CONFFILE _DIJON_EXTERNALFILTER_CONFFILE
 #else
-	ExternalFilter::initialize("/etc/dijon/external-filters.xml", mime_types);
+#define EXTERNALFILTER_CONFFILE "/etc/dijon/external-filters.xml"
 #endif
 
+DIJON_FILTER_EXPORT bool get_filter_types(std::set<std::string> &mime_types)
+{
+	ExternalFilter::initialize(EXTERNALFILTER_CONFFILE, mime_types);
+
+	return true;
+}
+
+DIJON_FILTER_EXPORT bool get_filter_dependencies(std::set<std::string> &file_names)
+{
+	file_names.insert(EXTERNALFILTER_CONFFILE);
+
 	return true;
 }
 
@@ -82,6 +98,11 @@ DIJON_FILTER_EXPORT Filter *get_filter(const std::string &mime_type)
 {
 	return new ExternalFilter(mime_type);
 }
+
+DIJON_FILTER_SHUTDOWN void shutdown_external_filter(void)
+{
+	ExternalFilter::shutdown();
+}
 #endif
 
 // This function is heavily inspired by Xapian Omega's shell_protect()
@@ -116,20 +137,194 @@ static string shell_protect(const string &file_name)
 	return safefile;
 }
 
-map<string, string> ExternalFilter::m_commandsByType;
-map<string, string> ExternalFilter::m_outputsByType;
-map<string, string> ExternalFilter::m_charsetsByType;
+// Builds a command line for the shell, with the file name in place of %s
+static string build_command_line(const string &command, const string &file_path)
+{
+	string commandLine(command);
+	bool replacedParam = false;
+
+	string::size_type argPos = commandLine.find("%s");
+	while (argPos != string::npos)
+	{
+		string quotedFilePath(shell_protect(file_path));
+
+		commandLine.replace(argPos, 2, quotedFilePath);
+		replacedParam = true;
+
+		// Next
+		argPos = commandLine.find("%s", argPos + 1);
+	}
+
+	if (replacedParam == false)
+	{
+		// Append
+		commandLine += " ";
+		commandLine += shell_protect(file_path);
+	}
+
+	return commandLine;
+}
+
+// Splits a command into arguments, with the file name in place of %s.
+// Returns false if the shell is needed to run this command.
+static bool split_command(const string &command, const string &file_path,
+	vector<string> &arguments)
+{
+	string filePath(file_path);
+	bool replacedParam = false;
+
+	arguments.clear();
+
+	// Leave quotes, redirections, variables, globs... to the shell
+	if (command.find_first_of("|&;<>()$`\\\"'*?[]{}~#\n") != string::npos)
+	{
+		return false;
+	}
+
+	if ((filePath.empty() == false) &&
+		(filePath[0] == '-'))
+	{
+		// Don't let it be treated as an option
+		filePath.insert(0, "./");
+	}
+
+	string::size_type startPos = command.find_first_not_of(" \t");
+	while (startPos != string::npos)
+	{
+		string::size_type endPos = command.find_first_of(" \t", startPos);
+		string argument;
+
+		if (endPos == string::npos)
+		{
+			argument = command.substr(startPos);
+		}
+		else
+		{
+			argument = command.substr(startPos, endPos - startPos);
+		}
+
+		string::size_type argPos = argument.find("%s");
+		while (argPos != string::npos)
+		{
+			argument.replace(argPos, 2, filePath);
+			replacedParam = true;
+
+			// Next
+			argPos = argument.find("%s", argPos + filePath.length());
+		}
+		arguments.push_back(argument);
+
+		if (endPos == string::npos)
+		{
+			break;
+		}
+		startPos = command.find_first_not_of(" \t", endPos);
+	}
+
+	if (arguments.empty() == true)
+	{
+		return false;
+	}
+	if (replacedParam == false)
+	{
+		// Append
+		arguments.push_back(filePath);
+	}
+
+	return true;
+}
+
+ExternalFilter::TypeConfiguration::TypeConfiguration() :
+	m_maxProcesses(0),
+	m_timeout(0),
+	m_maxMemory(0),
+	m_maxFileSize(0)
+{
+}
+
+ExternalFilter::TypeConfiguration::~TypeConfiguration()
+{
+}
+
+bool ExternalFilter::TypeConfiguration::operator==(const TypeConfiguration &other) const
+{
+	if ((m_command == other.m_command) &&
+		(m_output == other.m_output) &&
+		(m_charset == other.m_charset) &&
+		(m_maxProcesses == other.m_maxProcesses) &&
+		(m_timeout == other.m_timeout) &&
+		(m_maxMemory == other.m_maxMemory) &&
+		(m_maxFileSize == other.m_maxFileSize))
+	{
+		return true;
+	}
+
+	return false;
+}
+
+const ExternalFilter::Configuration *ExternalFilter::m_pConfiguration = NULL;
+map<const ExternalFilter::Configuration *, unsigned int> ExternalFilter::m_configurationUsers;
+pthread_mutex_t ExternalFilter::m_configurationMutex = PTHREAD_MUTEX_INITIALIZER;
+map<string, unsigned int> ExternalFilter::m_processesByType;
+pthread_mutex_t ExternalFilter::m_processesMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ExternalFilter::m_processesCond = PTHREAD_COND_INITIALIZER;
 
 ExternalFilter::ExternalFilter(const string &mime_type) :
 	FileOutputFilter(mime_type),
+	m_pUsedConfiguration(NULL),
+	m_pTypeConfiguration(NULL),
 	m_maxSize(0),
-	m_doneWithDocument(false)
+	m_doneWithDocument(false),
+	m_outFd(-1),
+	m_childPid(-1),
+	m_deadline(0),
+	m_maxOutputSize(0),
+	m_outputSize(0),
+	m_gotOutput(false)
 {
+	// This type's configuration won't change for the life of the filter
+	if (pthread_mutex_lock(&m_configurationMutex) == 0)
+	{
+		if (m_pConfiguration != NULL)
+		{
+			Configuration::const_iterator typeIter = m_pConfiguration->find(mime_type);
+
+			if ((typeIter != m_pConfiguration->end()) &&
+				(typeIter->second.m_command.empty() == false))
+			{
+				m_pUsedConfiguration = m_pConfiguration;
+				m_pTypeConfiguration = &typeIter->second;
+				++m_configurationUsers[m_pConfiguration];
+			}
+		}
+
+		pthread_mutex_unlock(&m_configurationMutex);
+	}
 }
 
 ExternalFilter::~ExternalFilter()
 {
 	rewind();
+
+	if ((m_pUsedConfiguration != NULL) &&
+		(pthread_mutex_lock(&m_configurationMutex) == 0))
+	{
+		map<const Configuration *, unsigned int>::iterator userIter = m_configurationUsers.find(m_pUsedConfiguration);
+
+		// Delete a configuration that was replaced once its last filter is gone
+		if ((userIter != m_configurationUsers.end()) &&
+			(--userIter->second == 0) &&
+			(userIter->first != m_pConfiguration))
+		{
+#ifdef DEBUG
+			cout << "ExternalFilter::~ExternalFilter: deleting replaced configuration" << endl;
+#endif
+			delete userIter->first;
+			m_configurationUsers.erase(userIter);
+		}
+
+		pthread_mutex_unlock(&m_configurationMutex);
+	}
 }
 
 bool ExternalFilter::is_data_input_ok(DataInput input) const
@@ -184,47 +379,29 @@ bool ExternalFilter::next_document(void)
 	if ((m_doneWithDocument == false) &&
 		(m_mimeType.empty() == false) &&
 		(m_filePath.empty() == false) &&
-		(m_commandsByType.empty() == false))
+		(m_pTypeConfiguration != NULL))
 	{
-		string outputType("text/plain");
-		ssize_t maxSize = 0;
+		string command;
 
 		m_doneWithDocument = true;
 
-		// Is this type supported ? Assume text/plain if not specified
-		map<string, string>::const_iterator commandIter = m_commandsByType.find(m_mimeType);
-		if ((commandIter == m_commandsByType.end()) ||
-			(commandIter->second.empty() == true))
+		if (find_command(command) == false)
 		{
 			return false;
 		}
 
-		// What's the output type ?
-		map<string, string>::const_iterator outputIter = m_outputsByType.find(m_mimeType);
-		if (outputIter != m_outputsByType.end())
-		{
-			outputType = outputIter->second;
-		}
+		// A sink should know what type the output is before getting any
+		set_document_meta_data();
 
-		if (outputType != "text/plain")
-		{
-			maxSize = m_maxSize;
-		}
+		acquire_process();
+		bool ranCommand = run_command(command, (ssize_t)m_maxSize);
+		release_process();
 
-		if (run_command(commandIter->second, maxSize) == true)
+		if (ranCommand == true)
 		{
-			// Fill in general details
-			m_metaData["uri"] = "file://" + m_filePath;
-			m_metaData["mimetype"] = outputType;
-			// Is it in a known charset ?
-			map<string, string>::const_iterator charsetIter = m_charsetsByType.find(m_mimeType);
-			if (charsetIter != m_charsetsByType.end())
-			{
-				m_metaData["charset"] = charsetIter->second;
-			}
-
 			return true;
 		}
+		m_metaData.clear();
 
 		return false;
 	}
@@ -253,6 +430,7 @@ void ExternalFilter::initialize(const std::string &config_file, set<std::string>
 {
 	xmlDoc *pDoc = NULL;
 	xmlNode *pRootElement = NULL;
+	Configuration *pConfiguration = NULL;
 
 	types.clear();
 
@@ -267,6 +445,8 @@ void ExternalFilter::initialize(const std::string &config_file, set<std::string>
 		return;
 	}
 
+	pConfiguration = new Configuration();
+
 	// Iterate through the root element's nodes
 	pRootElement = xmlDocGetRootElement(pDoc);
 	for (xmlNode *pCurrentNode = pRootElement->children; pCurrentNode != NULL;
@@ -282,6 +462,7 @@ void ExternalFilter::initialize(const std::string &config_file, set<std::string>
 		if (xmlStrncmp(pCurrentNode->name, BAD_CAST"filter", 6) == 0)
 		{
 			string mimeType, charset, command, arguments, output;
+			unsigned int maxProcesses = 0, timeout = 0, maxMemory = 0, maxFileSize = 0;
 
 			for (xmlNode *pCurrentCodecNode = pCurrentNode->children;
 				pCurrentCodecNode != NULL; pCurrentCodecNode = pCurrentCodecNode->next)
@@ -318,6 +499,22 @@ void ExternalFilter::initialize(const std::string &config_file, set<std::string>
 				{
 					output = pChildContent;
 				}
+				else if (xmlStrncmp(pCurrentCodecNode->name, BAD_CAST"maxprocesses", 12) == 0)
+				{
+					maxProcesses = (unsigned int)atoi(pChildContent);
+				}
+				else if (xmlStrncmp(pCurrentCodecNode->name, BAD_CAST"timeout", 7) == 0)
+				{
+					timeout = (unsigned int)atoi(pChildContent);
+				}
+				else if (xmlStrncmp(pCurrentCodecNode->name, BAD_CAST"maxmemory", 9) == 0)
+				{
+					maxMemory = (unsigned int)atoi(pChildContent);
+				}
+				else if (xmlStrncmp(pCurrentCodecNode->name, BAD_CAST"maxfilesize", 11) == 0)
+				{
+					maxFileSize = (unsigned int)atoi(pChildContent);
+				}
 
 				// Free
 				xmlFree(pChildContent);
@@ -332,18 +529,19 @@ void ExternalFilter::initialize(const std::string &config_file, set<std::string>
 					<< command << " " << arguments << endl;
 #endif
 
+				TypeConfiguration &typeConfiguration = (*pConfiguration)[mimeType];
+
 				// Command to run
-				m_commandsByType[mimeType] = command + " " + arguments;
-				// Output
-				if (output.empty() == false)
-				{
-					m_outputsByType[mimeType] = output;
-				}
-				// Charset
-				if (charset.empty() == false)
-				{
-					m_charsetsByType[mimeType] = charset;
-				}
+				typeConfiguration.m_command = command + " " + arguments;
+				typeConfiguration.m_output = output;
+				typeConfiguration.m_charset = charset;
+				// How many may run at once
+				typeConfiguration.m_maxProcesses = maxProcesses;
+				// Wall-clock time in seconds
+				typeConfiguration.m_timeout = timeout;
+				// Address space and written files' size in megabytes
+				typeConfiguration.m_maxMemory = maxMemory;
+				typeConfiguration.m_maxFileSize = maxFileSize;
 
 				types.insert(mimeType);
 			}
@@ -352,40 +550,381 @@ void ExternalFilter::initialize(const std::string &config_file, set<std::string>
 
 	// Free the document
 	xmlFreeDoc(pDoc);
+
+	// Filters that already exist keep using the previous configuration
+	if (pthread_mutex_lock(&m_configurationMutex) == 0)
+	{
+		if ((m_pConfiguration != NULL) &&
+			(*m_pConfiguration == *pConfiguration))
+		{
+			// Nothing changed
+			delete pConfiguration;
+		}
+		else
+		{
+			if (m_pConfiguration != NULL)
+			{
+				map<const Configuration *, unsigned int>::iterator userIter = m_configurationUsers.find(m_pConfiguration);
+
+				// Unless filters still use it, the previous one can go
+				if ((userIter != m_configurationUsers.end()) &&
+					(userIter->second == 0))
+				{
+					delete userIter->first;
+					m_configurationUsers.erase(userIter);
+				}
+			}
+
+			m_configurationUsers[pConfiguration] = 0;
+			m_pConfiguration = pConfiguration;
+		}
+
+		pthread_mutex_unlock(&m_configurationMutex);
+	}
+	else
+	{
+		delete pConfiguration;
+	}
+}
+
+void ExternalFilter::shutdown(void)
+{
+	if (pthread_mutex_lock(&m_configurationMutex) == 0)
+	{
+		for (map<const Configuration *, unsigned int>::iterator userIter = m_configurationUsers.begin();
+			userIter != m_configurationUsers.end(); ++userIter)
+		{
+			delete userIter->first;
+		}
+		m_configurationUsers.clear();
+		m_pConfiguration = NULL;
+
+		pthread_mutex_unlock(&m_configurationMutex);
+	}
 }
 
 void ExternalFilter::rewind(void)
 {
+#ifdef LIMIT_EXTERNAL_PROGRAMS
+	if (m_childPid != -1)
+	{
+		// Don't leave the command behind
+		m_gotOutput = false;
+		finish_command();
+	}
+#endif
 	Filter::rewind();
 	m_doneWithDocument = false;
 }
 
-// This function is heavily inspired by Xapian Omega's stdout_to_string()
-bool ExternalFilter::run_command(const string &command, ssize_t maxSize)
+bool ExternalFilter::find_command(string &command) const
 {
-	string commandLine(command);
-	bool replacedParam = false, gotOutput = false;
+	// Is this type supported ?
+	if (m_pTypeConfiguration == NULL)
+	{
+		return false;
+	}
+	command = m_pTypeConfiguration->m_command;
 
-	string::size_type argPos = commandLine.find("%s");
-	while (argPos != string::npos)
+	return true;
+}
+
+void ExternalFilter::set_document_meta_data(void)
+{
+	string outputType("text/plain");
+
+	// What's the output type ? Assume text/plain if not specified
+	if ((m_pTypeConfiguration != NULL) &&
+		(m_pTypeConfiguration->m_output.empty() == false))
 	{
-		string quotedFilePath(shell_protect(m_filePath));
+		outputType = m_pTypeConfiguration->m_output;
+	}
 
-		commandLine.replace(argPos, 2, quotedFilePath);
-		replacedParam = true;
+	// Fill in general details
+	m_metaData["uri"] = "file://" + m_filePath;
+	m_metaData["mimetype"] = outputType;
+	// Is it in a known charset ?
+	if ((m_pTypeConfiguration != NULL) &&
+		(m_pTypeConfiguration->m_charset.empty() == false))
+	{
+		m_metaData["charset"] = m_pTypeConfiguration->m_charset;
+	}
+}
 
-		// Next
-		argPos = commandLine.find("%s", argPos + 1);
+bool ExternalFilter::start_document(void)
+{
+	string command;
+
+	if ((m_doneWithDocument == true) ||
+		(m_filePath.empty() == true))
+	{
+		return false;
 	}
+	m_doneWithDocument = true;
 
-	if (replacedParam == false)
+	if (find_command(command) == false)
 	{
-		// Append
-		commandLine += " ";
-		commandLine += shell_protect(m_filePath);
+		return false;
+	}
+
+	// A sink should know what type the output is before getting any
+	set_document_meta_data();
+
+#ifdef LIMIT_EXTERNAL_PROGRAMS
+	return start_command(command, (ssize_t)m_maxSize);
+#else
+	// The command can only be waited for
+	m_gotOutput = run_command(command, (ssize_t)m_maxSize);
+
+	return true;
+#endif
+}
+
+bool ExternalFilter::finish_document(void)
+{
+#ifdef LIMIT_EXTERNAL_PROGRAMS
+	m_gotOutput = finish_command();
+#endif
+	if (m_gotOutput == true)
+	{
+		return true;
+	}
+	m_metaData.clear();
+
+	return false;
+}
+
+void ExternalFilter::stop_document(void)
+{
+#ifdef LIMIT_EXTERNAL_PROGRAMS
+	stop_command();
+#endif
+}
+
+bool ExternalFilter::reap_document(bool &succeeded)
+{
+#ifdef LIMIT_EXTERNAL_PROGRAMS
+	bool ranCommand = false;
+
+	if (reap_command(false, ranCommand) == false)
+	{
+		return false;
+	}
+	m_gotOutput = end_command(ranCommand);
+#endif
+	succeeded = m_gotOutput;
+	if (succeeded == false)
+	{
+		m_metaData.clear();
+	}
+
+	return true;
+}
+
+bool ExternalFilter::acquire_process(bool wait)
+{
+	if ((m_pTypeConfiguration == NULL) ||
+		(m_pTypeConfiguration->m_maxProcesses == 0))
+	{
+		// No limit
+		return true;
 	}
 
+	if (pthread_mutex_lock(&m_processesMutex) == 0)
+	{
+		unsigned int &processesCount = m_processesByType[m_mimeType];
+
+		while (processesCount >= m_pTypeConfiguration->m_maxProcesses)
+		{
+			if (wait == false)
+			{
+				pthread_mutex_unlock(&m_processesMutex);
+
+				return false;
+			}
+#ifdef DEBUG
+			cout << "ExternalFilter::acquire_process: waiting for a " << m_mimeType << " process" << endl;
+#endif
+			pthread_cond_wait(&m_processesCond, &m_processesMutex);
+		}
+		++processesCount;
+
+		pthread_mutex_unlock(&m_processesMutex);
+	}
+
+	return true;
+}
+
+void ExternalFilter::release_process(void)
+{
+	if ((m_pTypeConfiguration == NULL) ||
+		(m_pTypeConfiguration->m_maxProcesses == 0))
+	{
+		return;
+	}
+
+	if (pthread_mutex_lock(&m_processesMutex) == 0)
+	{
+		unsigned int &processesCount = m_processesByType[m_mimeType];
+
+		if (processesCount > 0)
+		{
+			--processesCount;
+		}
+		pthread_cond_broadcast(&m_processesCond);
+
+		pthread_mutex_unlock(&m_processesMutex);
+	}
+}
+
+#ifdef LIMIT_EXTERNAL_PROGRAMS
+pid_t ExternalFilter::spawn_command(const string &command, int outFd)
+{
+	vector<string> arguments;
+	vector<char*> argv;
+
+	// Only go through the shell if the command needs it
+	if (split_command(command, m_filePath, arguments) == false)
+	{
+		arguments.clear();
+		arguments.push_back("/bin/sh");
+		arguments.push_back("-c");
+		arguments.push_back(build_command_line(command, m_filePath));
+	}
+	for (vector<string>::const_iterator argIter = arguments.begin();
+		argIter != arguments.end(); ++argIter)
+	{
+#ifdef DEBUG
+		cout << "ExternalFilter::spawn_command: argument " << *argIter << endl;
+#endif
+		argv.push_back(const_cast<char*>(argIter->c_str()));
+	}
+	argv.push_back(NULL);
+
+	// Limit CPU time for external programs to 300 seconds
+	struct rlimit cpu_limit = { 300, RLIM_INFINITY } ;
+	struct rlimit memory_limit = { RLIM_INFINITY, RLIM_INFINITY } ;
+	struct rlimit file_size_limit = { RLIM_INFINITY, RLIM_INFINITY } ;
+	if (m_pTypeConfiguration->m_maxMemory > 0)
+	{
+		memory_limit.rlim_cur = memory_limit.rlim_max = (rlim_t)m_pTypeConfiguration->m_maxMemory * 1048576;
+	}
+	if (m_pTypeConfiguration->m_maxFileSize > 0)
+	{
+		file_size_limit.rlim_cur = file_size_limit.rlim_max = (rlim_t)m_pTypeConfiguration->m_maxFileSize * 1048576;
+	}
+	// Fork and execute the command. The child sets up its process group,
+	// output and limits before it runs the program, which vfork() doesn't
+	// allow and posix_spawn() can't do for limits
+	pid_t childPid = fork();
+	if (childPid == 0)
+	{
+		// Child process
+		// Put it in its own process group, so that it can be killed with its children
+		setpgid(0, 0);
+		// Connect stdout to our side of the socket pair
+		dup2(outFd, 1);
+		// Close stderr
+		close(2);
+
+		setrlimit(RLIMIT_CPU, &cpu_limit);
+		if (memory_limit.rlim_cur != RLIM_INFINITY)
+		{
+			setrlimit(RLIMIT_AS, &memory_limit);
+		}
+		if (file_size_limit.rlim_cur != RLIM_INFINITY)
+		{
+			setrlimit(RLIMIT_FSIZE, &file_size_limit);
+		}
+
+		execvp(argv[0], &argv[0]);
+		_exit(127);
+	}
+	else if (childPid > 0)
+	{
+		// Don't depend on the child having run first
+		setpgid(childPid, childPid);
+	}
+#ifdef DEBUG
+	else cout << "ExternalFilter::spawn_command: couldn't run " << command << endl;
+#endif
+
+	return childPid;
+}
+
+bool ExternalFilter::wait_for_command(const string &command, pid_t childPid,
+	time_t deadline)
+{
+	useconds_t waitInterval = 1000;
+	int status = 0;
+	bool killedCommand = false;
+
+	// Wait until the child terminates, checking more and more rarely
+	pid_t actualChildPid = waitpid(childPid, &status, WNOHANG);
+	while (actualChildPid == 0)
+	{
+		if ((m_cancelled == true) ||
+			((deadline > 0) && (time(NULL) >= deadline)))
+		{
+#ifdef DEBUG
+			cout << "ExternalFilter::wait_for_command: killing " << command << endl;
+#endif
+			kill(-childPid, SIGKILL);
+			killedCommand = true;
+
+			actualChildPid = waitpid(childPid, &status, 0);
+			break;
+		}
+
+		usleep(waitInterval);
+		if (waitInterval < 100000)
+		{
+			waitInterval *= 2;
+		}
+
+		actualChildPid = waitpid(childPid, &status, WNOHANG);
+	}
+	if ((actualChildPid == -1) ||
+		(killedCommand == true))
+	{
+		return false;
+	}
+
+	return check_command_status(command, status);
+}
+
+bool ExternalFilter::check_command_status(const string &command, int status)
+{
+	if (status != 0)
+	{
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+		{
+#ifdef DEBUG
+			cout << "ExternalFilter::wait_for_command: couldn't run " << command << endl;
+#endif
+			return false;
+		}
+	}
+#ifdef SIGXCPU
+	if (WIFSIGNALED(status) && WTERMSIG(status) == SIGXCPU)
+	{
+#ifdef DEBUG
+		cout << "ExternalFilter::wait_for_command: " << command << " consumed too much CPU" << endl;
+#endif
+		return false;
+	}
+#endif
+
+	return true;
+}
+#endif
+
+// This function is heavily inspired by Xapian Omega's stdout_to_string()
+bool ExternalFilter::run_command(const string &command, ssize_t maxSize)
+{
 #ifndef LIMIT_EXTERNAL_PROGRAMS
+	string commandLine(build_command_line(command, m_filePath));
+
 	// Create a temporary file for the program's output
 	char outTemplate[18] = "/tmp/filterXXXXXX";
 #ifdef HAVE_MKSTEMP
@@ -403,6 +942,14 @@ bool ExternalFilter::run_command(const string &command, ssize_t maxSize)
 		return false;
 	}
 
+	if (maxSize > 0)
+	{
+		stringstream limitStream;
+
+		// Don't let the program write more than will be read, in 512 bytes blocks
+		limitStream << "ulimit -f " << (maxSize / 512) + 1 << "; ";
+		commandLine.insert(0, limitStream.str());
+	}
 	commandLine += ">";
 	commandLine += outTemplate;
 #ifdef DEBUG
@@ -410,16 +957,19 @@ bool ExternalFilter::run_command(const string &command, ssize_t maxSize)
 #endif
 
 	// Run the command
-	if (system(commandLine.c_str()) == -1)
+	int status = system(commandLine.c_str());
+	if (status == -1)
 	{
 #ifdef DEBUG
 		cout << "ExternalFilter::run_command: couldn't run command line" << endl;
 #endif
+		close(outFd);
+		unlink(outTemplate);
 		return false;
 	}
 
 	ssize_t totalSize = 0;
-	gotOutput = read_file(outFd, maxSize, totalSize);
+	bool gotOutput = read_file(outFd, maxSize, totalSize);
 
 	// Close and delete the temporary file
 	close(outFd);
@@ -430,90 +980,244 @@ bool ExternalFilter::run_command(const string &command, ssize_t maxSize)
 		return false;
 	}
 #else
-	int status = 0;
+	if (start_command(command, maxSize) == false)
+	{
+		return false;
+	}
+
+	m_gotOutput = read_file(m_outFd, m_maxOutputSize, m_outputSize, m_deadline);
+
+	return finish_command();
+#endif
+
+	return true;
+}
+
+#ifdef LIMIT_EXTERNAL_PROGRAMS
+bool ExternalFilter::start_command(const string &command, ssize_t maxSize)
+{
+	if (m_cancelled == true)
+	{
+		return false;
+	}
 
 	// We want to be able to get the exit status of the child process
 	signal(SIGCHLD, SIG_DFL);
 
 	int fds[2];
+#ifdef SOCK_CLOEXEC
+	if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, PF_UNSPEC, fds) < 0)
+	{
+		return false;
+	}
+#else
 	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, fds) < 0)
 	{
 		return false;
 	}
-
-#ifdef DEBUG
-	cout << "ExternalFilter::run_command: running " << commandLine << endl;
+	// The child only gets the descriptor it is given as stdout
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
 #endif
-	// Fork and execute the command
-	pid_t childPid = fork();
-	if (childPid == 0)
-	{
-		// Child process
-		// Close the parent's side of the socket pair
-		close(fds[0]);
-
-		// Connect stdout to our side of the socket pair
-		dup2(fds[1], 1);
-		// Close stderr
-		close(2);
 
-		// Limit CPU time for external programs to 300 seconds
-		struct rlimit cpu_limit = { 300, RLIM_INFINITY } ;
-		setrlimit(RLIMIT_CPU, &cpu_limit);
+#ifdef SO_RCVBUF
+	// Let the program write large chunks before it has to wait for us
+	int bufferSize = 1048576;
+	setsockopt(fds[0], SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+	setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+#endif
 
-		execl("/bin/sh", "/bin/sh", "-c", commandLine.c_str(), (void*)NULL);
-		exit(-1);
+	// Wall-clock time the command may take
+	m_deadline = 0;
+	if (m_pTypeConfiguration->m_timeout > 0)
+	{
+		m_deadline = time(NULL) + m_pTypeConfiguration->m_timeout;
 	}
 
-	// Parent process
+	m_childPid = spawn_command(command, fds[1]);
+
 	// Close the child's side of the socket pair
 	close(fds[1]);
-	if (childPid == -1)
+	if (m_childPid == -1)
 	{
-		// The fork failed
 		close(fds[0]);
 		return false;
 	}
 
-	ssize_t totalSize = 0;
-	gotOutput = read_file(fds[0], maxSize, totalSize);
+	// Reading mustn't block when the output is polled along with others'
+	int fdFlags = fcntl(fds[0], F_GETFL);
+	if (fdFlags != -1)
+	{
+		fcntl(fds[0], F_SETFL, fdFlags|O_NONBLOCK);
+	}
 
-	// Close our side of the socket pair
-	close(fds[0]);
+	m_command = command;
+	m_outFd = fds[0];
+	m_maxOutputSize = maxSize;
+	m_outputSize = 0;
+	m_gotOutput = true;
+
+	return true;
+}
+
+bool ExternalFilter::continue_command(void)
+{
+	char readBuffer[CONTINUE_READ_SIZE];
+	ssize_t startSize = m_outputSize;
 
-	// Wait until the child terminates
-	pid_t actualChildPid = waitpid(childPid, &status, 0);
-	if ((gotOutput == false) ||
-		(actualChildPid == -1))
+	if (m_outFd == -1)
 	{
 		return false;
 	}
 
-	if (status != 0)
+	// Don't hog the caller if the command writes faster than we read
+	while ((size_t)(m_outputSize - startSize) < CONTINUE_MAX_SIZE)
 	{
-		if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+		if ((m_cancelled == true) ||
+			((m_deadline > 0) && (time(NULL) >= m_deadline)))
 		{
 #ifdef DEBUG
-			cout << "ExternalFilter::run_command: couldn't run " << command << endl;
+			cout << "ExternalFilter::continue_command: stopping " << m_command << endl;
 #endif
+			m_gotOutput = false;
 			return false;
 		}
+
+		ssize_t bytesRead = read_chunk(m_outFd, readBuffer, CONTINUE_READ_SIZE,
+			m_maxOutputSize, m_outputSize);
+		if (bytesRead == 0)
+		{
+			// End of file, or enough output
+			return false;
+		}
+		else if (bytesRead < 0)
+		{
+			if ((errno == EAGAIN) ||
+				(errno == EWOULDBLOCK))
+			{
+				// Nothing more for now
+				break;
+			}
+			else if (errno != EINTR)
+			{
+				m_gotOutput = false;
+				return false;
+			}
+		}
 	}
-#ifdef SIGXCPU
-	if (WIFSIGNALED(status) && WTERMSIG(status) == SIGXCPU)
+
+	return true;
+}
+
+bool ExternalFilter::finish_command(void)
+{
+	bool ranCommand = false;
+
+	if (m_childPid == -1)
+	{
+		return false;
+	}
+
+	stop_command();
+	reap_command(true, ranCommand);
+
+	return end_command(ranCommand);
+}
+
+void ExternalFilter::stop_command(void)
+{
+	if ((m_childPid == -1) ||
+		(m_outFd == -1))
+	{
+		return;
+	}
+
+	if (m_gotOutput == false)
+	{
+		// Timed out, cancelled or failed, don't wait for it to finish
+		kill(-m_childPid, SIGKILL);
+	}
+	else if ((m_maxOutputSize > 0) &&
+		(m_outputSize >= m_maxOutputSize))
 	{
 #ifdef DEBUG
-		cout << "ExternalFilter::run_command: " << command << " consumed too much CPU" << endl;
+		cout << "ExternalFilter::finish_command: stopping " << m_command << " at " << m_outputSize << endl;
 #endif
+		// That's all the output we want, don't let it convert the rest
+		kill(-m_childPid, SIGKILL);
+	}
+
+	// Close our side of the socket pair
+	close(m_outFd);
+	m_outFd = -1;
+}
+
+bool ExternalFilter::reap_command(bool wait, bool &ranCommand)
+{
+	pid_t actualChildPid = 0;
+	int status = 0;
+
+	if (m_childPid == -1)
+	{
+		ranCommand = false;
+		return true;
+	}
+
+	if (wait == false)
+	{
+		actualChildPid = waitpid(m_childPid, &status, WNOHANG);
+		if ((actualChildPid == 0) &&
+			(m_cancelled == false) &&
+			((m_deadline == 0) || (time(NULL) < m_deadline)))
+		{
+			// It's still running
+			return false;
+		}
+	}
+
+	if (actualChildPid == 0)
+	{
+		// This kills it if it's past the deadline or cancelled
+		ranCommand = wait_for_command(m_command, m_childPid, m_deadline);
+	}
+	else
+	{
+		ranCommand = ((actualChildPid != -1) &&
+			(check_command_status(m_command, status) == true));
+	}
+	m_childPid = -1;
+
+	return true;
+}
+
+bool ExternalFilter::end_command(bool ranCommand)
+{
+	if ((m_gotOutput == false) ||
+		(ranCommand == false))
+	{
 		return false;
 	}
-#endif
 
 	stringstream numStream;
-	numStream << totalSize;
+	numStream << m_outputSize;
 	m_metaData["size"] = numStream.str();
-#endif
 
 	return true;
 }
+#else
+bool ExternalFilter::start_command(const string &command, ssize_t maxSize)
+{
+	return false;
+}
+
+bool ExternalFilter::continue_command(void)
+{
+	return false;
+}
+
+bool ExternalFilter::finish_command(void)
+{
+	return false;
+}
+#endif
 
@@ -19,14 +19,19 @@
 #ifndef _DIJON_EXTERNALFILTER_H
 #define _DIJON_EXTERNALFILTER_H
 
+#include <sys/types.h>
+#include <pthread.h>
 #include <string>
 #include <set>
 #include <map>
+#include <vector>
 
 #include  "FileOutputFilter.h"
 
 namespace Dijon
 {
+    class ExternalFilterBatch;
+
     class ExternalFilter : public FileOutputFilter
     {
     public:
@@ -36,9 +41,17 @@ namespace Dijon
 	virtual ~ExternalFilter();
 
 
-	/// Parses the configuration file and initializes the class.
+	/** Parses the configuration file and initializes the class.
+	 * This may be called again to reload the configuration, which
+	 * filters built afterwards use while others keep the previous one.
+	 * That one is freed once no filter uses it. Nothing is replaced if
+	 * the configuration didn't change.
+	 */
 	static void initialize(const std::string &config_file, std::set<std::string> &types);
 
+	/// Frees all configurations. No filter may be left.
+	static void shutdown(void);
+
 
 	// Information.
 
@@ -100,16 +113,137 @@ namespace Dijon
 	virtual std::string get_error(void) const;
 
     protected:
-	static std::map<std::string, std::string> m_commandsByType;
-	static std::map<std::string, std::string> m_outputsByType;
-	static std::map<std::string, std::string> m_charsetsByType;
+	/// How documents of a type are converted. Limits are 0 if not set.
+	class TypeConfiguration
+	{
+	public:
+		TypeConfiguration();
+		~TypeConfiguration();
+
+		bool operator==(const TypeConfiguration &other) const;
+
+		std::string m_command;
+		std::string m_output;
+		std::string m_charset;
+		unsigned int m_maxProcesses;
+		unsigned int m_timeout;
+		unsigned int m_maxMemory;
+		unsigned int m_maxFileSize;
+
+	};
+
+	/// A configuration is never modified once it's in use.
+	typedef std::map<std::string, TypeConfiguration> Configuration;
+
+	static const Configuration *m_pConfiguration;
+	/// The current configuration and those filters still use, with how many do.
+	static std::map<const Configuration *, unsigned int> m_configurationUsers;
+	static pthread_mutex_t m_configurationMutex;
+	static std::map<std::string, unsigned int> m_processesByType;
+	static pthread_mutex_t m_processesMutex;
+	static pthread_cond_t m_processesCond;
+	const Configuration *m_pUsedConfiguration;
+	const TypeConfiguration *m_pTypeConfiguration;
 	off_t m_maxSize;
 	bool m_doneWithDocument;
+	std::string m_command;
+	int m_outFd;
+	pid_t m_childPid;
+	time_t m_deadline;
+	ssize_t m_maxOutputSize;
+	ssize_t m_outputSize;
+	bool m_gotOutput;
 
 	virtual void rewind(void);
 
+	/// Finds the command for this type.
+	bool find_command(std::string &command) const;
+
+	/// Sets the metadata of a document that was converted.
+	void set_document_meta_data(void);
+
 	bool run_command(const std::string &command, ssize_t maxSize);
 
+	/** Starts converting the document, without waiting for the command.
+	 * If the command's output has to be polled, m_outFd is set.
+	 * Returns false if the document can't be converted.
+	 */
+	bool start_document(void);
+
+	/** Finishes converting the document started with start_document().
+	 * Returns true if the filter is now positioned on the document.
+	 */
+	bool finish_document(void);
+
+	/** Stops reading the output of the document started with
+	 * start_document(), without waiting for the command.
+	 */
+	void stop_document(void);
+
+	/** Checks whether the command of the document stopped with
+	 * stop_document() terminated, without waiting for it unless it's
+	 * past the deadline or cancelled, in which case it's killed.
+	 * Returns false while it runs. Otherwise, succeeded is set to what
+	 * finish_document() would return.
+	 */
+	bool reap_document(bool &succeeded);
+
+	/** Starts the command, with m_outFd set to the non-blocking
+	 * descriptor its output can be read from.
+	 */
+	bool start_command(const std::string &command, ssize_t maxSize);
+
+	/** Reads the command's output that is available.
+	 * Returns false once there's nothing more to wait for.
+	 */
+	bool continue_command(void);
+
+	/** Waits for the command started with start_command() and checks
+	 * how it went, killing it first if its output wasn't all read or
+	 * reached the maximum size.
+	 */
+	bool finish_command(void);
+
+	/** Kills the command started with start_command() if its output
+	 * wasn't all read or reached the maximum size, and stops reading it.
+	 */
+	void stop_command(void);
+
+	/** Checks whether the command stopped with stop_command() terminated
+	 * and how it went, or waits for it if wait is true.
+	 * Returns false if it's still running.
+	 */
+	bool reap_command(bool wait, bool &ranCommand);
+
+	/// Checks how converting went, once the command was reaped.
+	bool end_command(bool ranCommand);
+
+	/** Waits until another process may be run for this type, or
+	 * if wait is false, returns false if one may not run now.
+	 */
+	bool acquire_process(bool wait = true);
+
+	/// Lets other processes run for this type.
+	void release_process(void);
+
+	/** Runs the command in its own process group, with its output going
+	 * to the given descriptor and this type's resource limits.
+	 * Returns -1 if the command couldn't be run.
+	 */
+	pid_t spawn_command(const std::string &command, int outFd);
+
+	/** Waits for the command to terminate and checks how it went.
+	 * The command's process group is killed if the deadline, if not 0,
+	 * passes or the filter is cancelled.
+	 */
+	bool wait_for_command(const std::string &command, pid_t childPid,
+		time_t deadline);
+
+	/// Checks the exit status of a command that terminated.
+	bool check_command_status(const std::string &command, int status);
+
+	friend class ExternalFilterBatch;
+
     private:
 	/// ExternalFilter objects cannot be copied.
 	ExternalFilter(const ExternalFilter &other);
@@ -0,0 +1,326 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <iostream>
+
+#include "ExternalFilterBatch.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::map;
+using std::deque;
+using std::vector;
+using std::pair;
+using std::make_pair;
+
+using namespace Dijon;
+
+// How often, in milliseconds, jobs that produce no output are checked
+static const int POLL_INTERVAL = 200;
+// How often, in milliseconds, commands that closed their output are checked
+static const int REAP_INTERVAL = 20;
+
+ExternalFilterBatch::ExternalFilterBatch(unsigned int max_processes) :
+	m_maxProcesses(max_processes)
+{
+	if (m_maxProcesses == 0)
+	{
+		m_maxProcesses = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+		// One per processor
+		long processorsCount = sysconf(_SC_NPROCESSORS_ONLN);
+		if (processorsCount > 0)
+		{
+			m_maxProcesses = (unsigned int)processorsCount;
+		}
+#endif
+	}
+}
+
+ExternalFilterBatch::~ExternalFilterBatch()
+{
+	cancel();
+}
+
+void ExternalFilterBatch::set_property(Filter::Properties prop_name, const string &prop_value)
+{
+	m_properties[prop_name] = prop_value;
+}
+
+ExternalFilter *ExternalFilterBatch::add_job(const string &file_path,
+	const string &mime_type)
+{
+	ExternalFilter *pFilter = new ExternalFilter(mime_type);
+
+	// Is this type supported ?
+	if (pFilter->m_pTypeConfiguration == NULL)
+	{
+		delete pFilter;
+		return NULL;
+	}
+
+	for (map<Filter::Properties, string>::const_iterator propIter = m_properties.begin();
+		propIter != m_properties.end(); ++propIter)
+	{
+		pFilter->set_property(propIter->first, propIter->second);
+	}
+	if (pFilter->set_document_file(file_path) == false)
+	{
+		delete pFilter;
+		return NULL;
+	}
+
+	m_queuedJobs.push_back(pFilter);
+
+	return pFilter;
+}
+
+bool ExternalFilterBatch::has_jobs(void) const
+{
+	if ((m_queuedJobs.empty() == true) &&
+		(m_runningJobs.empty() == true) &&
+		(m_lingeringJobs.empty() == true) &&
+		(m_completedJobs.empty() == true))
+	{
+		return false;
+	}
+
+	return true;
+}
+
+ExternalFilter *ExternalFilterBatch::get_result(bool &succeeded, int timeout)
+{
+	struct timeval startTime;
+	time_t lastCheckTime = time(NULL);
+
+	succeeded = false;
+	gettimeofday(&startTime, NULL);
+
+	while (m_completedJobs.empty() == true)
+	{
+		reap_jobs();
+		start_jobs();
+		if (m_completedJobs.empty() == false)
+		{
+			break;
+		}
+		if ((m_runningJobs.empty() == true) &&
+			(m_lingeringJobs.empty() == true) &&
+			(m_queuedJobs.empty() == true))
+		{
+			return NULL;
+		}
+
+		// Lingering commands can't be polled for
+		int pollTimeout = (m_lingeringJobs.empty() == true) ? POLL_INTERVAL : REAP_INTERVAL;
+		if (timeout >= 0)
+		{
+			struct timeval timeNow;
+
+			gettimeofday(&timeNow, NULL);
+			long elapsedTime = (timeNow.tv_sec - startTime.tv_sec) * 1000 +
+				(timeNow.tv_usec - startTime.tv_usec) / 1000;
+			if (elapsedTime >= (long)timeout)
+			{
+				return NULL;
+			}
+			if ((long)timeout - elapsedTime < (long)pollTimeout)
+			{
+				pollTimeout = (int)((long)timeout - elapsedTime);
+			}
+		}
+
+		// If all jobs wait for their type's processes, this only sleeps
+		vector<struct pollfd> pollFds(m_runningJobs.size());
+		for (vector<ExternalFilter *>::size_type jobNum = 0; jobNum < m_runningJobs.size(); ++jobNum)
+		{
+			pollFds[jobNum].fd = m_runningJobs[jobNum]->m_outFd;
+			pollFds[jobNum].events = POLLIN;
+			pollFds[jobNum].revents = 0;
+		}
+
+		int readyCount = poll((pollFds.empty() == true) ? NULL : &pollFds[0],
+			pollFds.size(), pollTimeout);
+		if ((readyCount == -1) &&
+			(errno != EINTR))
+		{
+#ifdef DEBUG
+			cout << "ExternalFilterBatch::get_result: poll failed" << endl;
+#endif
+			return NULL;
+		}
+
+		// Jobs that write nothing may still time out or be cancelled
+		time_t timeNow = time(NULL);
+		bool checkAll = ((readyCount == 0) || (timeNow != lastCheckTime));
+		lastCheckTime = timeNow;
+
+		vector<ExternalFilter *>::size_type jobNum = 0;
+		for (vector<ExternalFilter *>::size_type pollNum = 0; pollNum < pollFds.size(); ++pollNum)
+		{
+			if (((pollFds[pollNum].revents != 0) || (checkAll == true)) &&
+				(m_runningJobs[jobNum]->continue_command() == false))
+			{
+				complete_job(jobNum);
+				continue;
+			}
+
+			++jobNum;
+		}
+	}
+
+	pair<ExternalFilter *, bool> completedJob(m_completedJobs.front());
+	m_completedJobs.pop_front();
+	succeeded = completedJob.second;
+
+	return completedJob.first;
+}
+
+void ExternalFilterBatch::cancel(void)
+{
+	for (vector<ExternalFilter *>::iterator jobIter = m_runningJobs.begin();
+		jobIter != m_runningJobs.end(); ++jobIter)
+	{
+		ExternalFilter *pFilter = *jobIter;
+
+		pFilter->cancel();
+		pFilter->finish_document();
+		pFilter->release_process();
+		delete pFilter;
+	}
+	m_runningJobs.clear();
+
+	for (vector<ExternalFilter *>::iterator jobIter = m_lingeringJobs.begin();
+		jobIter != m_lingeringJobs.end(); ++jobIter)
+	{
+		ExternalFilter *pFilter = *jobIter;
+		bool succeeded = false;
+
+		// This kills the command
+		pFilter->cancel();
+		pFilter->reap_document(succeeded);
+		pFilter->release_process();
+		delete pFilter;
+	}
+	m_lingeringJobs.clear();
+
+	for (deque<ExternalFilter *>::iterator jobIter = m_queuedJobs.begin();
+		jobIter != m_queuedJobs.end(); ++jobIter)
+	{
+		delete *jobIter;
+	}
+	m_queuedJobs.clear();
+
+	for (deque<pair<ExternalFilter *, bool> >::iterator jobIter = m_completedJobs.begin();
+		jobIter != m_completedJobs.end(); ++jobIter)
+	{
+		delete jobIter->first;
+	}
+	m_completedJobs.clear();
+}
+
+void ExternalFilterBatch::start_jobs(void)
+{
+	deque<ExternalFilter *>::iterator jobIter = m_queuedJobs.begin();
+
+	while ((jobIter != m_queuedJobs.end()) &&
+		(m_runningJobs.size() + m_lingeringJobs.size() < m_maxProcesses))
+	{
+		ExternalFilter *pFilter = *jobIter;
+
+		// Leave the job queued if its type can't have another process now
+		if (pFilter->acquire_process(false) == false)
+		{
+			++jobIter;
+			continue;
+		}
+		jobIter = m_queuedJobs.erase(jobIter);
+
+		if (pFilter->start_document() == false)
+		{
+			pFilter->release_process();
+			m_completedJobs.push_back(make_pair(pFilter, false));
+		}
+		else if (pFilter->m_outFd == -1)
+		{
+			// The command couldn't be run in the background, and is done
+			bool succeeded = pFilter->finish_document();
+
+			pFilter->release_process();
+			m_completedJobs.push_back(make_pair(pFilter, succeeded));
+		}
+		else
+		{
+#ifdef DEBUG
+			cout << "ExternalFilterBatch::start_jobs: started " << pFilter->m_filePath << endl;
+#endif
+			m_runningJobs.push_back(pFilter);
+		}
+	}
+}
+
+void ExternalFilterBatch::complete_job(vector<ExternalFilter *>::size_type jobNum)
+{
+	ExternalFilter *pFilter = m_runningJobs[jobNum];
+	bool succeeded = false;
+
+	m_runningJobs.erase(m_runningJobs.begin() + jobNum);
+
+	// Don't wait for a command that closed its output but keeps running
+	pFilter->stop_document();
+	if (pFilter->reap_document(succeeded) == false)
+	{
+#ifdef DEBUG
+		cout << "ExternalFilterBatch::complete_job: " << pFilter->m_filePath << " lingers" << endl;
+#endif
+		m_lingeringJobs.push_back(pFilter);
+		return;
+	}
+
+	pFilter->release_process();
+	m_completedJobs.push_back(make_pair(pFilter, succeeded));
+}
+
+void ExternalFilterBatch::reap_jobs(void)
+{
+	vector<ExternalFilter *>::iterator jobIter = m_lingeringJobs.begin();
+
+	while (jobIter != m_lingeringJobs.end())
+	{
+		ExternalFilter *pFilter = *jobIter;
+		bool succeeded = false;
+
+		// This also kills commands that are past their deadline or cancelled
+		if (pFilter->reap_document(succeeded) == false)
+		{
+			++jobIter;
+			continue;
+		}
+		jobIter = m_lingeringJobs.erase(jobIter);
+
+		pFilter->release_process();
+		m_completedJobs.push_back(make_pair(pFilter, succeeded));
+	}
+}
@@ -0,0 +1,100 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DIJON_EXTERNALFILTERBATCH_H
+#define _DIJON_EXTERNALFILTERBATCH_H
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+
+#include "ExternalFilter.h"
+
+namespace Dijon
+{
+    /** Runs external filters on many files at once.
+     * Up to a given number of commands run concurrently, all from the
+     * calling thread, and results are handed back as commands complete.
+     * Each type's maximum number of processes is honoured.
+     */
+    class ExternalFilterBatch
+    {
+    public:
+	/** Builds an empty batch that runs up to max_processes commands
+	 * at once, or one per processor if 0.
+	 */
+	ExternalFilterBatch(unsigned int max_processes = 0);
+	/// Destroys the batch, killing commands that are still running.
+	virtual ~ExternalFilterBatch();
+
+	/// Sets a property on the filters of jobs added from now on.
+	void set_property(Filter::Properties prop_name, const std::string &prop_value);
+
+	/** Queues the file for conversion by the external filter of its type.
+	 * Returns the filter the result will be in, or NULL if the type
+	 * isn't supported. A content sink may be set on it before it runs.
+	 */
+	ExternalFilter *add_job(const std::string &file_path,
+		const std::string &mime_type);
+
+	/// Returns true if jobs haven't been handed back yet.
+	bool has_jobs(void) const;
+
+	/** Runs jobs until one completes or timeout milliseconds pass,
+	 * indefinitely if negative.
+	 * Returns the filter of the first job to complete, or NULL if none
+	 * did. It belongs to the caller from then on and, if succeeded is
+	 * true, it is positioned on the document as if next_document() had
+	 * been called.
+	 */
+	ExternalFilter *get_result(bool &succeeded, int timeout = -1);
+
+	/// Cancels all jobs that haven't been handed back and deletes their filters.
+	void cancel(void);
+
+    protected:
+	unsigned int m_maxProcesses;
+	std::map<Filter::Properties, std::string> m_properties;
+	std::deque<ExternalFilter *> m_queuedJobs;
+	std::vector<ExternalFilter *> m_runningJobs;
+	/// Jobs whose output was read but whose command hasn't terminated yet.
+	std::vector<ExternalFilter *> m_lingeringJobs;
+	std::deque<std::pair<ExternalFilter *, bool> > m_completedJobs;
+
+	/// Starts queued jobs while there are free slots.
+	void start_jobs(void);
+
+	/** Moves the running job to the completed ones, or to the lingering
+	 * ones if its command hasn't terminated yet.
+	 */
+	void complete_job(std::vector<ExternalFilter *>::size_type jobNum);
+
+	/// Moves lingering jobs whose command terminated to the completed ones.
+	void reap_jobs(void);
+
+    private:
+	/// ExternalFilterBatch objects cannot be copied.
+	ExternalFilterBatch(const ExternalFilterBatch &other);
+	/// ExternalFilterBatch objects cannot be copied.
+	ExternalFilterBatch& operator=(const ExternalFilterBatch& other);
+
+    };
+}
+
+#endif // _DIJON_EXTERNALFILTERBATCH_H
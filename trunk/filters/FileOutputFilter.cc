@@ -20,6 +20,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
 #include <errno.h>
 #include <iostream>
 
@@ -33,6 +35,12 @@ using std::endl;
 
 using namespace Dijon;
 
+// Reads start at this size and grow while the output keeps filling them
+static const size_t MIN_READ_SIZE = 65536;
+static const size_t MAX_READ_SIZE = 1048576;
+// How often, in milliseconds, waiting for output checks the deadline and cancellation
+static const int CANCEL_CHECK_INTERVAL = 200;
+
 FileOutputFilter::FileOutputFilter(const string &mime_type) :
 	Filter(mime_type)
 {
@@ -42,51 +50,171 @@ FileOutputFilter::~FileOutputFilter()
 {
 }
 
-bool FileOutputFilter::read_file(int fd, ssize_t maxSize, ssize_t &totalSize)
+bool FileOutputFilter::read_file(int fd, ssize_t maxSize, ssize_t &totalSize,
+	time_t deadline)
 {
 	struct stat fdStats;
+	char *pReadBuffer = NULL;
+	size_t readSize = MIN_READ_SIZE;
 	ssize_t bytesRead = 0;
 	bool gotOutput = true;
 
+	if ((fstat(fd, &fdStats) == 0) &&
+		(S_ISREG(fdStats.st_mode)) &&
+		(fdStats.st_size > 0))
+	{
+		off_t expectedSize = fdStats.st_size;
+
 #ifdef DEBUG
-	if (fstat(fd, &fdStats) == 0)
+		cout << "FileOutputFilter::read_file: file size " << fdStats.st_size << endl;
+#endif
+		if ((maxSize > 0) &&
+			(expectedSize > (off_t)maxSize))
+		{
+			expectedSize = (off_t)maxSize;
+		}
+
+		// The whole output is already there
+		if (expectedSize > (off_t)MAX_READ_SIZE)
+		{
+			readSize = MAX_READ_SIZE;
+		}
+		else if (expectedSize > (off_t)readSize)
+		{
+			readSize = (size_t)expectedSize;
+		}
+		if (is_content_streamed() == false)
+		{
+			m_content.reserve(m_content.length() + (dstring::size_type)expectedSize);
+		}
+	}
+
+	if (is_content_streamed() == true)
 	{
-		cout << "ExternalFilter::read_file: file size " << fdStats.st_size << endl;
+		// The sink gets what's read, a chunk at a time
+		readSize = MIN_READ_SIZE;
 	}
-#endif
+	pReadBuffer = new char[readSize];
 
-	do
+	while (true)
 	{
 		if ((maxSize > 0) &&
 			(totalSize >= maxSize))
 		{
 #ifdef DEBUG
-			cout << "ExternalFilter::read_file: stopping at " << totalSize << endl;
+			cout << "FileOutputFilter::read_file: stopping at " << totalSize << endl;
 #endif
 			break;
 		}
-
-		char readBuffer[4096];
-		bytesRead = read(fd, readBuffer, 4096);
-		if (bytesRead > 0)
+		if (m_cancelled == true)
 		{
-			m_content.append(readBuffer, bytesRead);
-			totalSize += bytesRead;
+#ifdef DEBUG
+			cout << "FileOutputFilter::read_file: cancelled at " << totalSize << endl;
+#endif
+			gotOutput = false;
+			break;
 		}
-		else if (bytesRead == -1)
+
+		// Wait for output, but not past the deadline
+		if (deadline > 0)
 		{
-			// An error occured
-			if (errno != EINTR)
+			time_t timeNow = time(NULL);
+
+			if (timeNow >= deadline)
 			{
+#ifdef DEBUG
+				cout << "FileOutputFilter::read_file: timed out at " << totalSize << endl;
+#endif
 				gotOutput = false;
 				break;
 			}
+		}
+
+		struct pollfd pollFd;
+		pollFd.fd = fd;
+		pollFd.events = POLLIN;
+		pollFd.revents = 0;
 
-			// Try again
-			bytesRead = 1;
+		int readyCount = poll(&pollFd, 1, CANCEL_CHECK_INTERVAL);
+		if (readyCount == 0)
+		{
+			continue;
 		}
-	} while (bytesRead > 0);
+		else if (readyCount == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			gotOutput = false;
+			break;
+		}
+
+		bytesRead = read_chunk(fd, pReadBuffer, readSize, maxSize, totalSize);
+		if (bytesRead > 0)
+		{
+			// Read more at once while there's plenty to read
+			if (((size_t)bytesRead == readSize) &&
+				(is_content_streamed() == false) &&
+				(readSize < MAX_READ_SIZE))
+			{
+				readSize *= 2;
+				delete[] pReadBuffer;
+				pReadBuffer = new char[readSize];
+			}
+		}
+		else if (bytesRead == 0)
+		{
+			// End of file
+			break;
+		}
+		else if ((errno != EINTR) &&
+			(errno != EAGAIN))
+		{
+			// An error occured
+			gotOutput = false;
+			break;
+		}
+	}
+
+	delete[] pReadBuffer;
+	if (m_cancelled == true)
+	{
+		gotOutput = false;
+	}
 
 	return gotOutput;
 }
 
+ssize_t FileOutputFilter::read_chunk(int fd, char *pReadBuffer, size_t readSize,
+	ssize_t maxSize, ssize_t &totalSize)
+{
+	size_t wantedSize = readSize;
+	ssize_t bytesRead = 0;
+
+	if (maxSize > 0)
+	{
+		if (totalSize >= maxSize)
+		{
+			return 0;
+		}
+		if ((ssize_t)wantedSize > maxSize - totalSize)
+		{
+			wantedSize = (size_t)(maxSize - totalSize);
+		}
+	}
+
+	bytesRead = read(fd, pReadBuffer, wantedSize);
+	if (bytesRead > 0)
+	{
+		totalSize += bytesRead;
+		if (append_content(pReadBuffer, bytesRead) == false)
+		{
+			// The sink doesn't want any more
+			return 0;
+		}
+	}
+
+	return bytesRead;
+}
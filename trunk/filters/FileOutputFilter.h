@@ -19,6 +19,8 @@
 #ifndef _DIJON_FILEOUTPUTFILTER_H
 #define _DIJON_FILEOUTPUTFILTER_H
 
+#include <time.h>
+
 #include "Filter.h"
 
 namespace Dijon
@@ -32,7 +34,21 @@ namespace Dijon
 	virtual ~FileOutputFilter();
 
     protected:
-	bool read_file(int fd, ssize_t maxSize, ssize_t &totalSize);
+	/** Reads from the descriptor until the end of file, maxSize bytes
+	 * if not 0, the deadline if not 0, or cancellation.
+	 * Returns false on errors, time-outs and cancellation.
+	 */
+	bool read_file(int fd, ssize_t maxSize, ssize_t &totalSize,
+		time_t deadline = 0);
+
+	/** Reads once from the descriptor into pReadBuffer, up to readSize
+	 * bytes and maxSize bytes in total if not 0, and appends that to the
+	 * content or passes it on to the sink.
+	 * Returns what read() returns, or 0 once maxSize is reached or the
+	 * sink doesn't accept more.
+	 */
+	ssize_t read_chunk(int fd, char *pReadBuffer, size_t readSize,
+		ssize_t maxSize, ssize_t &totalSize);
 
     };
 }
@@ -16,10 +16,17 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include "config.h"
 #include <stdlib.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <iostream>
 
 #include "Filter.h"
@@ -32,14 +39,32 @@ using std::endl;
 
 using namespace Dijon;
 
+// Content buffers larger than this aren't kept by reset()
+static const string::size_type MAX_KEPT_CONTENT = 1024 * 1024;
+
+ContentSink::ContentSink()
+{
+}
+
+ContentSink::~ContentSink()
+{
+}
+
 Filter::Filter(const string &mime_type) :
 	m_mimeType(mime_type),
+	m_pContentSink(NULL),
+	m_abortedContent(false),
+	m_cancelled(false),
+	m_copiedSize(0),
+	m_pMappedFile(NULL),
+	m_mappedLength(0),
 	m_deleteInputFile(false)
 {
 }
 
 Filter::~Filter()
 {
+	unmap_file();
 	deleteInputFile();
 }
 
@@ -57,6 +82,11 @@ bool Filter::set_document_file(const string &file_path, bool unlink_when_done)
 	return true;
 }
 
+void Filter::set_content_sink(ContentSink *pSink)
+{
+	m_pContentSink = pSink;
+}
+
 string Filter::get_mime_type(void) const
 {
 	return m_mimeType;
@@ -72,15 +102,183 @@ const dstring &Filter::get_content(void) const
 	return m_content;
 }
 
+bool Filter::is_content_aborted(void) const
+{
+	return m_abortedContent;
+}
+
+off_t Filter::get_copied_size(void) const
+{
+	return m_copiedSize;
+}
+
+void Filter::cancel(void)
+{
+	m_cancelled = true;
+}
+
+bool Filter::reset(void)
+{
+	rewind();
+	m_pContentSink = NULL;
+
+	// clear() keeps the buffer, unless it's too large to hang on to
+	if (m_content.capacity() > MAX_KEPT_CONTENT)
+	{
+		dstring emptyContent;
+
+		m_content.swap(emptyContent);
+	}
+
+	return true;
+}
+
 void Filter::rewind(void)
 {
 	m_metaData.clear();
 	m_content.clear();
+	m_abortedContent = false;
+	m_cancelled = false;
+	m_copiedSize = 0;
+	unmap_file();
 	deleteInputFile();
 	m_filePath.clear();
 	m_deleteInputFile = false;
 }
 
+bool Filter::is_content_streamed(void) const
+{
+	if (m_pContentSink == NULL)
+	{
+		return false;
+	}
+
+	// Other types are for the client application to filter again
+	map<string, string>::const_iterator typeIter = m_metaData.find("mimetype");
+	if ((typeIter != m_metaData.end()) &&
+		(typeIter->second == "text/plain"))
+	{
+		return true;
+	}
+
+	return false;
+}
+
+bool Filter::append_content(const char *data_ptr, unsigned int data_length)
+{
+	if ((m_abortedContent == true) ||
+		(m_cancelled == true))
+	{
+		return false;
+	}
+	if ((data_ptr == NULL) ||
+		(data_length == 0))
+	{
+		return true;
+	}
+
+	if (is_content_streamed() == false)
+	{
+		m_content.append(data_ptr, data_length);
+
+		return true;
+	}
+
+	if (m_pContentSink->write(data_ptr, data_length) == false)
+	{
+#ifdef DEBUG
+		cout << "Filter::append_content: sink stopped extraction" << endl;
+#endif
+		m_abortedContent = true;
+
+		return false;
+	}
+
+	return true;
+}
+
+bool Filter::map_file(void)
+{
+#ifdef HAVE_MMAP
+	struct stat fileStat;
+	int openFlags = O_RDONLY;
+
+	if (m_filePath.empty() == true)
+	{
+		return false;
+	}
+	unmap_file();
+
+#ifdef O_CLOEXEC
+	openFlags |= O_CLOEXEC;
+#endif
+#ifdef O_NOATIME
+	int fd = open(m_filePath.c_str(), openFlags|O_NOATIME);
+	if ((fd < 0) &&
+		(errno == EPERM))
+	{
+		// Try again
+		fd = open(m_filePath.c_str(), openFlags);
+	}
+#else
+	int fd = open(m_filePath.c_str(), openFlags);
+#endif
+	if (fd < 0)
+	{
+#ifdef DEBUG
+		cout << "Filter::map_file: couldn't open " << m_filePath << endl;
+#endif
+		return false;
+	}
+
+	if ((fstat(fd, &fileStat) != 0) ||
+		(!S_ISREG(fileStat.st_mode)) ||
+		(fileStat.st_size == 0) ||
+		(fileStat.st_size > (off_t)UINT_MAX))
+	{
+		close(fd);
+		return false;
+	}
+
+	// Pages are shared with other processes that map the same file
+	void *pMapping = mmap(NULL, (size_t)fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping remains valid after the descriptor is closed
+	close(fd);
+	if (pMapping == MAP_FAILED)
+	{
+#ifdef DEBUG
+		cout << "Filter::map_file: couldn't map " << m_filePath << endl;
+#endif
+		return false;
+	}
+#ifdef MADV_SEQUENTIAL
+	madvise(pMapping, (size_t)fileStat.st_size, MADV_SEQUENTIAL);
+#endif
+
+	m_pMappedFile = static_cast<const char*>(pMapping);
+	m_mappedLength = (unsigned int)fileStat.st_size;
+#ifdef DEBUG
+	cout << "Filter::map_file: mapped " << m_mappedLength << " bytes of " << m_filePath << endl;
+#endif
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void Filter::unmap_file(void)
+{
+#ifdef HAVE_MMAP
+	if (m_pMappedFile != NULL)
+	{
+		munmap(const_cast<char*>(m_pMappedFile), (size_t)m_mappedLength);
+	}
+#endif
+	m_pMappedFile = NULL;
+	m_mappedLength = 0;
+}
+
 void Filter::deleteInputFile(void)
 {
 	if ((m_deleteInputFile == true) &&
@@ -19,6 +19,7 @@
 #ifndef _DIJON_FILTER_H
 #define _DIJON_FILTER_H
 
+#include <sys/types.h>
 #include <string>
 #include <set>
 #include <map>
@@ -53,6 +54,12 @@ namespace Dijon
      * it should load documents or not.
      */
     typedef bool (check_filter_data_input_func)(int);
+    /** Lists files that the filter(s) read their configuration from.
+     * This function may be exported by dynamically loaded filter libraries,
+     * so that the client application can tell when their configuration
+     * changed without loading them.
+     */
+    typedef bool (get_filter_dependencies_func)(std::set<std::string> &);
     /** Returns a Filter that handles the given MIME type.
      * The Filter object is allocated with new.
      * This function is exported by dynamically loaded filter libraries
@@ -66,6 +73,31 @@ namespace Dijon
     typedef std::string (convert_to_utf8_func)(const char *,
         unsigned int, const std::string &);
 
+    /// Interface for receiving content as it is extracted.
+    class DIJON_FILTER_EXPORT ContentSink
+    {
+    public:
+	/// Builds a sink.
+	ContentSink();
+	/// Destroys the sink.
+	virtual ~ContentSink();
+
+	/** Receives the next chunk of the current document's content.
+	 * The data pointer is only valid for the duration of the call.
+	 * Blocking in this method holds the filter back until the client
+	 * application is ready for more content.
+	 * Returns false to stop extraction of the current document.
+	 */
+	virtual bool write(const char *data_ptr, unsigned int data_length) = 0;
+
+    private:
+	/// ContentSink objects cannot be copied.
+	ContentSink(const ContentSink &other);
+	/// ContentSink objects cannot be copied.
+	ContentSink& operator=(const ContentSink& other);
+
+    };
+
     /// Filter interface.
     class DIJON_FILTER_EXPORT Filter
     {
@@ -86,10 +118,16 @@ namespace Dijon
 	/** Input properties supported by the filter.
 	 * - PREFERRED_CHARSET is the charset preferred by the client application.
 	 * The filter will convert document's content to this charset if possible.
-	 * - OPERATING_MODE can be set to either view or index.
+	 * - OPERATING_MODE can be set to either view, index or metadata.
+	 * In metadata mode, filters may return documents without content.
 	 * - MAXIMUM_NESTED_SIZE is the maximum size in bytes of nested documents.
+	 * - INDEX_DIRECTORY is a directory where filters may keep indexes
+	 * of the nested documents found in files, to speed up later passes.
+	 * - MAXIMUM_THREADS is how many threads a filter may use to extract
+	 * nested documents. Documents are still returned in order.
 	 */
-	typedef enum { PREFERRED_CHARSET = 0, OPERATING_MODE, MAXIMUM_NESTED_SIZE } Properties;
+	typedef enum { PREFERRED_CHARSET = 0, OPERATING_MODE, MAXIMUM_NESTED_SIZE, INDEX_DIRECTORY,
+		MAXIMUM_THREADS } Properties;
 
 
 	// Information.
@@ -108,6 +146,19 @@ namespace Dijon
 	 */
 	virtual bool set_property(Properties prop_name, const std::string &prop_value) = 0;
 
+	/** Sets the object content is pushed to, prior to calling set_document_XXX().
+	 * Content is then passed to the sink as it is extracted and
+	 * get_content() remains empty. Chunks may be pushed while either
+	 * set_document_XXX() or next_document() runs, and they belong to
+	 * the document next_document() moves onto.
+	 * Only text/plain content is pushed. Filters set the document's
+	 * mimetype before any of its content is extracted, and content of
+	 * any other type, eg HTML output by a converter or an archive member
+	 * that should be filtered again, is kept in get_content() as usual.
+	 * The sink isn't owned by the filter. Pass NULL to reset.
+	 */
+	void set_content_sink(ContentSink *pSink);
+
 	/** (Re)initializes the filter with the given data.
 	 * Caller should ensure the given pointer is valid until the
 	 * Filter object is destroyed, as some filters may not need to
@@ -180,6 +231,33 @@ namespace Dijon
 	/// Returns content.
 	const dstring &get_content(void) const;
 
+	/// Returns true if the content sink stopped extraction of the current document.
+	bool is_content_aborted(void) const;
+
+	/** Returns how many bytes of input were copied to extract the current
+	 * document. Input that is parsed in place or mapped isn't counted.
+	 */
+	off_t get_copied_size(void) const;
+
+
+	// Cancellation.
+
+	/** Asks the filter to give up on the current document as soon as it can.
+	 * This may be called from another thread. The document's extraction
+	 * then fails, and the next call to set_document_XXX() resets this.
+	 */
+	virtual void cancel(void);
+
+
+	// Reuse.
+
+	/** Releases the current document and the content sink, so that
+	 * the filter may be given another document. Properties are kept,
+	 * and so are buffers unless they grew large.
+	 * Returns false if the filter can't be reused.
+	 */
+	virtual bool reset(void);
+
     protected:
 	/// The MIME type handled by the filter.
 	std::string m_mimeType;
@@ -189,10 +267,40 @@ namespace Dijon
 	dstring m_content;
 	/// The name of the input file, if any.
 	std::string m_filePath;
+	/// The content sink, if any.
+	ContentSink *m_pContentSink;
+	/// Whether the sink stopped extraction.
+	bool m_abortedContent;
+	/// Whether cancel() was called.
+	volatile bool m_cancelled;
+	/// How many bytes of input were copied.
+	off_t m_copiedSize;
+	/// The input file's contents, if it was mapped.
+	const char *m_pMappedFile;
+	/// The size of the mapped input file.
+	unsigned int m_mappedLength;
 
 	/// Rewinds the filter.
 	virtual void rewind(void);
 
+	/// Returns true if content is passed on to the sink rather than kept.
+	bool is_content_streamed(void) const;
+
+	/** Appends to content, or passes it on to the sink if the
+	 * document's mimetype is text/plain.
+	 * Returns false if extraction should stop, or was cancelled.
+	 */
+	bool append_content(const char *data_ptr, unsigned int data_length);
+
+	/** Maps the input file in memory, read-only and for sequential access.
+	 * The mapping is released when the filter is rewound.
+	 * Returns false if the file couldn't be mapped.
+	 */
+	bool map_file(void);
+
+	/// Releases the input file's mapping, if any.
+	void unmap_file(void);
+
     private:
 	/// Whether the input file should be deleted when done.
 	bool m_deleteInputFile;
@@ -0,0 +1,720 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <utime.h>
+#include <time.h>
+#include <sstream>
+#include <algorithm>
+#include <iostream>
+
+#include "FilterCache.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::stringstream;
+using std::map;
+using std::vector;
+using std::pair;
+using std::make_pair;
+using std::sort;
+
+using namespace Dijon;
+
+// Entries start with this, in the byte order of the machine that wrote them
+static const unsigned int ENTRY_MAGIC = 0x444a4331;
+static const unsigned int ENTRY_FORMAT = 1;
+// When the cache is full, evict entries until it's this much of its maximum size
+static const unsigned int EVICTION_PERCENT = 90;
+// Entries may not take more than this fraction of the cache
+static const unsigned int MAX_ENTRY_FRACTION = 16;
+// Left-over temporary files older than this are removed, in seconds
+static const time_t STALE_TEMP_AGE = 86400;
+
+// Nanoseconds of modification and change times, where stat has them
+#if defined(__APPLE__)
+#define STAT_MTIME_NSEC(fileStat) (fileStat).st_mtimespec.tv_nsec
+#define STAT_CTIME_NSEC(fileStat) (fileStat).st_ctimespec.tv_nsec
+#elif defined(st_mtime)
+#define STAT_MTIME_NSEC(fileStat) (fileStat).st_mtim.tv_nsec
+#define STAT_CTIME_NSEC(fileStat) (fileStat).st_ctim.tv_nsec
+#else
+#define STAT_MTIME_NSEC(fileStat) 0
+#define STAT_CTIME_NSEC(fileStat) 0
+#endif
+
+static const unsigned long long FNV_OFFSET_BASIS = 14695981039346656037ULL;
+static const unsigned long long FNV_PRIME = 1099511628211ULL;
+
+static unsigned long long hash_data(unsigned long long hash,
+	const char *data_ptr, size_t data_length)
+{
+	for (size_t pos = 0; pos < data_length; ++pos)
+	{
+		hash ^= (unsigned char)data_ptr[pos];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static bool hash_file(int fd, unsigned long long &hash)
+{
+	char readBuffer[65536];
+	ssize_t bytesRead = 0;
+
+	hash = FNV_OFFSET_BASIS;
+	do
+	{
+		bytesRead = read(fd, readBuffer, sizeof(readBuffer));
+		if (bytesRead > 0)
+		{
+			hash = hash_data(hash, readBuffer, (size_t)bytesRead);
+		}
+		else if ((bytesRead == -1) &&
+			(errno != EINTR))
+		{
+			return false;
+		}
+	} while (bytesRead != 0);
+
+	return true;
+}
+
+// Entry names are 16 hexadecimal digits
+static bool is_entry_name(const char *pName)
+{
+	if (strlen(pName) != 16)
+	{
+		return false;
+	}
+
+	return (strspn(pName, "0123456789abcdef") == 16);
+}
+
+// Reads a field from the mapped entry, checking it's all there
+static bool read_field(const char *&pos, const char *end, void *field_ptr,
+	size_t field_length)
+{
+	if ((size_t)(end - pos) < field_length)
+	{
+		return false;
+	}
+
+	memcpy(field_ptr, pos, field_length);
+	pos += field_length;
+
+	return true;
+}
+
+static bool read_string(const char *&pos, const char *end, string &str)
+{
+	unsigned int length = 0;
+
+	if ((read_field(pos, end, &length, sizeof(length)) == false) ||
+		((size_t)(end - pos) < (size_t)length))
+	{
+		return false;
+	}
+
+	str.assign(pos, length);
+	pos += length;
+
+	return true;
+}
+
+FilterCacheEntry::FilterCacheEntry() :
+	m_pMapping(NULL),
+	m_mappingLength(0)
+{
+}
+
+FilterCacheEntry::~FilterCacheEntry()
+{
+	release();
+}
+
+unsigned int FilterCacheEntry::get_documents_count(void) const
+{
+	return (unsigned int)m_metaData.size();
+}
+
+const map<string, string> &FilterCacheEntry::get_meta_data(unsigned int doc_num) const
+{
+	return m_metaData[doc_num];
+}
+
+const char *FilterCacheEntry::get_content(unsigned int doc_num, unsigned int &content_length) const
+{
+	content_length = m_contentLengths[doc_num];
+
+	return m_contents[doc_num];
+}
+
+void FilterCacheEntry::release(void)
+{
+#ifdef HAVE_MMAP
+	if (m_pMapping != NULL)
+	{
+		munmap(m_pMapping, m_mappingLength);
+	}
+#endif
+	m_pMapping = NULL;
+	m_mappingLength = 0;
+	m_metaData.clear();
+	m_contents.clear();
+	m_contentLengths.clear();
+}
+
+FilterCache::PendingEntry::PendingEntry() :
+	m_fd(-1),
+	m_size(0),
+	m_documentsCount(0),
+	m_contentLengthOffset(0),
+	m_failed(false)
+{
+}
+
+FilterCache::PendingEntry::~PendingEntry()
+{
+	if (m_fd != -1)
+	{
+		close(m_fd);
+		unlink(m_tempPath.c_str());
+	}
+}
+
+FilterCache::FilterCache(const string &dir_name, off_t max_size,
+	bool hash_contents) :
+	m_dirName(dir_name),
+	m_maxSize(max_size),
+	m_maxEntrySize(max_size / MAX_ENTRY_FRACTION),
+	m_hashContents(hash_contents),
+	m_isValid(false),
+	m_totalSize(0)
+{
+	struct stat dirStat;
+
+	pthread_mutex_init(&m_mutex, NULL);
+
+	if ((m_dirName.empty() == true) ||
+		(m_maxSize <= 0))
+	{
+		return;
+	}
+
+	if ((stat(m_dirName.c_str(), &dirStat) != 0) &&
+		(mkdir(m_dirName.c_str(), 0700) != 0))
+	{
+#ifdef DEBUG
+		cout << "FilterCache: couldn't create " << m_dirName << endl;
+#endif
+		return;
+	}
+	if ((stat(m_dirName.c_str(), &dirStat) != 0) ||
+		(!S_ISDIR(dirStat.st_mode)) ||
+		(access(m_dirName.c_str(), R_OK|W_OK|X_OK) != 0))
+	{
+		return;
+	}
+
+	m_isValid = true;
+
+	// How large is it already ?
+	scan_entries(false);
+}
+
+FilterCache::~FilterCache()
+{
+	pthread_mutex_destroy(&m_mutex);
+}
+
+bool FilterCache::is_valid(void) const
+{
+	return m_isValid;
+}
+
+bool FilterCache::get_key(const string &file_path, const string &mime_type,
+	const string &version, string &key) const
+{
+	struct stat fileStat;
+	stringstream keyStream;
+
+	if ((m_isValid == false) ||
+		(file_path.empty() == true))
+	{
+		return false;
+	}
+
+	if (m_hashContents == true)
+	{
+		unsigned long long hash = 0;
+
+		int fd = open(file_path.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			return false;
+		}
+		if ((fstat(fd, &fileStat) != 0) ||
+			(!S_ISREG(fileStat.st_mode)) ||
+			(hash_file(fd, hash) == false))
+		{
+			close(fd);
+			return false;
+		}
+		close(fd);
+
+		keyStream << "fnv:" << std::hex << hash << std::dec << ":" << fileStat.st_size;
+	}
+	else
+	{
+		if ((stat(file_path.c_str(), &fileStat) != 0) ||
+			(!S_ISREG(fileStat.st_mode)))
+		{
+			return false;
+		}
+
+		// Files rewritten within the same second only differ by nanoseconds
+		keyStream << "stat:" << fileStat.st_dev << ":" << fileStat.st_ino << ":"
+			<< fileStat.st_size << ":" << fileStat.st_mtime << "." << STAT_MTIME_NSEC(fileStat)
+			<< ":" << fileStat.st_ctime << "." << STAT_CTIME_NSEC(fileStat);
+	}
+	keyStream << "|" << mime_type << "|" << version;
+
+	key = keyStream.str();
+
+	return true;
+}
+
+bool FilterCache::load(const string &key, FilterCacheEntry &entry)
+{
+#ifdef HAVE_MMAP
+	struct stat entryStat;
+	string entryPath(get_entry_path(key));
+
+	entry.release();
+
+	if (m_isValid == false)
+	{
+		return false;
+	}
+
+	int fd = open(entryPath.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	if ((fstat(fd, &entryStat) != 0) ||
+		(entryStat.st_size == 0) ||
+		(entryStat.st_size > (off_t)UINT_MAX))
+	{
+		close(fd);
+		return false;
+	}
+
+	void *pMapping = mmap(NULL, (size_t)entryStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pMapping == MAP_FAILED)
+	{
+		return false;
+	}
+	entry.m_pMapping = pMapping;
+	entry.m_mappingLength = (size_t)entryStat.st_size;
+
+	const char *pos = static_cast<const char*>(pMapping);
+	const char *end = pos + entry.m_mappingLength;
+	unsigned int magic = 0, format = 0, documentsCount = 0;
+	string entryKey;
+	bool isValid = false;
+
+	if ((read_field(pos, end, &magic, sizeof(magic)) == true) &&
+		(magic == ENTRY_MAGIC) &&
+		(read_field(pos, end, &format, sizeof(format)) == true) &&
+		(format == ENTRY_FORMAT) &&
+		(read_string(pos, end, entryKey) == true) &&
+		(read_field(pos, end, &documentsCount, sizeof(documentsCount)) == true))
+	{
+		isValid = (entryKey == key);
+	}
+	for (unsigned int docNum = 0; (isValid == true) && (docNum < documentsCount); ++docNum)
+	{
+		unsigned long long contentLength = 0;
+		unsigned int metaDataCount = 0;
+
+		isValid = false;
+		if ((read_field(pos, end, &contentLength, sizeof(contentLength)) == false) ||
+			((unsigned long long)(end - pos) < contentLength))
+		{
+			break;
+		}
+		entry.m_contents.push_back(pos);
+		entry.m_contentLengths.push_back((unsigned int)contentLength);
+		pos += contentLength;
+
+		if (read_field(pos, end, &metaDataCount, sizeof(metaDataCount)) == false)
+		{
+			break;
+		}
+		entry.m_metaData.push_back(map<string, string>());
+
+		map<string, string> &metaData = entry.m_metaData.back();
+		unsigned int metaDataNum = 0;
+		for (; metaDataNum < metaDataCount; ++metaDataNum)
+		{
+			string name, value;
+
+			if ((read_string(pos, end, name) == false) ||
+				(read_string(pos, end, value) == false))
+			{
+				break;
+			}
+			metaData[name] = value;
+		}
+		isValid = (metaDataNum == metaDataCount);
+	}
+
+	if (isValid == false)
+	{
+#ifdef DEBUG
+		cout << "FilterCache::load: invalid entry " << entryPath << endl;
+#endif
+		entry.release();
+		// Collisions are as good as corrupted
+		unlink(entryPath.c_str());
+
+		return false;
+	}
+#ifdef MADV_SEQUENTIAL
+	madvise(pMapping, entry.m_mappingLength, MADV_SEQUENTIAL);
+#endif
+
+	// It was just used
+	utime(entryPath.c_str(), NULL);
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool FilterCache::start_entry(const string &key, PendingEntry &entry)
+{
+	if (m_isValid == false)
+	{
+		return false;
+	}
+
+	string tempPath(m_dirName);
+	tempPath += "/.tmpXXXXXX";
+
+	vector<char> tempTemplate(tempPath.begin(), tempPath.end());
+	tempTemplate.push_back('\0');
+
+	int fd = mkstemp(&tempTemplate[0]);
+	if (fd < 0)
+	{
+		return false;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	entry.m_key = key;
+	entry.m_tempPath = &tempTemplate[0];
+	entry.m_fd = fd;
+	entry.m_size = 0;
+	entry.m_documentsCount = 0;
+	entry.m_contentLengthOffset = 0;
+	entry.m_failed = false;
+
+	unsigned int keyLength = (unsigned int)key.length();
+	unsigned int documentsCount = 0;
+
+	if ((write_entry(entry, &ENTRY_MAGIC, sizeof(ENTRY_MAGIC)) == false) ||
+		(write_entry(entry, &ENTRY_FORMAT, sizeof(ENTRY_FORMAT)) == false) ||
+		(write_entry(entry, &keyLength, sizeof(keyLength)) == false) ||
+		(write_entry(entry, key.c_str(), key.length()) == false) ||
+		(write_entry(entry, &documentsCount, sizeof(documentsCount)) == false))
+	{
+		end_entry(entry, false);
+		return false;
+	}
+
+	return true;
+}
+
+bool FilterCache::add_content(PendingEntry &entry, const char *data_ptr, unsigned int data_length)
+{
+	if ((entry.m_failed == true) ||
+		(start_document(entry) == false))
+	{
+		return false;
+	}
+
+	return write_entry(entry, data_ptr, data_length);
+}
+
+bool FilterCache::end_document(PendingEntry &entry, const map<string, string> &meta_data)
+{
+	if ((entry.m_failed == true) ||
+		(start_document(entry) == false))
+	{
+		return false;
+	}
+
+	// Now that the content is all there, write its length
+	unsigned long long contentLength = (unsigned long long)(entry.m_size - entry.m_contentLengthOffset - sizeof(contentLength));
+	if (pwrite(entry.m_fd, &contentLength, sizeof(contentLength), entry.m_contentLengthOffset) != (ssize_t)sizeof(contentLength))
+	{
+		entry.m_failed = true;
+		return false;
+	}
+	entry.m_contentLengthOffset = 0;
+
+	unsigned int metaDataCount = (unsigned int)meta_data.size();
+	if (write_entry(entry, &metaDataCount, sizeof(metaDataCount)) == false)
+	{
+		return false;
+	}
+	for (map<string, string>::const_iterator metaIter = meta_data.begin();
+		metaIter != meta_data.end(); ++metaIter)
+	{
+		unsigned int nameLength = (unsigned int)metaIter->first.length();
+		unsigned int valueLength = (unsigned int)metaIter->second.length();
+
+		if ((write_entry(entry, &nameLength, sizeof(nameLength)) == false) ||
+			(write_entry(entry, metaIter->first.c_str(), nameLength) == false) ||
+			(write_entry(entry, &valueLength, sizeof(valueLength)) == false) ||
+			(write_entry(entry, metaIter->second.c_str(), valueLength) == false))
+		{
+			return false;
+		}
+	}
+	++entry.m_documentsCount;
+
+	return true;
+}
+
+void FilterCache::end_entry(PendingEntry &entry, bool commit)
+{
+	bool isComplete = false;
+
+	if (entry.m_fd == -1)
+	{
+		return;
+	}
+
+	if ((commit == true) &&
+		(entry.m_failed == false) &&
+		(entry.m_contentLengthOffset == 0) &&
+		(entry.m_documentsCount > 0))
+	{
+		// The documents count follows the key
+		off_t countOffset = (off_t)(sizeof(ENTRY_MAGIC) + sizeof(ENTRY_FORMAT) + sizeof(unsigned int) + entry.m_key.length());
+
+		if (pwrite(entry.m_fd, &entry.m_documentsCount, sizeof(entry.m_documentsCount), countOffset) == (ssize_t)sizeof(entry.m_documentsCount))
+		{
+			isComplete = true;
+		}
+	}
+	if (close(entry.m_fd) != 0)
+	{
+		isComplete = false;
+	}
+	entry.m_fd = -1;
+
+	if ((isComplete == false) ||
+		(rename(entry.m_tempPath.c_str(), get_entry_path(entry.m_key).c_str()) != 0))
+	{
+		// Discard it
+		unlink(entry.m_tempPath.c_str());
+		return;
+	}
+#ifdef DEBUG
+	cout << "FilterCache::end_entry: stored " << entry.m_documentsCount
+		<< " documents in " << entry.m_size << " bytes" << endl;
+#endif
+
+	if (pthread_mutex_lock(&m_mutex) == 0)
+	{
+		m_totalSize += entry.m_size;
+		if (m_totalSize > m_maxSize)
+		{
+			scan_entries(true);
+		}
+
+		pthread_mutex_unlock(&m_mutex);
+	}
+}
+
+string FilterCache::get_entry_path(const string &key) const
+{
+	unsigned long long hash = hash_data(FNV_OFFSET_BASIS, key.c_str(), key.length());
+	char entryName[17];
+
+	snprintf(entryName, 17, "%016llx", hash);
+
+	string entryPath(m_dirName);
+	entryPath += "/";
+	entryPath += entryName;
+
+	return entryPath;
+}
+
+bool FilterCache::write_entry(PendingEntry &entry, const void *data_ptr, size_t data_length)
+{
+	const char *pData = static_cast<const char*>(data_ptr);
+
+	if (entry.m_failed == true)
+	{
+		return false;
+	}
+	if (entry.m_size + (off_t)data_length > m_maxEntrySize)
+	{
+#ifdef DEBUG
+		cout << "FilterCache::write_entry: entry is too large" << endl;
+#endif
+		entry.m_failed = true;
+		return false;
+	}
+
+	while (data_length > 0)
+	{
+		ssize_t bytesWritten = write(entry.m_fd, pData, data_length);
+
+		if (bytesWritten < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			entry.m_failed = true;
+			return false;
+		}
+
+		pData += bytesWritten;
+		data_length -= (size_t)bytesWritten;
+		entry.m_size += bytesWritten;
+	}
+
+	return true;
+}
+
+bool FilterCache::start_document(PendingEntry &entry)
+{
+	if (entry.m_contentLengthOffset > 0)
+	{
+		// Already started
+		return true;
+	}
+
+	// The content's length is written when the document ends
+	unsigned long long contentLength = 0;
+	off_t contentLengthOffset = entry.m_size;
+
+	if (write_entry(entry, &contentLength, sizeof(contentLength)) == false)
+	{
+		return false;
+	}
+	entry.m_contentLengthOffset = contentLengthOffset;
+
+	return true;
+}
+
+void FilterCache::scan_entries(bool evict)
+{
+	vector<pair<time_t, pair<off_t, string> > > entries;
+	time_t timeNow = time(NULL);
+
+	DIR *pDir = opendir(m_dirName.c_str());
+	if (pDir == NULL)
+	{
+		return;
+	}
+
+	m_totalSize = 0;
+
+	struct dirent *pDirEntry = readdir(pDir);
+	while (pDirEntry != NULL)
+	{
+		struct stat entryStat;
+		string entryPath(m_dirName);
+
+		entryPath += "/";
+		entryPath += pDirEntry->d_name;
+
+		if (strncmp(pDirEntry->d_name, ".tmp", 4) == 0)
+		{
+			// Remove what crashed processes left behind
+			if ((stat(entryPath.c_str(), &entryStat) == 0) &&
+				(entryStat.st_mtime + STALE_TEMP_AGE < timeNow))
+			{
+				unlink(entryPath.c_str());
+			}
+		}
+		else if ((is_entry_name(pDirEntry->d_name) == true) &&
+			(stat(entryPath.c_str(), &entryStat) == 0) &&
+			(S_ISREG(entryStat.st_mode)))
+		{
+			m_totalSize += entryStat.st_size;
+			if (evict == true)
+			{
+				entries.push_back(make_pair(entryStat.st_mtime, make_pair(entryStat.st_size, entryPath)));
+			}
+		}
+
+		// Next entry
+		pDirEntry = readdir(pDir);
+	}
+	closedir(pDir);
+
+	if ((evict == false) ||
+		(m_totalSize <= m_maxSize))
+	{
+		return;
+	}
+
+	// Least recently used first
+	sort(entries.begin(), entries.end());
+
+	off_t targetSize = (m_maxSize / 100) * EVICTION_PERCENT;
+	for (vector<pair<time_t, pair<off_t, string> > >::const_iterator entryIter = entries.begin();
+		(entryIter != entries.end()) && (m_totalSize > targetSize); ++entryIter)
+	{
+		if (unlink(entryIter->second.second.c_str()) == 0)
+		{
+			m_totalSize -= entryIter->second.first;
+		}
+	}
+#ifdef DEBUG
+	cout << "FilterCache::scan_entries: evicted down to " << m_totalSize << " bytes" << endl;
+#endif
+}
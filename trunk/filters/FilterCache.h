@@ -0,0 +1,163 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DIJON_FILTERCACHE_H
+#define _DIJON_FILTERCACHE_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <string>
+#include <map>
+#include <vector>
+
+#include "Filter.h"
+
+namespace Dijon
+{
+    /// A cache entry, mapped in memory.
+    class DIJON_FILTER_EXPORT FilterCacheEntry
+    {
+    public:
+	/// Builds an empty entry.
+	FilterCacheEntry();
+	/// Destroys the entry.
+	virtual ~FilterCacheEntry();
+
+	/// Returns the number of documents in the entry.
+	unsigned int get_documents_count(void) const;
+
+	/// Returns the metadata of the given document.
+	const std::map<std::string, std::string> &get_meta_data(unsigned int doc_num) const;
+
+	/// Returns the content of the given document, valid until the entry is released.
+	const char *get_content(unsigned int doc_num, unsigned int &content_length) const;
+
+	/// Releases the entry.
+	void release(void);
+
+    protected:
+	void *m_pMapping;
+	size_t m_mappingLength;
+	std::vector<std::map<std::string, std::string> > m_metaData;
+	std::vector<const char *> m_contents;
+	std::vector<unsigned int> m_contentLengths;
+
+	friend class FilterCache;
+
+    private:
+	/// FilterCacheEntry objects cannot be copied.
+	FilterCacheEntry(const FilterCacheEntry &other);
+	/// FilterCacheEntry objects cannot be copied.
+	FilterCacheEntry& operator=(const FilterCacheEntry& other);
+
+    };
+
+    /** An on-disk cache of what filters extracted from files.
+     * Entries are keyed by the file's identity or contents, its type
+     * and the version of the filter. Each is stored in a file that is
+     * mapped when read, and the least recently used are evicted when
+     * the cache grows past its maximum size.
+     * The cache may be shared by several threads and processes.
+     */
+    class DIJON_FILTER_EXPORT FilterCache
+    {
+    public:
+	/** Builds a cache in the given directory, which is created if
+	 * necessary. If hash_contents is true, files are identified by
+	 * their contents rather than by device, inode, size and time.
+	 */
+	FilterCache(const std::string &dir_name, off_t max_size,
+		bool hash_contents = false);
+	/// Destroys the cache.
+	virtual ~FilterCache();
+
+	/// Returns true if the cache directory is usable.
+	bool is_valid(void) const;
+
+	/** Builds the key of the given file.
+	 * Returns false if the file can't be cached.
+	 */
+	bool get_key(const std::string &file_path, const std::string &mime_type,
+		const std::string &version, std::string &key) const;
+
+	/** Loads the entry with the given key.
+	 * Returns false if there's no such entry.
+	 */
+	bool load(const std::string &key, FilterCacheEntry &entry);
+
+	/// An entry being written.
+	class PendingEntry
+	{
+	public:
+		PendingEntry();
+		~PendingEntry();
+
+		std::string m_key;
+		std::string m_tempPath;
+		int m_fd;
+		off_t m_size;
+		unsigned int m_documentsCount;
+		off_t m_contentLengthOffset;
+		bool m_failed;
+
+	};
+
+	/** Starts writing an entry with the given key.
+	 * Returns false if it can't be written.
+	 */
+	bool start_entry(const std::string &key, PendingEntry &entry);
+
+	/** Adds content to the current document of the entry.
+	 * Returns false if the entry is too large to be cached.
+	 */
+	bool add_content(PendingEntry &entry, const char *data_ptr, unsigned int data_length);
+
+	/// Ends the current document of the entry with its metadata.
+	bool end_document(PendingEntry &entry, const std::map<std::string, std::string> &meta_data);
+
+	/// Completes the entry, or discards it if commit is false.
+	void end_entry(PendingEntry &entry, bool commit);
+
+    protected:
+	std::string m_dirName;
+	off_t m_maxSize;
+	off_t m_maxEntrySize;
+	bool m_hashContents;
+	bool m_isValid;
+	off_t m_totalSize;
+	pthread_mutex_t m_mutex;
+
+	std::string get_entry_path(const std::string &key) const;
+
+	bool write_entry(PendingEntry &entry, const void *data_ptr, size_t data_length);
+
+	bool start_document(PendingEntry &entry);
+
+	/// Scans the directory for entries and, if evict is true, removes the oldest.
+	void scan_entries(bool evict);
+
+    private:
+	/// FilterCache objects cannot be copied.
+	FilterCache(const FilterCache &other);
+	/// FilterCache objects cannot be copied.
+	FilterCache& operator=(const FilterCache& other);
+
+    };
+}
+
+#endif // _DIJON_FILTERCACHE_H
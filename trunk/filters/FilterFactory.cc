@@ -18,6 +18,7 @@
 
 #include "config.h"
 #include <ctype.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
@@ -28,10 +29,13 @@
 #include <dlfcn.h>
 #endif
 #include <algorithm>
+#include <sstream>
+#include <fstream>
 #include <iostream>
 
 #include "Filter.h"
 #include "TextFilter.h"
+#include "CachedFilter.h"
 #include "FilterFactory.h"
 
 #ifdef HAVE_DLFCN_H
@@ -44,18 +48,214 @@
 
 #define GETFILTERTYPESFUNC	"_Z16get_filter_typesRSt3setISsSt4lessISsESaISsEE"
 #define GETFILTERFUNC		"_Z10get_filterRKSs"
+#define CHECKFILTERDATAINPUTFUNC	"_Z23check_filter_data_inputi"
+#define GETFILTERDEPENDENCIESFUNC	"_Z23get_filter_dependenciesRSt3setISsSt4lessISsESaISsEE"
+
+// Snapshots are fully built before they are published
+#if defined __GNUC__ && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 7)))
+#define LOAD_SNAPSHOT(ptr) __atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+#define STORE_SNAPSHOT(ptr, value) __atomic_store_n(&(ptr), (value), __ATOMIC_RELEASE)
+#elif defined __GNUC__ && (__GNUC__ == 4) && (__GNUC_MINOR__ >= 1)
+#define LOAD_SNAPSHOT(ptr) (ptr)
+#define STORE_SNAPSHOT(ptr, value) { __sync_synchronize(); (ptr) = (value); }
+#else
+#define LOAD_SNAPSHOT(ptr) (ptr)
+#define STORE_SNAPSHOT(ptr, value) (ptr) = (value)
+#endif
 
 using std::cout;
 using std::cerr;
 using std::endl;
 using std::string;
+using std::stringstream;
+using std::ifstream;
+using std::ofstream;
 using std::set;
 using std::map;
+using std::vector;
 using std::copy;
 using namespace Dijon;
 
+static Filter *get_text_filter(const string &mime_type)
+{
+	return new TextFilter(mime_type);
+}
+
+#ifndef _DYNAMIC_DIJON_HTMLFILTER
+static Filter *get_html_filter(const string &mime_type)
+{
+	return new HtmlFilter(mime_type);
+}
+#endif
+
+#ifndef _DYNAMIC_DIJON_XMLFILTER
+static Filter *get_xml_filter(const string &mime_type)
+{
+	return new XmlFilter(mime_type);
+}
+#endif
+
+typedef struct
+{
+	const char *m_pMimeType;
+	get_filter_func *m_pGetFilter;
+} BuiltInType;
+
+// All built-in filters accept data, strings and file names
+static const BuiltInType g_builtInTypes[] = {
+	{ "text/plain", &get_text_filter },
+#ifndef _DYNAMIC_DIJON_HTMLFILTER
+	{ "text/html", &get_html_filter },
+#endif
+#ifndef _DYNAMIC_DIJON_XMLFILTER
+	{ "text/xml", &get_xml_filter },
+	{ "application/xml", &get_xml_filter },
+#endif
+	{ NULL, NULL }
+};
+static const unsigned int g_builtInDataInputs = (1 << Filter::DOCUMENT_DATA) |
+	(1 << Filter::DOCUMENT_STRING) | (1 << Filter::DOCUMENT_FILE_NAME);
+
+// The first line of manifests, which also describes their format
+static const char *MANIFEST_HEADER = "dijon-filters-manifest 2";
+
+// How many filters of a type each thread keeps for reuse, for the same properties
+static const vector<Filter *>::size_type POOLED_FILTERS_PER_TYPE = 4;
+
+// Filters are pooled by type and properties
+static string get_pool_key(const string &mime_type,
+	const map<Filter::Properties, string> &properties)
+{
+	string poolKey(mime_type);
+
+	// This is called for each filter acquired, so avoid streams
+	for (map<Filter::Properties, string>::const_iterator propIter = properties.begin();
+		propIter != properties.end(); ++propIter)
+	{
+		char propName[16];
+
+		snprintf(propName, 16, "|%d=", (int)propIter->first);
+		poolKey += propName;
+		poolKey += propIter->second;
+	}
+
+	return poolKey;
+}
+
+// Cached documents and manifests are only good for this build of the library,
+// and for this version of the files it reads its configuration from
+static string get_library_version(const string &file_name, const struct stat &fileStat,
+	const set<string> &dependencies)
+{
+	stringstream versionStream;
+
+	versionStream << file_name << ":" << fileStat.st_size << ":" << fileStat.st_mtime;
+	for (set<string>::const_iterator depIter = dependencies.begin();
+		depIter != dependencies.end(); ++depIter)
+	{
+		struct stat depStat;
+
+		versionStream << "|" << *depIter;
+		if (stat(depIter->c_str(), &depStat) == 0)
+		{
+			versionStream << ":" << depStat.st_size << ":" << depStat.st_mtime;
+		}
+	}
+
+	return versionStream.str();
+}
+
+// FNV-1a
+static unsigned int hash_type(const char *pType, string::size_type typeLength)
+{
+	unsigned int hash = 2166136261U;
+
+	for (string::size_type pos = 0; pos < typeLength; ++pos)
+	{
+		hash ^= (unsigned char)pType[pos];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+FilterFactory::DispatchEntry::DispatchEntry() :
+	m_hash(0),
+	m_pGetFilter(NULL),
+	m_dataInputs(0),
+	m_isLibrary(false)
+{
+}
+
+FilterFactory::DispatchEntry::~DispatchEntry()
+{
+}
+
+FilterFactory::LibraryManifest::LibraryManifest()
+{
+}
+
+FilterFactory::LibraryManifest::~LibraryManifest()
+{
+}
+
+FilterFactory::Snapshot::Snapshot() :
+	m_pCache(NULL)
+{
+}
+
+FilterFactory::Snapshot::~Snapshot()
+{
+}
+
+FilterFactory::FilterPool::FilterPool()
+{
+	pthread_mutex_init(&m_mutex, NULL);
+}
+
+FilterFactory::FilterPool::~FilterPool()
+{
+	clear();
+	pthread_mutex_destroy(&m_mutex);
+}
+
+void FilterFactory::FilterPool::clear(void)
+{
+	if (pthread_mutex_lock(&m_mutex) == 0)
+	{
+		for (map<string, vector<Filter *> >::iterator typeIter = m_filters.begin();
+			typeIter != m_filters.end(); ++typeIter)
+		{
+			for (vector<Filter *>::iterator filterIter = typeIter->second.begin();
+				filterIter != typeIter->second.end(); ++filterIter)
+			{
+				delete *filterIter;
+			}
+		}
+		m_filters.clear();
+		m_acquired.clear();
+
+		pthread_mutex_unlock(&m_mutex);
+	}
+}
+
 map<string, string> FilterFactory::m_types;
 map<string, void *> FilterFactory::m_handles;
+map<string, string> FilterFactory::m_libraryVersions;
+map<string, set<string> > FilterFactory::m_libraryDependencies;
+map<string, map<string, unsigned int> > FilterFactory::m_libraryTypes;
+map<string, unsigned int> FilterFactory::m_dataInputs;
+FilterCache *FilterFactory::m_pCache = NULL;
+string FilterFactory::m_cacheVersion;
+// Built-in types are available before any library is loaded
+FilterFactory::Snapshot * volatile FilterFactory::m_pSnapshot = FilterFactory::buildSnapshot();
+vector<FilterFactory::Snapshot *> FilterFactory::m_retiredSnapshots;
+vector<FilterCache *> FilterFactory::m_retiredCaches;
+pthread_mutex_t FilterFactory::m_loadMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t FilterFactory::m_poolKeyOnce = PTHREAD_ONCE_INIT;
+pthread_key_t FilterFactory::m_poolKey;
+pthread_mutex_t FilterFactory::m_poolsMutex = PTHREAD_MUTEX_INITIALIZER;
+set<FilterFactory::FilterPool *> FilterFactory::m_pools;
 
 FilterFactory::FilterFactory()
 {
@@ -65,11 +265,15 @@ FilterFactory::~FilterFactory()
 {
 }
 
-unsigned int FilterFactory::loadFilters(const string &dir_name)
+unsigned int FilterFactory::loadFilters(const string &dir_name,
+	const string &manifest_file)
 {
 	unsigned int count = 0;
 #ifdef HAVE_DLFCN_H
+	map<string, LibraryManifest> manifest;
+	set<string> libraries;
 	struct stat fileStat;
+	bool writeManifest = false;
 
 	if (dir_name.empty() == true)
 	{
@@ -91,6 +295,18 @@ unsigned int FilterFactory::loadFilters(const string &dir_name)
 		return 0;
 	}
 
+	// Loads are serialized, lookups use the snapshot
+	if (pthread_mutex_lock(&m_loadMutex) != 0)
+	{
+		closedir(pDir);
+		return 0;
+	}
+
+	if (manifest_file.empty() == false)
+	{
+		readManifest(manifest_file, manifest);
+	}
+
 	// Iterate through this directory's entries
 	struct dirent *pDirEntry = readdir(pDir);
 	while (pDirEntry != NULL)
@@ -117,37 +333,42 @@ unsigned int FilterFactory::loadFilters(const string &dir_name)
 			if ((stat(fileName.c_str(), &fileStat) == 0) &&
 				(S_ISREG(fileStat.st_mode)))
 			{
-				void *pHandle = dlopen(fileName.c_str(), DLOPEN_FLAGS);
-				if (pHandle != NULL)
+				map<string, LibraryManifest>::const_iterator manifestIter = manifest.find(fileName);
+				map<string, void *>::const_iterator handleIter = m_handles.find(fileName);
+				string version;
+
+				if (manifestIter != manifest.end())
 				{
-					// What type(s) does this support ?
-					get_filter_types_func *pTypesFunc = (get_filter_types_func *)dlsym(pHandle,
-							GETFILTERTYPESFUNC);
-					if (pTypesFunc != NULL)
-					{
-						set<string> types;
-						bool filterOkay = (*pTypesFunc)(types);
-
-						if (filterOkay == true)
-						{
-							for (set<string>::iterator typeIter = types.begin();
-								typeIter != types.end(); ++typeIter)
-							{
-								// Add a record for this filter
-								m_types[*typeIter] = fileName;
-#ifdef DEBUG
-								cout << "FilterFactory::loadFilters: type " << *typeIter
-									<< " is supported by " << pEntryName << endl;
-#endif
-							}
+					version = get_library_version(fileName, fileStat,
+						manifestIter->second.m_dependencies);
+				}
 
-							m_handles[fileName] = pHandle;
-						}
-						else cerr << "FilterFactory::loadFilters: couldn't get types from " << fileName << endl;
-					}
-					else cerr << "FilterFactory::loadFilters: " << dlerror() << endl;
+				if ((manifestIter != manifest.end()) &&
+					(manifestIter->second.m_version == version) &&
+					((handleIter == m_handles.end()) || (handleIter->second == NULL)))
+				{
+					// The library is only loaded when one of its types is first used
+					m_handles[fileName] = NULL;
+					m_libraryDependencies[fileName] = manifestIter->second.m_dependencies;
+					m_libraryTypes[fileName] = manifestIter->second.m_types;
+					claimTypes(fileName);
+				}
+				else if (loadLibrary(fileName) == true)
+				{
+					version = get_library_version(fileName, fileStat,
+						m_libraryDependencies[fileName]);
+					writeManifest = true;
+				}
+				else
+				{
+					// Next entry
+					pDirEntry = readdir(pDir);
+					continue;
 				}
-				else cerr << "FilterFactory::loadFilters: " << dlerror() << endl;
+
+				m_libraryVersions[fileName] = version;
+				libraries.insert(fileName);
+				++count;
 			}
 #ifdef DEBUG
 			else cout << "FilterFactory::loadFilters: "
@@ -159,147 +380,739 @@ unsigned int FilterFactory::loadFilters(const string &dir_name)
 		pDirEntry = readdir(pDir);
 	}
 	closedir(pDir);
+
+	// Rewrite the manifest if libraries changed, or were removed
+	if ((manifest_file.empty() == false) &&
+		((writeManifest == true) || (manifest.size() != libraries.size())))
+	{
+		saveManifest(manifest_file, libraries);
+	}
+
+	// Released filters may not be what getFilter() would now return
+	clearPools();
+	publishSnapshot();
+
+	pthread_mutex_unlock(&m_loadMutex);
 #endif
 
 	return count;
 }
 
-Filter *FilterFactory::getLibraryFilter(const string &mime_type)
+bool FilterFactory::loadLibrary(const string &file_name)
 {
-	void *pHandle = NULL;
+#ifdef HAVE_DLFCN_H
+	void *pHandle = dlopen(file_name.c_str(), DLOPEN_FLAGS);
+	if (pHandle == NULL)
+	{
+		cerr << "FilterFactory::loadLibrary: " << dlerror() << endl;
+		return false;
+	}
 
-	if (m_handles.empty() == true)
+	// What type(s) does this support ?
+	get_filter_types_func *pTypesFunc = (get_filter_types_func *)dlsym(pHandle,
+		GETFILTERTYPESFUNC);
+	get_filter_func *pFilterFunc = (get_filter_func *)dlsym(pHandle,
+		GETFILTERFUNC);
+	if ((pTypesFunc == NULL) ||
+		(pFilterFunc == NULL))
 	{
+		cerr << "FilterFactory::loadLibrary: " << dlerror() << endl;
+		dlclose(pHandle);
+		return false;
+	}
+
+	set<string> types;
+	if ((*pTypesFunc)(types) == false)
+	{
+		cerr << "FilterFactory::loadLibrary: couldn't get types from " << file_name << endl;
+		dlclose(pHandle);
+		return false;
+	}
+
+	// Which configuration files does it read, if it tells ?
+	get_filter_dependencies_func *pDependenciesFunc = (get_filter_dependencies_func *)dlsym(pHandle,
+		GETFILTERDEPENDENCIESFUNC);
+	set<string> dependencies;
+	if (pDependenciesFunc != NULL)
+	{
+		(*pDependenciesFunc)(dependencies);
+	}
+	m_libraryDependencies[file_name] = dependencies;
+
+	check_filter_data_input_func *pCheckFunc = (check_filter_data_input_func *)dlsym(pHandle,
+		CHECKFILTERDATAINPUTFUNC);
+	map<string, unsigned int> &libraryTypes = m_libraryTypes[file_name];
+	libraryTypes.clear();
+	for (set<string>::iterator typeIter = types.begin();
+		typeIter != types.end(); ++typeIter)
+	{
+		unsigned int dataInputs = 0;
+
+		// Ask a filter, as the export can't tell types apart
+		Filter *pFilter = (*pFilterFunc)(*typeIter);
+		if (pFilter != NULL)
+		{
+			for (int input = Filter::DOCUMENT_DATA; input <= Filter::DOCUMENT_URI; ++input)
+			{
+				if (pFilter->is_data_input_ok((Filter::DataInput)input) == true)
+				{
+					dataInputs |= (1 << input);
+				}
+			}
+			delete pFilter;
+		}
+		else if (pCheckFunc != NULL)
+		{
+			for (int input = Filter::DOCUMENT_DATA; input <= Filter::DOCUMENT_URI; ++input)
+			{
+				if ((*pCheckFunc)(input) == true)
+				{
+					dataInputs |= (1 << input);
+				}
+			}
+		}
+
+		// Add a record for this filter
+		libraryTypes[*typeIter] = dataInputs;
 #ifdef DEBUG
-		cout << "FilterFactory::getLibraryFilter: no libraries" << endl;
+		cout << "FilterFactory::loadLibrary: type " << *typeIter
+			<< " is supported by " << file_name << endl;
 #endif
-		return NULL;
 	}
+	claimTypes(file_name);
 
-	map<string, string>::iterator typeIter = m_types.find(mime_type);
-	if (typeIter == m_types.end())
+	map<string, void *>::const_iterator handleIter = m_handles.find(file_name);
+	if ((handleIter != m_handles.end()) &&
+		(handleIter->second != NULL))
 	{
-		// We don't know about this type
-		return NULL;
+		// It was loaded already, and its types were refreshed
+		dlclose(pHandle);
+	}
+	else
+	{
+		m_handles[file_name] = pHandle;
 	}
-	map<string, void *>::iterator handleIter = m_handles.find(typeIter->second);
-	if (handleIter == m_handles.end())
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void FilterFactory::claimTypes(const string &file_name, bool unhandled_only)
+{
+	const map<string, unsigned int> &libraryTypes = m_libraryTypes[file_name];
+	bool isConfigured = (m_libraryDependencies[file_name].empty() == false);
+
+	for (map<string, unsigned int>::const_iterator typeIter = libraryTypes.begin();
+		typeIter != libraryTypes.end(); ++typeIter)
+	{
+		map<string, string>::const_iterator ownerIter = m_types.find(typeIter->first);
+
+		if ((unhandled_only == true) &&
+			(ownerIter != m_types.end()))
+		{
+			continue;
+		}
+
+		// Configured types, eg external programs, give way to filters that run in process
+		if ((isConfigured == true) &&
+			(ownerIter != m_types.end()) &&
+			(ownerIter->second != file_name) &&
+			(m_libraryDependencies[ownerIter->second].empty() == true))
+		{
+#ifdef DEBUG
+			cout << "FilterFactory::claimTypes: type " << typeIter->first
+				<< " is left to " << ownerIter->second << endl;
+#endif
+			continue;
+		}
+
+		m_types[typeIter->first] = file_name;
+		m_dataInputs[typeIter->first] = typeIter->second;
+	}
+}
+
+Filter *FilterFactory::getLazyFilter(const string &mime_type)
+{
+	if (pthread_mutex_lock(&m_loadMutex) != 0)
 	{
-		// We don't know about this library
 		return NULL;
 	}
-	pHandle = handleIter->second;
-	if (pHandle == NULL)
+
+	// Another thread may have loaded the library in the meantime
+	map<string, string>::const_iterator typeIter = m_types.find(mime_type);
+	if (typeIter != m_types.end())
+	{
+		string fileName(typeIter->second);
+		map<string, void *>::const_iterator handleIter = m_handles.find(fileName);
+
+		if ((handleIter != m_handles.end()) &&
+			(handleIter->second == NULL))
+		{
+#ifdef DEBUG
+			cout << "FilterFactory::getLazyFilter: loading " << fileName << " for " << mime_type << endl;
+#endif
+			if (loadLibrary(fileName) == false)
+			{
+				// Forget about its types rather than try again
+				map<string, string>::iterator forgetIter = m_types.begin();
+				while (forgetIter != m_types.end())
+				{
+					if (forgetIter->second == fileName)
+					{
+						m_dataInputs.erase(forgetIter->first);
+						m_types.erase(forgetIter++);
+					}
+					else
+					{
+						++forgetIter;
+					}
+				}
+				m_handles.erase(fileName);
+				m_libraryTypes.erase(fileName);
+
+				// Other libraries may handle these types
+				for (map<string, map<string, unsigned int> >::const_iterator libraryIter = m_libraryTypes.begin();
+					libraryIter != m_libraryTypes.end(); ++libraryIter)
+				{
+					claimTypes(libraryIter->first, true);
+				}
+			}
+
+			publishSnapshot();
+		}
+	}
+
+	pthread_mutex_unlock(&m_loadMutex);
+
+	const DispatchEntry *pEntry = findType(getSnapshot(), mime_type);
+	if ((pEntry == NULL) ||
+		(pEntry->m_pGetFilter == &getLazyFilter))
 	{
 		return NULL;
 	}
 
-#ifdef HAVE_DLFCN_H
-	// Get a filter object then
-	get_filter_func *pFunc = (get_filter_func *)dlsym(pHandle,
-		GETFILTERFUNC);
-	if (pFunc != NULL)
+	return (*pEntry->m_pGetFilter)(mime_type);
+}
+
+void FilterFactory::readManifest(const string &manifest_file,
+	map<string, LibraryManifest> &manifest)
+{
+	ifstream manifestStream(manifest_file.c_str());
+	string line;
+	LibraryManifest *pLibrary = NULL;
+
+	if ((manifestStream.good() == false) ||
+		(getline(manifestStream, line).good() == false) ||
+		(line != MANIFEST_HEADER))
+	{
+		return;
+	}
+
+	// Libraries are followed by their types and dependencies
+	while (getline(manifestStream, line).good() == true)
+	{
+		string::size_type firstTab = line.find('\t');
+		if (firstTab == string::npos)
+		{
+			continue;
+		}
+
+		if (line.compare(0, firstTab, "L") == 0)
+		{
+			string::size_type secondTab = line.find('\t', firstTab + 1);
+			if (secondTab == string::npos)
+			{
+				pLibrary = NULL;
+				continue;
+			}
+
+			pLibrary = &manifest[line.substr(secondTab + 1)];
+			pLibrary->m_version = line.substr(firstTab + 1, secondTab - firstTab - 1);
+		}
+		else if ((line.compare(0, firstTab, "T") == 0) &&
+			(pLibrary != NULL))
+		{
+			string::size_type secondTab = line.find('\t', firstTab + 1);
+			if (secondTab == string::npos)
+			{
+				continue;
+			}
+
+			pLibrary->m_types[line.substr(secondTab + 1)] = (unsigned int)atoi(line.substr(firstTab + 1, secondTab - firstTab - 1).c_str());
+		}
+		else if ((line.compare(0, firstTab, "D") == 0) &&
+			(pLibrary != NULL))
+		{
+			pLibrary->m_dependencies.insert(line.substr(firstTab + 1));
+		}
+	}
+#ifdef DEBUG
+	cout << "FilterFactory::readManifest: " << manifest.size() << " libraries in " << manifest_file << endl;
+#endif
+}
+
+void FilterFactory::saveManifest(const string &manifest_file,
+	const set<string> &libraries)
+{
+	string tempFile(manifest_file);
+	stringstream pidStream;
+
+	// Write to a temporary file, then replace the manifest with it
+	pidStream << "." << getpid();
+	tempFile += pidStream.str();
+
+	ofstream manifestStream(tempFile.c_str());
+	if (manifestStream.good() == false)
+	{
+		cerr << "FilterFactory::saveManifest: couldn't write " << tempFile << endl;
+		return;
+	}
+
+	manifestStream << MANIFEST_HEADER << "\n";
+	for (set<string>::const_iterator libraryIter = libraries.begin();
+		libraryIter != libraries.end(); ++libraryIter)
+	{
+		map<string, string>::const_iterator versionIter = m_libraryVersions.find(*libraryIter);
+		if (versionIter == m_libraryVersions.end())
+		{
+			continue;
+		}
+
+		manifestStream << "L\t" << versionIter->second << "\t" << *libraryIter << "\n";
+		// All its types, including those another library handles
+		const map<string, unsigned int> &libraryTypes = m_libraryTypes[*libraryIter];
+		for (map<string, unsigned int>::const_iterator typeIter = libraryTypes.begin();
+			typeIter != libraryTypes.end(); ++typeIter)
+		{
+			manifestStream << "T\t" << typeIter->second << "\t" << typeIter->first << "\n";
+		}
+		const set<string> &dependencies = m_libraryDependencies[*libraryIter];
+		for (set<string>::const_iterator depIter = dependencies.begin();
+			depIter != dependencies.end(); ++depIter)
+		{
+			manifestStream << "D\t" << *depIter << "\n";
+		}
+	}
+	manifestStream.close();
+
+	if ((manifestStream.fail() == true) ||
+		(rename(tempFile.c_str(), manifest_file.c_str()) != 0))
 	{
-		return (*pFunc)(mime_type);
+		cerr << "FilterFactory::saveManifest: couldn't write " << manifest_file << endl;
+		unlink(tempFile.c_str());
 	}
+}
+
+FilterFactory::Snapshot *FilterFactory::buildSnapshot(void)
+{
+	Snapshot *pSnapshot = new Snapshot();
+	vector<DispatchEntry> entries;
+
+	for (unsigned int typeNum = 0; g_builtInTypes[typeNum].m_pMimeType != NULL; ++typeNum)
+	{
+		DispatchEntry entry;
+
+		entry.m_mimeType = g_builtInTypes[typeNum].m_pMimeType;
+		entry.m_pGetFilter = g_builtInTypes[typeNum].m_pGetFilter;
+		entry.m_dataInputs = g_builtInDataInputs;
+		entries.push_back(entry);
+	}
+
+#ifdef HAVE_DLFCN_H
+	for (map<string, string>::const_iterator typeIter = m_types.begin();
+		typeIter != m_types.end(); ++typeIter)
+	{
+		map<string, void *>::const_iterator handleIter = m_handles.find(typeIter->second);
+		DispatchEntry entry;
+
+		if (handleIter == m_handles.end())
+		{
+			continue;
+		}
+
+		entry.m_mimeType = typeIter->first;
+		if (handleIter->second == NULL)
+		{
+			// The library will be loaded on first use
+			entry.m_pGetFilter = &getLazyFilter;
+		}
+		else
+		{
+			entry.m_pGetFilter = (get_filter_func *)dlsym(handleIter->second, GETFILTERFUNC);
+		}
+		if (entry.m_pGetFilter == NULL)
+		{
 #ifdef DEBUG
-	cout << "FilterFactory::getLibraryFilter: couldn't find export getFilter" << endl;
+			cout << "FilterFactory::buildSnapshot: couldn't find export getFilter" << endl;
 #endif
+			continue;
+		}
+
+		map<string, unsigned int>::const_iterator inputsIter = m_dataInputs.find(typeIter->first);
+		if (inputsIter != m_dataInputs.end())
+		{
+			entry.m_dataInputs = inputsIter->second;
+		}
+
+		entry.m_isLibrary = true;
+		map<string, string>::const_iterator versionIter = m_libraryVersions.find(typeIter->second);
+		if (versionIter != m_libraryVersions.end())
+		{
+			entry.m_libraryVersion = versionIter->second;
+		}
+
+		// Libraries can't override built-in types
+		bool isBuiltIn = false;
+		for (vector<DispatchEntry>::const_iterator entryIter = entries.begin();
+			entryIter != entries.end(); ++entryIter)
+		{
+			if ((entryIter->m_isLibrary == false) &&
+				(entryIter->m_mimeType == entry.m_mimeType))
+			{
+				isBuiltIn = true;
+				break;
+			}
+		}
+		if (isBuiltIn == false)
+		{
+			entries.push_back(entry);
+		}
+	}
 #endif
 
+	// Keep the table at most half full
+	vector<DispatchEntry>::size_type tableSize = 16;
+	while (tableSize < entries.size() * 2)
+	{
+		tableSize *= 2;
+	}
+
+	vector<DispatchEntry> &table = pSnapshot->m_dispatchTable;
+	table.resize(tableSize);
+	for (vector<DispatchEntry>::iterator entryIter = entries.begin();
+		entryIter != entries.end(); ++entryIter)
+	{
+		entryIter->m_hash = hash_type(entryIter->m_mimeType.c_str(), entryIter->m_mimeType.length());
+
+		vector<DispatchEntry>::size_type slot = entryIter->m_hash & (tableSize - 1);
+		while (table[slot].m_pGetFilter != NULL)
+		{
+			slot = (slot + 1) & (tableSize - 1);
+		}
+		table[slot] = *entryIter;
+	}
+
+	pSnapshot->m_pCache = m_pCache;
+	pSnapshot->m_cacheVersion = m_cacheVersion;
+
+	return pSnapshot;
+}
+
+void FilterFactory::publishSnapshot(void)
+{
+	Snapshot *pCurrentSnapshot = LOAD_SNAPSHOT(m_pSnapshot);
+	Snapshot *pSnapshot = buildSnapshot();
+
+	// Threads may still be looking at the current one
+	m_retiredSnapshots.push_back(pCurrentSnapshot);
+	STORE_SNAPSHOT(m_pSnapshot, pSnapshot);
+}
+
+const FilterFactory::Snapshot *FilterFactory::getSnapshot(void)
+{
+	// Stores to the snapshot happened before its address was published
+	return LOAD_SNAPSHOT(m_pSnapshot);
+}
+
+const FilterFactory::DispatchEntry *FilterFactory::findType(const Snapshot *pSnapshot,
+	const string &mime_type)
+{
+	const vector<DispatchEntry> &dispatchTable = pSnapshot->m_dispatchTable;
+
+	// Ignore the charset, if any
+	string::size_type typeLength = mime_type.find(';');
+	if (typeLength == string::npos)
+	{
+		typeLength = mime_type.length();
+	}
+
+	if (dispatchTable.empty() == true)
+	{
+		return NULL;
+	}
+
+	unsigned int hash = hash_type(mime_type.c_str(), typeLength);
+	vector<DispatchEntry>::size_type tableMask = dispatchTable.size() - 1;
+	vector<DispatchEntry>::size_type slot = hash & tableMask;
+
+	while (dispatchTable[slot].m_pGetFilter != NULL)
+	{
+		const DispatchEntry &entry = dispatchTable[slot];
+
+		if ((entry.m_hash == hash) &&
+			(entry.m_mimeType.length() == typeLength) &&
+			(mime_type.compare(0, typeLength, entry.m_mimeType) == 0))
+		{
+			return &entry;
+		}
+
+		slot = (slot + 1) & tableMask;
+	}
+
 	return NULL;
 }
 
 Filter *FilterFactory::getFilter(const string &mime_type)
 {
-	string typeOnly(mime_type);
-	string::size_type semiColonPos = mime_type.find(";");
+	const Snapshot *pSnapshot = getSnapshot();
+	const DispatchEntry *pEntry = findType(pSnapshot, mime_type);
 
-	// Remove the charset, if any
-	if (semiColonPos != string::npos)
+	if (pEntry == NULL)
 	{
-		typeOnly = mime_type.substr(0, semiColonPos);
+		// We don't know about this type
+		return NULL;
 	}
 #ifdef DEBUG
-	cout << "FilterFactory::getFilter: file type is " << typeOnly << endl;
+	cout << "FilterFactory::getFilter: file type is " << pEntry->m_mimeType << endl;
 #endif
 
-	if (typeOnly == "text/plain")
+	Filter *pFilter = (*pEntry->m_pGetFilter)(pEntry->m_mimeType);
+	if ((pFilter != NULL) &&
+		(pEntry->m_isLibrary == true) &&
+		(pSnapshot->m_pCache != NULL))
+	{
+		string version(pSnapshot->m_cacheVersion);
+
+		if (pEntry->m_libraryVersion.empty() == false)
+		{
+			version += "|";
+			version += pEntry->m_libraryVersion;
+		}
+
+		return new CachedFilter(pFilter, pSnapshot->m_pCache, version);
+	}
+
+	return pFilter;
+}
+
+Filter *FilterFactory::acquireFilter(const string &mime_type,
+	const map<Filter::Properties, string> &properties)
+{
+	const DispatchEntry *pEntry = findType(getSnapshot(), mime_type);
+	FilterPool *pPool = getPool();
+
+	if (pEntry == NULL)
 	{
-		return new TextFilter(typeOnly);
+		// We don't know about this type
+		return NULL;
 	}
-#ifndef _DYNAMIC_DIJON_HTMLFILTER
-	else if (typeOnly == "text/html")
+
+	string poolKey(get_pool_key(pEntry->m_mimeType, properties));
+	Filter *pFilter = NULL;
+	if ((pPool != NULL) &&
+		(pthread_mutex_lock(&pPool->m_mutex) == 0))
+	{
+		map<string, vector<Filter *> >::iterator keyIter = pPool->m_filters.find(poolKey);
+
+		if ((keyIter != pPool->m_filters.end()) &&
+			(keyIter->second.empty() == false))
+		{
+			pFilter = keyIter->second.back();
+			keyIter->second.pop_back();
+			pPool->m_acquired[pFilter] = poolKey;
+		}
+
+		pthread_mutex_unlock(&pPool->m_mutex);
+	}
+
+	if (pFilter != NULL)
 	{
-		return new HtmlFilter(typeOnly);
+		return pFilter;
 	}
-#endif
-#ifndef _DYNAMIC_DIJON_XMLFILTER
-	else if ((typeOnly == "text/xml") ||
-		(typeOnly == "application/xml"))
+
+	pFilter = getFilter(mime_type);
+	if (pFilter == NULL)
 	{
-		return new XmlFilter(typeOnly);
+		return NULL;
 	}
-#endif
 
-	return getLibraryFilter(typeOnly);
+	for (map<Filter::Properties, string>::const_iterator propIter = properties.begin();
+		propIter != properties.end(); ++propIter)
+	{
+		pFilter->set_property(propIter->first, propIter->second);
+	}
+
+	if ((pPool != NULL) &&
+		(pthread_mutex_lock(&pPool->m_mutex) == 0))
+	{
+		pPool->m_acquired[pFilter] = poolKey;
+
+		pthread_mutex_unlock(&pPool->m_mutex);
+	}
+
+	return pFilter;
+}
+
+void FilterFactory::releaseFilter(Filter *pFilter)
+{
+	if (pFilter == NULL)
+	{
+		return;
+	}
+
+	FilterPool *pPool = getPool();
+	if ((pPool == NULL) ||
+		(pFilter->reset() == false))
+	{
+		delete pFilter;
+		return;
+	}
+
+	if (pthread_mutex_lock(&pPool->m_mutex) == 0)
+	{
+		// The properties of filters that weren't acquired here aren't known
+		map<Filter *, string>::iterator acquiredIter = pPool->m_acquired.find(pFilter);
+
+		if (acquiredIter != pPool->m_acquired.end())
+		{
+			vector<Filter *> &filters = pPool->m_filters[acquiredIter->second];
+
+			pPool->m_acquired.erase(acquiredIter);
+			if (filters.size() < POOLED_FILTERS_PER_TYPE)
+			{
+				filters.push_back(pFilter);
+				pFilter = NULL;
+			}
+		}
+
+		pthread_mutex_unlock(&pPool->m_mutex);
+	}
+
+	if (pFilter != NULL)
+	{
+		delete pFilter;
+	}
 }
 
 void FilterFactory::getSupportedTypes(set<string> &mime_types)
 {
+	const vector<DispatchEntry> &dispatchTable = getSnapshot()->m_dispatchTable;
+
 	mime_types.clear();
 
-	// Built-in types
-	mime_types.insert("text/plain");
-#ifndef _DYNAMIC_DIJON_HTMLFILTER
-	mime_types.insert("text/html");
-#endif
-#ifndef _DYNAMIC_DIJON_XMLFILTER
-	mime_types.insert("text/xml");
-	mime_types.insert("application/xml");
-#endif
-	// Library-handled types
-	for (map<string, string>::iterator typeIter = m_types.begin();
-		typeIter != m_types.end(); ++typeIter)
+	for (vector<DispatchEntry>::const_iterator entryIter = dispatchTable.begin();
+		entryIter != dispatchTable.end(); ++entryIter)
 	{
-		mime_types.insert(typeIter->first);
+		if (entryIter->m_pGetFilter != NULL)
+		{
+			mime_types.insert(entryIter->m_mimeType);
+		}
 	}
 }
 
 bool FilterFactory::isSupportedType(const string &mime_type)
 {
-	string typeOnly(mime_type);
-	string::size_type semiColonPos = mime_type.find(";");
+	if (findType(getSnapshot(), mime_type) == NULL)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+bool FilterFactory::isDataInputOk(const string &mime_type, Filter::DataInput input)
+{
+	const DispatchEntry *pEntry = findType(getSnapshot(), mime_type);
 
-	// Remove the charset, if any
-	if (semiColonPos != string::npos)
+	if ((pEntry == NULL) ||
+		((pEntry->m_dataInputs & (1 << input)) == 0))
 	{
-		typeOnly = mime_type.substr(0, semiColonPos);
+		return false;
 	}
 
-	// Is it a built-in type ?
-	if ((typeOnly == "text/plain") ||
-#ifndef _DYNAMIC_DIJON_HTMLFILTER
-		(typeOnly == "text/html") ||
-#endif
-#ifndef _DYNAMIC_DIJON_XMLFILTER
-		(typeOnly == "text/xml") ||
-		(typeOnly == "application/xml") ||
-#endif
-		(m_types.find(typeOnly) != m_types.end()))
+	return true;
+}
+
+FilterFactory::FilterPool *FilterFactory::getPool(void)
+{
+	if (pthread_once(&m_poolKeyOnce, createPoolKey) != 0)
 	{
-		return true;
+		return NULL;
 	}
 
-	return false;
+	FilterPool *pPool = static_cast<FilterPool *>(pthread_getspecific(m_poolKey));
+	if (pPool != NULL)
+	{
+		return pPool;
+	}
+
+	pPool = new FilterPool();
+	if (pthread_setspecific(m_poolKey, pPool) != 0)
+	{
+		delete pPool;
+		return NULL;
+	}
+
+	// Keep track of it, so that clearPools() can get to it
+	if (pthread_mutex_lock(&m_poolsMutex) == 0)
+	{
+		m_pools.insert(pPool);
+
+		pthread_mutex_unlock(&m_poolsMutex);
+	}
+
+	return pPool;
+}
+
+void FilterFactory::createPoolKey(void)
+{
+	// The pool is destroyed when its thread exits
+	pthread_key_create(&m_poolKey, destroyPool);
+}
+
+void FilterFactory::destroyPool(void *pPool)
+{
+	if (pthread_mutex_lock(&m_poolsMutex) == 0)
+	{
+		m_pools.erase(static_cast<FilterPool *>(pPool));
+
+		pthread_mutex_unlock(&m_poolsMutex);
+	}
+
+	delete static_cast<FilterPool *>(pPool);
+}
+
+void FilterFactory::clearPools(void)
+{
+	if (pthread_mutex_lock(&m_poolsMutex) == 0)
+	{
+		for (set<FilterPool *>::iterator poolIter = m_pools.begin();
+			poolIter != m_pools.end(); ++poolIter)
+		{
+			(*poolIter)->clear();
+		}
+
+		pthread_mutex_unlock(&m_poolsMutex);
+	}
 }
 
 void FilterFactory::unloadFilters(void)
 {
+	if (pthread_mutex_lock(&m_loadMutex) != 0)
+	{
+		return;
+	}
+
+	// Filters from these libraries can't be deleted once they are unloaded
+	clearPools();
+
 #ifdef HAVE_DLFCN_H
 	for (map<string, void*>::iterator iter = m_handles.begin(); iter != m_handles.end(); ++iter)
 	{
-		if (dlclose(iter->second) != 0)
+		if ((iter->second != NULL) &&
+			(dlclose(iter->second) != 0))
 		{
 #ifdef DEBUG
 			cout << "FilterFactory::unloadFilters: failed on " << iter->first << endl;
@@ -310,5 +1123,83 @@ void FilterFactory::unloadFilters(void)
 
 	m_types.clear();
 	m_handles.clear();
+	m_libraryVersions.clear();
+	m_libraryDependencies.clear();
+	m_libraryTypes.clear();
+	m_dataInputs.clear();
+	retireCache();
+	publishSnapshot();
+
+	// Nothing uses replaced snapshots and caches any more
+	for (vector<Snapshot *>::iterator snapshotIter = m_retiredSnapshots.begin();
+		snapshotIter != m_retiredSnapshots.end(); ++snapshotIter)
+	{
+		delete *snapshotIter;
+	}
+	m_retiredSnapshots.clear();
+	for (vector<FilterCache *>::iterator cacheIter = m_retiredCaches.begin();
+		cacheIter != m_retiredCaches.end(); ++cacheIter)
+	{
+		delete *cacheIter;
+	}
+	m_retiredCaches.clear();
+
+	pthread_mutex_unlock(&m_loadMutex);
+}
+
+bool FilterFactory::enableCache(const string &dir_name, off_t max_size,
+	const string &version, bool hash_contents)
+{
+	FilterCache *pCache = new FilterCache(dir_name, max_size, hash_contents);
+
+	if (pCache->is_valid() == false)
+	{
+		cerr << "FilterFactory::enableCache: can't use " << dir_name << endl;
+		delete pCache;
+
+		return false;
+	}
+
+	if (pthread_mutex_lock(&m_loadMutex) != 0)
+	{
+		delete pCache;
+
+		return false;
+	}
+
+	retireCache();
+	m_pCache = pCache;
+	m_cacheVersion = version;
+	publishSnapshot();
+
+	pthread_mutex_unlock(&m_loadMutex);
+
+	return true;
+}
+
+void FilterFactory::disableCache(void)
+{
+	if (pthread_mutex_lock(&m_loadMutex) != 0)
+	{
+		return;
+	}
+
+	retireCache();
+	publishSnapshot();
+
+	pthread_mutex_unlock(&m_loadMutex);
 }
 
+void FilterFactory::retireCache(void)
+{
+	// Released filters may use the cache, or not use it
+	clearPools();
+
+	if (m_pCache != NULL)
+	{
+		// Filters may still use it
+		m_retiredCaches.push_back(m_pCache);
+		m_pCache = NULL;
+	}
+	m_cacheVersion.clear();
+}
@@ -19,11 +19,15 @@
 #ifndef _DIJON_FILTERFACTORY_H
 #define _DIJON_FILTERFACTORY_H
 
+#include <sys/types.h>
+#include <pthread.h>
 #include <string>
 #include <map>
 #include <set>
+#include <vector>
 
 #include "Filter.h"
+#include "FilterCache.h"
 #ifndef _DYNAMIC_DIJON_HTMLFILTER
 #include "HtmlFilter.h"
 #endif
@@ -39,28 +43,206 @@ namespace Dijon
     public:
 	virtual ~FilterFactory();
 
-	/// Loads the filter libraries found in the given directory.
-	static unsigned int loadFilters(const std::string &dir_name);
+	/** Loads the filter libraries found in the given directory, and
+	 * returns how many there are. If a manifest file is given, libraries
+	 * it lists are only loaded when one of their types is first used,
+	 * unless they or the configuration files they depend on changed, and
+	 * it's rewritten when it's out of date.
+	 * Types are looked up in a snapshot that is never modified. This,
+	 * enableCache() and disableCache() build a new snapshot and swap
+	 * it in, so they may run while other threads get filters, which
+	 * need no locking. Calling this again picks up new libraries and
+	 * their new configuration. Libraries that were already loaded
+	 * remain so.
+	 */
+	static unsigned int loadFilters(const std::string &dir_name,
+		const std::string &manifest_file = "");
 
 	/// Returns a Filter that handles the given MIME type.
 	static Filter *getFilter(const std::string &mime_type);
 
+	/** Returns a Filter that handles the given MIME type, with the given
+	 * properties set, reusing one the calling thread released if possible.
+	 * Filters are only reused for the same type and properties, so these
+	 * should be given here rather than set on the filter.
+	 */
+	static Filter *acquireFilter(const std::string &mime_type,
+		const std::map<Filter::Properties, std::string> &properties =
+			std::map<Filter::Properties, std::string>());
+
+	/** Resets a Filter obtained from acquireFilter(), and keeps it for
+	 * the calling thread to reuse. It's deleted if it can't be reset,
+	 * enough filters with its type and properties are kept, or it
+	 * wasn't acquired by this thread. Acquired filters should be
+	 * released rather than deleted.
+	 */
+	static void releaseFilter(Filter *pFilter);
+
 	/// Returns all supported MIME types.
 	static void getSupportedTypes(std::set<std::string> &mime_types);
 
 	/// Indicates whether a MIME type is supported or not.
 	static bool isSupportedType(const std::string &mime_type);
 
-	/// Unloads all filter libraries.
+	/** Indicates whether filters for the given MIME type accept the given
+	 * input, without building one. This tells whether documents have to
+	 * be read in memory. Returns false if the type isn't supported.
+	 */
+	static bool isDataInputOk(const std::string &mime_type, Filter::DataInput input);
+
+	/** Unloads all filter libraries, disables the cache and frees
+	 * replaced snapshots. No other thread may use the factory or
+	 * library filters while this runs.
+	 */
 	static void unloadFilters(void);
 
+	/** Caches what filters loaded from libraries extract from files,
+	 * in the given directory and up to max_size bytes.
+	 * The version should change whenever the filters' configuration
+	 * does. Filters are keyed by file contents if hash_contents is true.
+	 * Returns false if the cache can't be used.
+	 */
+	static bool enableCache(const std::string &dir_name, off_t max_size,
+		const std::string &version, bool hash_contents = false);
+
+	/** Disables the cache. Filters that use it may still be in use,
+	 * and it's only deleted by unloadFilters().
+	 */
+	static void disableCache(void);
+
     protected:
+	/// A type in the dispatch table.
+	class DispatchEntry
+	{
+	public:
+		DispatchEntry();
+		~DispatchEntry();
+
+		std::string m_mimeType;
+		unsigned int m_hash;
+		get_filter_func *m_pGetFilter;
+		unsigned int m_dataInputs;
+		bool m_isLibrary;
+		std::string m_libraryVersion;
+
+	};
+
+	/// What a manifest says about a library.
+	class LibraryManifest
+	{
+	public:
+		LibraryManifest();
+		~LibraryManifest();
+
+		std::string m_version;
+		std::map<std::string, unsigned int> m_types;
+		std::set<std::string> m_dependencies;
+
+	};
+
+	/// What types are looked up in. It's not modified once published.
+	class Snapshot
+	{
+	public:
+		Snapshot();
+		~Snapshot();
+
+		std::vector<DispatchEntry> m_dispatchTable;
+		FilterCache *m_pCache;
+		std::string m_cacheVersion;
+
+	};
+
+	/// Filters acquired and released by a thread.
+	class FilterPool
+	{
+	public:
+		FilterPool();
+		~FilterPool();
+
+		/// Deletes all filters.
+		void clear(void);
+
+		pthread_mutex_t m_mutex;
+		/// Released filters, by type and properties.
+		std::map<std::string, std::vector<Filter *> > m_filters;
+		/// Filters in use, and the type and properties they were acquired with.
+		std::map<Filter *, std::string> m_acquired;
+
+	};
+
 	static std::map<std::string, std::string> m_types;
 	static std::map<std::string, void *> m_handles;
+	static std::map<std::string, std::string> m_libraryVersions;
+	static std::map<std::string, std::set<std::string> > m_libraryDependencies;
+	static std::map<std::string, std::map<std::string, unsigned int> > m_libraryTypes;
+	static std::map<std::string, unsigned int> m_dataInputs;
+	static FilterCache *m_pCache;
+	static std::string m_cacheVersion;
+	static Snapshot * volatile m_pSnapshot;
+	static std::vector<Snapshot *> m_retiredSnapshots;
+	static std::vector<FilterCache *> m_retiredCaches;
+	static pthread_mutex_t m_loadMutex;
+	static pthread_once_t m_poolKeyOnce;
+	static pthread_key_t m_poolKey;
+	static pthread_mutex_t m_poolsMutex;
+	static std::set<FilterPool *> m_pools;
 
 	FilterFactory();
 
-	static Filter *getLibraryFilter(const std::string &mime_type);
+	/** Loads a library and records its types. The caller must hold
+	 * m_loadMutex. Returns false if it's not a filter library.
+	 */
+	static bool loadLibrary(const std::string &file_name);
+
+	/** Makes the library handle the types it supports, unless it reads them
+	 * from configuration files and another library handles them in process,
+	 * or only those no library handles. The caller must hold m_loadMutex.
+	 */
+	static void claimTypes(const std::string &file_name, bool unhandled_only = false);
+
+	/// Loads the library that handles the type, and returns one of its filters.
+	static Filter *getLazyFilter(const std::string &mime_type);
+
+	/// Reads a manifest, listing libraries by file name.
+	static void readManifest(const std::string &manifest_file,
+		std::map<std::string, LibraryManifest> &manifest);
+
+	/// Writes a manifest of the given libraries. The caller must hold m_loadMutex.
+	static void saveManifest(const std::string &manifest_file,
+		const std::set<std::string> &libraries);
+
+	/** Builds a snapshot of built-in and loaded types, hashed with
+	 * open addressing, and of the cache settings.
+	 */
+	static Snapshot *buildSnapshot(void);
+
+	/** Replaces the current snapshot, which is retired.
+	 * The caller must hold m_loadMutex.
+	 */
+	static void publishSnapshot(void);
+
+	/// Returns the current snapshot.
+	static const Snapshot *getSnapshot(void);
+
+	/// Looks up the given type, ignoring its charset. Returns NULL if not supported.
+	static const DispatchEntry *findType(const Snapshot *pSnapshot,
+		const std::string &mime_type);
+
+	/// Retires the cache, if any. The caller must hold m_loadMutex.
+	static void retireCache(void);
+
+	/// Returns the calling thread's pool, creating it if necessary.
+	static FilterPool *getPool(void);
+
+	static void createPoolKey(void);
+
+	static void destroyPool(void *pPool);
+
+	/** Deletes the filters all threads released.
+	 * This is necessary before libraries are unloaded, or the cache changes.
+	 */
+	static void clearPools(void);
 
     private:
 	FilterFactory(const FilterFactory &other);
@@ -21,7 +21,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #ifdef HAVE_MMAP
 #include <sys/mman.h>
 #endif
@@ -36,6 +38,7 @@
 #include <gmime/gmime.h>
 
 #include "GMimeMboxFilter.h"
+#include "MaildirFilter.h"
 
 using std::cout;
 using std::cerr;
@@ -43,13 +46,251 @@ using std::endl;
 using std::string;
 using std::map;
 using std::max;
+using std::min;
+using std::vector;
 using namespace Dijon;
 
+// Indexes start with this
+static const char INDEX_MAGIC[] = "DJMBOX02";
+static const unsigned int INDEX_MAGIC_LENGTH = 8;
+// How much of the end of the indexed part of a mailbox is checked for changes
+static const off_t INDEX_CHECKED_SIZE = 4096;
+static const unsigned int MESSAGE_DELETED = 1;
+// Mailboxes are split in shards of about this size
+static const off_t SHARD_SIZE = 8 * 1024 * 1024;
+// Stands for the title documents inherit from the shard before theirs
+static const char INHERITED_TITLE[] = "\x01inherited\x01";
+
+// Mailboxes' headers are never longer than this
+static const string::size_type MAX_HEADERS_SIZE = 1024 * 1024;
+
+static bool isDeletedMessage(const char *pMozStatus, const char *pEvoStatus)
+{
+	// This only applies to Mozilla
+	if (pMozStatus != NULL)
+	{
+		long int mozFlags = strtol(pMozStatus, NULL, 16);
+
+		// Watch out for Mozilla specific flags :
+		// MSG_FLAG_EXPUNGED, MSG_FLAG_EXPIRED
+		// They are defined in mailnews/MailNewsTypes.h and msgbase/nsMsgMessageFlags.h
+		if ((mozFlags & 0x0008) ||
+			(mozFlags & 0x0040))
+		{
+#ifdef DEBUG
+			cout << "GMimeMboxFilter: message flagged by Mozilla" << endl;
+#endif
+			return true;
+		}
+	}
+	// This only applies to Evolution
+	if (pEvoStatus != NULL)
+	{
+		string evoStatus(pEvoStatus);
+		string::size_type flagsPos = evoStatus.find('-');
+
+		if (flagsPos != string::npos)
+		{
+			long int evoFlags = strtol(evoStatus.substr(flagsPos + 1).c_str(), NULL, 16);
+
+			// Watch out for Evolution specific flags :
+			// CAMEL_MESSAGE_DELETED
+			// It's defined in camel/camel-folder-summary.h
+			if (evoFlags & 0x0002)
+			{
+#ifdef DEBUG
+				cout << "GMimeMboxFilter: message flagged by Evolution" << endl;
+#endif
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static string getCurrentDate(void)
+{
+	time_t timeNow = time(NULL);
+	struct tm *pTimeTm = new struct tm;
+	string currentDate;
+
+#ifdef HAVE_LOCALTIME_R
+	if (localtime_r(&timeNow, pTimeTm) != NULL)
+#else
+	pTimeTm = localtime(&timeNow);
+	if (pTimeTm != NULL)
+#endif
+	{
+		char timeStr[64];
+
+		if (strftime(timeStr, 64, "%a, %d %b %Y %H:%M:%S %Z", pTimeTm) > 0)
+		{
+			currentDate = timeStr;
+		}
+	}
+
+	delete pTimeTm;
+
+	return currentDate;
+}
+
+static void parseHeaders(const string &headersBlock, bool hasFromLine,
+	map<string, string> &headers)
+{
+	map<string, string>::iterator lastIter = headers.end();
+	string::size_type lineStart = 0;
+
+	// Skip the From line
+	if (hasFromLine == true)
+	{
+		lineStart = headersBlock.find('\n');
+		if (lineStart != string::npos)
+		{
+			++lineStart;
+		}
+	}
+
+	while ((lineStart != string::npos) &&
+		(lineStart < headersBlock.length()))
+	{
+		string::size_type lineEnd = headersBlock.find('\n', lineStart);
+		string line(headersBlock, lineStart,
+			(lineEnd == string::npos) ? string::npos : lineEnd - lineStart);
+
+		if ((line.empty() == false) &&
+			(line[line.length() - 1] == '\r'))
+		{
+			line.resize(line.length() - 1);
+		}
+
+		if ((line.empty() == false) &&
+			((line[0] == ' ') || (line[0] == '\t')))
+		{
+			// This continues a folded header
+			if (lastIter != headers.end())
+			{
+				lastIter->second += line;
+			}
+		}
+		else
+		{
+			string::size_type colonPos = line.find(':');
+
+			lastIter = headers.end();
+			if (colonPos != string::npos)
+			{
+				string headerName(line, 0, colonPos);
+				string::size_type valuePos = line.find_first_not_of(" \t", colonPos + 1);
+
+				for (string::size_type charPos = 0; charPos < headerName.length(); ++charPos)
+				{
+					headerName[charPos] = (char)tolower((unsigned char)headerName[charPos]);
+				}
+
+				// Like GMime, return the first header with a given name
+				std::pair<map<string, string>::iterator, bool> insertPair = headers.insert(
+					std::make_pair(headerName, (valuePos == string::npos) ? string() : line.substr(valuePos)));
+				if (insertPair.second == true)
+				{
+					lastIter = insertPair.first;
+				}
+			}
+		}
+
+		lineStart = (lineEnd == string::npos) ? string::npos : lineEnd + 1;
+	}
+}
+
+static unsigned long long hashData(unsigned long long hash,
+	const char *pData, size_t dataLength)
+{
+	for (size_t pos = 0; pos < dataLength; ++pos)
+	{
+		hash ^= (unsigned char)pData[pos];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static bool hashIndexedEnd(int fd, off_t indexedEnd, unsigned long long &hash)
+{
+	char readBuffer[INDEX_CHECKED_SIZE];
+	off_t startOffset = 0;
+
+	if (indexedEnd > INDEX_CHECKED_SIZE)
+	{
+		startOffset = indexedEnd - INDEX_CHECKED_SIZE;
+	}
+
+	size_t checkedSize = (size_t)(indexedEnd - startOffset);
+	if (pread(fd, readBuffer, checkedSize, startOffset) != (ssize_t)checkedSize)
+	{
+		return false;
+	}
+	hash = hashData(14695981039346656037ULL, readBuffer, checkedSize);
+
+	return true;
+}
+
+static void writeNumber(string &buffer, unsigned long long number)
+{
+	for (unsigned int byteNum = 0; byteNum < 8; ++byteNum)
+	{
+		buffer += (char)((number >> (byteNum * 8)) & 0xff);
+	}
+}
+
+static void writeString(string &buffer, const string &str)
+{
+	writeNumber(buffer, (unsigned long long)str.length());
+	buffer += str;
+}
+
+static bool readNumber(const string &buffer, string::size_type &pos,
+	unsigned long long &number)
+{
+	if (pos + 8 > buffer.length())
+	{
+		return false;
+	}
+
+	number = 0;
+	for (unsigned int byteNum = 0; byteNum < 8; ++byteNum)
+	{
+		number |= ((unsigned long long)(unsigned char)buffer[pos + byteNum]) << (byteNum * 8);
+	}
+	pos += 8;
+
+	return true;
+}
+
+static bool readString(const string &buffer, string::size_type &pos,
+	string &str)
+{
+	unsigned long long length = 0;
+
+	if ((readNumber(buffer, pos, length) == false) ||
+		(length > (unsigned long long)(buffer.length() - pos)))
+	{
+		return false;
+	}
+
+	str = buffer.substr(pos, (string::size_type)length);
+	pos += (string::size_type)length;
+
+	return true;
+}
+
 #ifdef _DYNAMIC_DIJON_FILTERS
 DIJON_FILTER_EXPORT bool get_filter_types(std::set<std::string> &mime_types)
 {
 	mime_types.clear();
 	mime_types.insert("application/mbox");
+	mime_types.insert("application/x-maildir");
+	mime_types.insert("application/x-mh");
+	mime_types.insert("message/rfc822");
 	mime_types.insert("text/x-mail");
 	mime_types.insert("text/x-news");
 
@@ -71,6 +312,12 @@ DIJON_FILTER_EXPORT bool check_filter_data_input(int data_input)
 
 DIJON_FILTER_EXPORT Filter *get_filter(const std::string &mime_type)
 {
+	if ((mime_type == "application/x-maildir") ||
+		(mime_type == "application/x-mh"))
+	{
+		return new MaildirFilter(mime_type);
+	}
+
 	return new GMimeMboxFilter(mime_type);
 }
 
@@ -94,10 +341,9 @@ DIJON_FILTER_SHUTDOWN void shutdown_gmime(void)
 }
 #endif
 
-GMimeMboxFilter::GMimeMboxPart::GMimeMboxPart(const string &subject,
-	dstring &buffer) :
+GMimeMboxFilter::GMimeMboxPart::GMimeMboxPart(const string &subject) :
 	m_subject(subject),
-	m_buffer(buffer)
+	m_size(0)
 {
 }
 
@@ -105,6 +351,59 @@ GMimeMboxFilter::GMimeMboxPart::~GMimeMboxPart()
 {
 }
 
+GMimeMboxFilter::MessageEntry::MessageEntry() :
+	m_start(0),
+	m_end(0),
+	m_isDeleted(false)
+{
+}
+
+GMimeMboxFilter::MessageEntry::~MessageEntry()
+{
+}
+
+GMimeMboxFilter::ShardDocument::ShardDocument(const Filter &filter) :
+	m_metaData(filter.get_meta_data())
+{
+	const dstring &content = filter.get_content();
+
+	m_content.assign(content.c_str(), content.length());
+}
+
+GMimeMboxFilter::ShardDocument::~ShardDocument()
+{
+}
+
+GMimeMboxFilter::Shard::Shard(GMIME_OFFSET_TYPE start, GMIME_OFFSET_TYPE end) :
+	m_start(start),
+	m_end(end),
+	m_isDone(false)
+{
+}
+
+GMimeMboxFilter::Shard::~Shard()
+{
+	for (std::deque<ShardDocument *>::iterator docIter = m_documents.begin();
+		docIter != m_documents.end(); ++docIter)
+	{
+		delete *docIter;
+	}
+}
+
+GMimeMboxFilter::ShardThread::ShardThread(GMimeMboxFilter *pParent, GMimeMboxFilter *pFilter,
+	unsigned int firstShard, unsigned int shardsStep) :
+	m_pParent(pParent),
+	m_pFilter(pFilter),
+	m_firstShard(firstShard),
+	m_shardsStep(shardsStep)
+{
+}
+
+GMimeMboxFilter::ShardThread::~ShardThread()
+{
+	delete m_pFilter;
+}
+
 GMimeMboxFilter::GMimeMboxFilter(const string &mime_type) :
 	Filter(mime_type),
 	m_returnHeaders(false),
@@ -118,13 +417,32 @@ GMimeMboxFilter::GMimeMboxFilter(const string &mime_type) :
 	m_partsCount(-1),
 	m_partNum(-1),
 	m_messageStart(0),
-	m_foundDocument(false)
+	m_foundDocument(false),
+	m_fileDevice(0),
+	m_fileInode(0),
+	m_fileSize(0),
+	m_fileModTime(0),
+	m_indexedEnd(0),
+	m_isRecording(false),
+	m_indexChanged(false),
+	m_messagesEnd(0),
+	m_boundedByIndex(false),
+	m_maxThreads(1),
+	m_headersOnly(false),
+	m_scanOffset(0),
+	m_scanFrom(mime_type != "message/rfc822"),
+	m_currentShard(0),
+	m_stopShards(false)
 {
+	pthread_mutex_init(&m_shardsMutex, NULL);
+	pthread_cond_init(&m_shardsCond, NULL);
 }
 
 GMimeMboxFilter::~GMimeMboxFilter()
 {
 	finalize(true);
+	pthread_cond_destroy(&m_shardsCond);
+	pthread_mutex_destroy(&m_shardsMutex);
 }
 
 bool GMimeMboxFilter::is_data_input_ok(DataInput input) const
@@ -156,6 +474,7 @@ bool GMimeMboxFilter::set_property(Properties prop_name, const string &prop_valu
 		{
 			m_returnHeaders = false;
 		}
+		m_headersOnly = (prop_value == "metadata");
 
 		return true;
 	}
@@ -164,6 +483,19 @@ bool GMimeMboxFilter::set_property(Properties prop_name, const string &prop_valu
 	{
 		m_maxSize = (off_t)atoll(prop_value.c_str());
 	}
+	else if (prop_name == INDEX_DIRECTORY)
+	{
+		m_indexDirectory = prop_value;
+
+		return true;
+	}
+	else if ((prop_name == MAXIMUM_THREADS) &&
+		(prop_value.empty() == false))
+	{
+		m_maxThreads = (unsigned int)max(atoi(prop_value.c_str()), 1);
+
+		return true;
+	}
 
 	return false;
 }
@@ -177,6 +509,12 @@ bool GMimeMboxFilter::set_document_data(const char *data_ptr, unsigned int data_
 	m_messageDate.clear();
 	m_partCharset.clear();
 	m_foundDocument = false;
+	m_messages.clear();
+	m_indexedEnd = 0;
+	m_isRecording = false;
+	m_messagesEnd = 0;
+	m_boundedByIndex = false;
+	m_scanOffset = 0;
 
 	m_pData = data_ptr;
 	m_dataLength = data_length;
@@ -205,6 +543,9 @@ bool GMimeMboxFilter::set_document_file(const string &file_path, bool unlink_whe
 	m_messageDate.clear();
 	m_partCharset.clear();
 	m_foundDocument = false;
+	m_messagesEnd = 0;
+	m_boundedByIndex = false;
+	m_scanOffset = 0;
 
 	Filter::set_document_file(file_path, unlink_when_done);
 
@@ -212,7 +553,15 @@ bool GMimeMboxFilter::set_document_file(const string &file_path, bool unlink_whe
 	// but don't actually retrieve anything, until next or skip is called
 	if (initializeFile() == true)
 	{
+		// Messages are indexed as they are found
+		m_isRecording = loadIndex();
 		m_foundDocument = initialize();
+		if ((m_foundDocument == true) &&
+			(m_headersOnly == false) &&
+			(m_maxThreads > 1))
+		{
+			startShards();
+		}
 	}
 
 	return m_foundDocument;
@@ -233,20 +582,52 @@ bool GMimeMboxFilter::next_document(void)
 {
 	string subject;
 
+	if (m_shards.empty() == false)
+	{
+		return nextShardDocument();
+	}
+
 	map<string, string>::const_iterator titleIter = m_metaData.find("title");
 	if (titleIter != m_metaData.end())
 	{
 		subject = titleIter->second;
 	}
 
-	return extractMessage(subject);
+	if (m_headersOnly == true)
+	{
+		return extractHeaders(subject);
+	}
+
+	if (extractMessage(subject) == true)
+	{
+		return true;
+	}
+
+	// Only the message skipped to was read, go on with those that follow it
+	if ((m_boundedByIndex == true) &&
+		(m_cancelled == false))
+	{
+		m_boundedByIndex = false;
+		m_messageStart = m_messagesEnd;
+		m_messagesEnd = 0;
+		m_partsCount = m_partNum = -1;
+		if (reopen() == true)
+		{
+			return extractMessage(subject);
+		}
+	}
+
+	return false;
 }
 
 bool GMimeMboxFilter::skip_to_document(const string &ipath)
 {
+	unsigned long long messageStart = 0;
+
 	if (ipath.empty() == true)
 	{
-		if (m_messageStart > 0)
+		if ((m_messageStart > 0) ||
+			(m_shards.empty() == false))
 		{
 			// Reset
 			return set_document_file(m_filePath);
@@ -256,24 +637,100 @@ bool GMimeMboxFilter::skip_to_document(const string &ipath)
 	}
 
 	// ipath's format is "o=offset&p=part_number"
-	if (sscanf(ipath.c_str(), "o=%u&p=%d", (unsigned int*)&m_messageStart, &m_partNum) != 2)
+	// Mailboxes may be larger than 4 GB
+	if (sscanf(ipath.c_str(), "o=%llu&p=%d", &messageStart, &m_partNum) != 2)
 	{
 		return false;
 	}
+	m_messageStart = (GMIME_OFFSET_TYPE)messageStart;
+	// Shards set their own end
+	if (m_boundedByIndex == true)
+	{
+		m_messagesEnd = 0;
+		m_boundedByIndex = false;
+	}
+
+	// Indexing can only go on from a message the index knows about,
+	// while shards record all theirs
+	const MessageEntry *pEntry = NULL;
+	if (m_indexPath.empty() == false)
+	{
+		m_isRecording = false;
+	}
+	if (m_indexedEnd > 0)
+	{
+		int entryNum = findMessage(m_messageStart);
+
+		if (entryNum >= 0)
+		{
+			pEntry = &m_messages[entryNum];
+			m_isRecording = true;
+
+			// Like parsing, go on to the first message that's not deleted
+			while ((pEntry != NULL) &&
+				(pEntry->m_isDeleted == true))
+			{
+				m_messageStart = pEntry->m_end;
+				++entryNum;
+				pEntry = ((vector<MessageEntry>::size_type)entryNum < m_messages.size()) ?
+					&m_messages[entryNum] : NULL;
+			}
+			if (pEntry != NULL)
+			{
+				m_messageStart = pEntry->m_start;
+			}
+
+			// Don't parse past this message until asked to
+			if ((pEntry != NULL) &&
+				(m_headersOnly == false) &&
+				(m_messagesEnd == 0))
+			{
+				m_messagesEnd = pEntry->m_end;
+				m_boundedByIndex = true;
+			}
+		}
+		else if (m_messageStart < m_indexedEnd)
+		{
+#ifdef DEBUG
+			cout << "GMimeMboxFilter::skip_to_document: no message at offset " << m_messageStart << endl;
+#endif
+			return false;
+		}
+	}
 
-	finalize(false);
 	m_partsCount = -1;
 	m_messageDate.clear();
 	m_partCharset.clear();
 	m_foundDocument = false;
 
-	if (((m_filePath.empty() == false) && (initializeFile() == true)) ||
-		(initializeData() == true))
+	if (reopen() == true)
 	{
-		if (initialize() == true)
+		// Extract the first message at the given offset
+		if ((m_headersOnly == true) &&
+			(pEntry != NULL))
+		{
+			char posStr[128];
+
+			// The index has what its headers would give
+			m_messageDate = pEntry->m_date;
+			m_scanOffset = pEntry->m_end;
+			m_metaData.clear();
+			m_content.clear();
+			m_metaData["title"] = pEntry->m_subject;
+			m_metaData["mimetype"] = pEntry->m_contentType;
+			m_metaData["date"] = m_messageDate;
+			snprintf(posStr, 128, "o=%llu&p=0", (unsigned long long)m_messageStart);
+			m_metaData["ipath"] = posStr;
+			m_foundDocument = true;
+		}
+		else if (m_headersOnly == true)
+		{
+			m_scanOffset = m_messageStart;
+			m_foundDocument = extractHeaders(m_defaultTitle);
+		}
+		else
 		{
-			// Extract the first message at the given offset
-			m_foundDocument = extractMessage("");
+			m_foundDocument = extractMessage(m_defaultTitle);
 		}
 	}
 
@@ -312,7 +769,7 @@ int GMimeMboxFilter::openFile(const string &filePath)
 #ifdef DEBUG
 		cout << "GMimeMboxFilter::openFile: couldn't open " << filePath << endl;
 #endif
-		return false;
+		return -1;
 	}
 #ifndef O_CLOEXEC
 	int fdFlags = fcntl(fd, F_GETFD);
@@ -360,10 +817,23 @@ bool GMimeMboxFilter::initializeFile(void)
 	}
 
 	// Create a stream
-	if (m_messageStart > 0)
+	if ((m_messageStart > 0) ||
+		(m_messagesEnd > 0))
 	{
-		ssize_t streamLength = g_mime_stream_length(m_pGMimeMboxStream);
+		struct stat fileStat;
+		off_t streamLength = 0;
 
+		// The stream doesn't exist yet
+		if (fstat(m_fd, &fileStat) == 0)
+		{
+			streamLength = fileStat.st_size;
+		}
+		// Shards end where the next one starts
+		if ((m_messagesEnd > 0) &&
+			(m_messagesEnd < (GMIME_OFFSET_TYPE)streamLength))
+		{
+			streamLength = (off_t)m_messagesEnd;
+		}
 		if (m_messageStart > (GMIME_OFFSET_TYPE)streamLength)
 		{
 			// This offset doesn't make sense !
@@ -405,7 +875,7 @@ bool GMimeMboxFilter::initialize(void)
 		g_mime_parser_init_with_stream(m_pParser, m_pGMimeMboxStream);
 		g_mime_parser_set_respect_content_length(m_pParser, TRUE);
 		// Scan for mbox From-lines
-		g_mime_parser_set_scan_from(m_pParser, TRUE);
+		g_mime_parser_set_scan_from(m_pParser, (m_scanFrom == true) ? TRUE : FALSE);
 
 		return true;
 	}
@@ -416,8 +886,29 @@ bool GMimeMboxFilter::initialize(void)
 	return false;
 }
 
+bool GMimeMboxFilter::reopen(void)
+{
+	finalize(false);
+
+	if (((m_filePath.empty() == false) && (initializeFile() == true)) ||
+		(initializeData() == true))
+	{
+		return initialize();
+	}
+
+	return false;
+}
+
 void GMimeMboxFilter::finalize(bool fullReset)
 {
+	stopShards();
+
+	if ((fullReset == true) &&
+		(m_indexChanged == true))
+	{
+		saveIndex();
+	}
+
 	if (m_pMimeMessage != NULL)
 	{
 #ifdef GMIME_ENABLE_RFC2047_WORKAROUNDS
@@ -459,16 +950,27 @@ void GMimeMboxFilter::finalize(bool fullReset)
 		// ...but those data fields will only be reinit'ed on a full reset
 		m_pData = NULL;
 		m_dataLength = 0;
+		m_indexPath.clear();
+		m_messages.clear();
+		m_indexedEnd = 0;
+		m_isRecording = m_indexChanged = false;
 
-		rewind();
+		Filter::rewind();
 	}
 }
 
-bool GMimeMboxFilter::readStream(GMimeStream *pStream, dstring &fileBuffer)
+void GMimeMboxFilter::rewind(void)
+{
+	// Stop shards' threads and release the parser, as set_document_XXX() would
+	finalize(true);
+	m_foundDocument = false;
+}
+
+bool GMimeMboxFilter::readStream(GMimeStream *pStream, ssize_t &totalSize)
 {
 	char readBuffer[4096];
 	ssize_t streamLen = g_mime_stream_length(pStream);
-	ssize_t totalSize = 0, bytesRead = 0;
+	ssize_t bytesRead = 0;
 	bool gotOutput = true;
 
 #ifdef DEBUG
@@ -491,8 +993,11 @@ bool GMimeMboxFilter::readStream(GMimeStream *pStream, dstring &fileBuffer)
 		bytesRead = g_mime_stream_read(pStream, readBuffer, 4096);
 		if (bytesRead > 0)
 		{
-			fileBuffer.append(readBuffer, bytesRead);
 			totalSize += bytesRead;
+			if (append_content(readBuffer, bytesRead) == false)
+			{
+				break;
+			}
 		}
 		else if (bytesRead == -1)
 		{
@@ -509,7 +1014,7 @@ bool GMimeMboxFilter::readStream(GMimeStream *pStream, dstring &fileBuffer)
 	} while (bytesRead > 0);
 #ifdef DEBUG
 	cout << "GMimeMboxFilter::readStream: read " << totalSize
-		<< "/" << fileBuffer.size() << " bytes" << endl;
+		<< "/" << streamLen << " bytes" << endl;
 #endif
 
 	return gotOutput;
@@ -523,10 +1028,11 @@ bool GMimeMboxFilter::nextPart(const string &subject)
 		GMimeObject *pMimePart = g_mime_message_get_mime_part(m_pMimeMessage);
 		if (pMimePart != NULL)
 		{
-			GMimeMboxPart mboxPart(subject, m_content);
+			GMimeMboxPart mboxPart(subject);
 
 			// Extract the part's text
 			m_content.clear();
+			m_abortedContent = false;
 			if (extractPart(pMimePart, mboxPart) == true)
 			{
 				char posStr[128];
@@ -537,15 +1043,14 @@ bool GMimeMboxFilter::nextPart(const string &subject)
 				m_metaData["mimetype"] = mboxPart.m_contentType;
 				m_metaData["date"] = m_messageDate;
 				m_metaData["charset"] = m_partCharset;
-				snprintf(posStr, 128, "%u", m_content.length());
+				snprintf(posStr, 128, "%llu", (unsigned long long)mboxPart.m_size);
 				m_metaData["size"] = posStr;
 				// FIXME: use the same scheme as Mozilla
-				snprintf(posStr, 128, "o=%u&p=%d", m_messageStart, max(m_partNum - 1, 0));
+				snprintf(posStr, 128, "o=%llu&p=%d", (unsigned long long)m_messageStart, max(m_partNum - 1, 0));
 				m_metaData["ipath"] = posStr;
 #ifdef DEBUG
 				cout << "GMimeMboxFilter::nextPart: message location is " << posStr << endl; 
 #endif
-
 #ifndef GMIME_ENABLE_RFC2047_WORKAROUNDS
 				g_mime_object_unref(pMimePart);
 #endif
@@ -677,19 +1182,20 @@ bool GMimeMboxFilter::extractPart(GMimeObject *part, GMimeMboxPart &mboxPart)
 					{
 						mboxPart.m_contentType = "SCAN";
 						mboxPart.m_subject = partLocalFile;
-						mboxPart.m_buffer.clear();
+						mboxPart.m_size = 0;
 #ifdef DEBUG
 						cout << "GMimeMboxFilter::extractPart: local file at " << partLocalFile << endl;
 #endif
 
 						// Load the part from file
+						m_metaData["mimetype"] = mboxPart.m_contentType;
 						int fd = openFile(partLocalFile);
 						if (fd >= 0)
 						{
 							GMimeStream *fileStream = g_mime_stream_mmap_new(fd, PROT_READ, MAP_PRIVATE);
 							if (fileStream != NULL)
 							{
-								readStream(fileStream, mboxPart.m_buffer);
+								readStream(fileStream, mboxPart.m_size);
 								if (G_IS_OBJECT(fileStream))
 								{
 									g_object_unref(fileStream);
@@ -711,7 +1217,7 @@ bool GMimeMboxFilter::extractPart(GMimeObject *part, GMimeMboxPart &mboxPart)
 	}
 
 	// Was the part already loaded ?
-	if (mboxPart.m_buffer.empty() == false)
+	if (mboxPart.m_size > 0)
 	{
 		return true;
 	}
@@ -781,6 +1287,8 @@ bool GMimeMboxFilter::extractPart(GMimeObject *part, GMimeMboxPart &mboxPart)
 	}
 	g_mime_stream_flush(memStream);
 
+	// Only text goes to the sink
+	m_metaData["mimetype"] = mboxPart.m_contentType;
 	if ((m_returnHeaders == true) &&
 		(mboxPart.m_contentType.length() >= 10) &&
 		(strncasecmp(mboxPart.m_contentType.c_str(), "text/plain", 10) == 0))
@@ -789,14 +1297,17 @@ bool GMimeMboxFilter::extractPart(GMimeObject *part, GMimeMboxPart &mboxPart)
 
 		if (pHeaders != NULL)
 		{
-			mboxPart.m_buffer = pHeaders;
-			mboxPart.m_buffer += "\n";
+			unsigned int headersLength = strlen(pHeaders);
+
+			append_content(pHeaders, headersLength);
+			append_content("\n", 1);
+			mboxPart.m_size += headersLength + 1;
 			free(pHeaders);
 		}
 	}
 
 	g_mime_stream_reset(memStream);
-	readStream(memStream, mboxPart.m_buffer);
+	readStream(memStream, mboxPart.m_size);
 	if (G_IS_OBJECT(memStream))
 	{
 		g_object_unref(memStream);
@@ -836,7 +1347,8 @@ bool GMimeMboxFilter::extractMessage(const string &subject)
 				break;
 			}
 
-			m_messageStart = g_mime_parser_get_from_offset(m_pParser);
+			// Without From lines, there's no offset
+			m_messageStart = (m_scanFrom == true) ? g_mime_parser_get_from_offset(m_pParser) : 0;
 #ifdef GMIME_ENABLE_RFC2047_WORKAROUNDS
 			gint64 messageEnd = g_mime_parser_tell(m_pParser);
 #else
@@ -848,46 +1360,14 @@ bool GMimeMboxFilter::extractMessage(const string &subject)
 #endif
 			if (messageEnd > m_messageStart)
 			{
-				// This only applies to Mozilla
 				const char *pMozStatus = g_mime_object_get_header(GMIME_OBJECT(m_pMimeMessage), "X-Mozilla-Status");
-				if (pMozStatus != NULL)
-				{
-					long int mozFlags = strtol(pMozStatus, NULL, 16);
-
-					// Watch out for Mozilla specific flags :
-					// MSG_FLAG_EXPUNGED, MSG_FLAG_EXPIRED
-					// They are defined in mailnews/MailNewsTypes.h and msgbase/nsMsgMessageFlags.h
-					if ((mozFlags & 0x0008) ||
-						(mozFlags & 0x0040))
-					{
-#ifdef DEBUG
-						cout << "GMimeMboxFilter::extractMessage: flagged by Mozilla" << endl;
-#endif
-						continue;
-					}
-				}
-				// This only applies to Evolution
 				const char *pEvoStatus = g_mime_object_get_header(GMIME_OBJECT(m_pMimeMessage), "X-Evolution");
-				if (pEvoStatus != NULL)
-				{
-					string evoStatus(pEvoStatus);
-					string::size_type flagsPos = evoStatus.find('-');
+				bool isDeleted = isDeletedMessage(pMozStatus, pEvoStatus);
 
-					if (flagsPos != string::npos)
-					{
-						long int evoFlags = strtol(evoStatus.substr(flagsPos + 1).c_str(), NULL, 16);
-
-						// Watch out for Evolution specific flags :
-						// CAMEL_MESSAGE_DELETED
-						// It's defined in camel/camel-folder-summary.h
-						if (evoFlags & 0x0002)
-						{
-#ifdef DEBUG
-							cout << "GMimeMboxFilter::extractMessage: flagged by Evolution" << endl;
-#endif
-							continue;
-						}
-					}
+				if (isDeleted == true)
+				{
+					recordMessage(messageEnd, true, "");
+					continue;
 				}
 
 				// How old is this message ?
@@ -898,25 +1378,7 @@ bool GMimeMboxFilter::extractMessage(const string &subject)
 				}
 				else
 				{
-					time_t timeNow = time(NULL);
-					struct tm *pTimeTm = new struct tm;
-
-#ifdef HAVE_LOCALTIME_R
-					if (localtime_r(&timeNow, pTimeTm) != NULL)
-#else
-					pTimeTm = localtime(&timeNow);
-					if (pTimeTm != NULL)
-#endif
-					{
-						char timeStr[64];
-
-						if (strftime(timeStr, 64, "%a, %d %b %Y %H:%M:%S %Z", pTimeTm) > 0)
-						{
-							m_messageDate = timeStr;
-						}
-					}
-
-					delete pTimeTm;
+					m_messageDate = getCurrentDate();
 				}
 #ifdef DEBUG
 				cout << "GMimeMboxFilter::extractMessage: message date is " << m_messageDate << endl;
@@ -928,6 +1390,8 @@ bool GMimeMboxFilter::extractMessage(const string &subject)
 				{
 					msgSubject = pSubject;
 				}
+
+				recordMessage(messageEnd, false, (pSubject != NULL) ? pSubject : "");
 			}
 		}
 #ifdef DEBUG
@@ -949,3 +1413,945 @@ bool GMimeMboxFilter::extractMessage(const string &subject)
 
 	return false;
 }
+
+bool GMimeMboxFilter::loadIndex(void)
+{
+	struct stat fileStat;
+
+	m_indexPath.clear();
+	m_messages.clear();
+	m_indexedEnd = 0;
+	m_indexChanged = false;
+
+	if ((m_indexDirectory.empty() == true) ||
+		(fstat(m_fd, &fileStat) != 0))
+	{
+		return false;
+	}
+
+	char hashStr[64];
+
+	snprintf(hashStr, 64, "%016llx", hashData(14695981039346656037ULL, m_filePath.c_str(), m_filePath.length()));
+	m_indexPath = m_indexDirectory + "/";
+	m_indexPath += hashStr;
+	m_indexPath += ".mboxindex";
+	m_fileDevice = fileStat.st_dev;
+	m_fileInode = fileStat.st_ino;
+	m_fileSize = fileStat.st_size;
+	m_fileModTime = fileStat.st_mtime;
+
+	int indexFd = open(m_indexPath.c_str(), O_RDONLY);
+	if (indexFd < 0)
+	{
+		// It will be built
+		return true;
+	}
+
+	string buffer;
+	char readBuffer[4096];
+	ssize_t bytesRead = 0;
+
+	do
+	{
+		bytesRead = read(indexFd, readBuffer, 4096);
+		if (bytesRead > 0)
+		{
+			buffer.append(readBuffer, (string::size_type)bytesRead);
+		}
+		else if ((bytesRead == -1) &&
+			(errno == EINTR))
+		{
+			bytesRead = 1;
+		}
+	} while (bytesRead > 0);
+	close(indexFd);
+
+	unsigned long long fileDevice = 0, fileInode = 0, fileSize = 0, fileModTime = 0;
+	unsigned long long indexedEnd = 0, endHash = 0, messagesCount = 0;
+	string::size_type pos = INDEX_MAGIC_LENGTH;
+
+	if ((bytesRead < 0) ||
+		(buffer.compare(0, INDEX_MAGIC_LENGTH, INDEX_MAGIC) != 0) ||
+		(readNumber(buffer, pos, fileDevice) == false) ||
+		(readNumber(buffer, pos, fileInode) == false) ||
+		(readNumber(buffer, pos, fileSize) == false) ||
+		(readNumber(buffer, pos, fileModTime) == false) ||
+		(readNumber(buffer, pos, indexedEnd) == false) ||
+		(readNumber(buffer, pos, endHash) == false) ||
+		(readNumber(buffer, pos, messagesCount) == false))
+	{
+#ifdef DEBUG
+		cout << "GMimeMboxFilter::loadIndex: invalid index " << m_indexPath << endl;
+#endif
+		return true;
+	}
+
+	// Is this the same mailbox ?
+	if ((fileDevice != (unsigned long long)m_fileDevice) ||
+		(fileInode != (unsigned long long)m_fileInode) ||
+		(indexedEnd > (unsigned long long)m_fileSize))
+	{
+		return true;
+	}
+	bool wasModified = ((fileSize != (unsigned long long)m_fileSize) ||
+		(fileModTime != (unsigned long long)m_fileModTime));
+	if (wasModified == true)
+	{
+		unsigned long long currentHash = 0;
+
+		// Messages may only have been appended
+		if ((hashIndexedEnd(m_fd, (off_t)indexedEnd, currentHash) == false) ||
+			(currentHash != endHash))
+		{
+#ifdef DEBUG
+			cout << "GMimeMboxFilter::loadIndex: " << m_filePath << " was modified" << endl;
+#endif
+			return true;
+		}
+	}
+
+	for (unsigned long long messageNum = 0; messageNum < messagesCount; ++messageNum)
+	{
+		MessageEntry entry;
+		unsigned long long start = 0, end = 0, flags = 0;
+
+		if ((readNumber(buffer, pos, start) == false) ||
+			(readNumber(buffer, pos, end) == false) ||
+			(readNumber(buffer, pos, flags) == false) ||
+			(readString(buffer, pos, entry.m_date) == false) ||
+			(readString(buffer, pos, entry.m_subject) == false) ||
+			(readString(buffer, pos, entry.m_contentType) == false))
+		{
+			m_messages.clear();
+			return true;
+		}
+
+		entry.m_start = (GMIME_OFFSET_TYPE)start;
+		entry.m_end = (GMIME_OFFSET_TYPE)end;
+		entry.m_isDeleted = ((flags & MESSAGE_DELETED) != 0);
+		m_messages.push_back(entry);
+	}
+	m_indexedEnd = (GMIME_OFFSET_TYPE)indexedEnd;
+
+	// Messages may also have been rewritten in place, eg to flag them as deleted
+	if ((wasModified == true) &&
+		(checkIndex() == false))
+	{
+#ifdef DEBUG
+		cout << "GMimeMboxFilter::loadIndex: " << m_filePath << " was rewritten" << endl;
+#endif
+		m_messages.clear();
+		m_indexedEnd = 0;
+		m_indexChanged = false;
+	}
+#ifdef DEBUG
+	cout << "GMimeMboxFilter::loadIndex: " << m_messages.size() << " messages up to offset "
+		<< m_indexedEnd << endl;
+#endif
+
+	return true;
+}
+
+bool GMimeMboxFilter::checkIndex(void)
+{
+	for (vector<MessageEntry>::iterator entryIter = m_messages.begin();
+		entryIter != m_messages.end(); ++entryIter)
+	{
+		char fromStr[5];
+
+		// The message should still start there
+		if ((m_scanFrom == true) &&
+			((readMailbox(fromStr, 5, entryIter->m_start) != 5) ||
+			(strncmp(fromStr, "From ", 5) != 0)))
+		{
+			return false;
+		}
+
+		map<string, string> headers;
+		const char *pMozStatus = NULL;
+		const char *pEvoStatus = NULL;
+
+		readHeaders(entryIter->m_start, headers);
+		map<string, string>::const_iterator headerIter = headers.find("x-mozilla-status");
+		if (headerIter != headers.end())
+		{
+			pMozStatus = headerIter->second.c_str();
+		}
+		headerIter = headers.find("x-evolution");
+		if (headerIter != headers.end())
+		{
+			pEvoStatus = headerIter->second.c_str();
+		}
+
+		bool isDeleted = isDeletedMessage(pMozStatus, pEvoStatus);
+		if (isDeleted == entryIter->m_isDeleted)
+		{
+			continue;
+		}
+		else if (isDeleted == false)
+		{
+			// What it holds wasn't indexed
+			return false;
+		}
+#ifdef DEBUG
+		cout << "GMimeMboxFilter::checkIndex: message at offset " << entryIter->m_start
+			<< " was deleted" << endl;
+#endif
+		entryIter->m_isDeleted = true;
+		entryIter->m_date.clear();
+		entryIter->m_subject.clear();
+		entryIter->m_contentType.clear();
+		m_indexChanged = true;
+	}
+
+	return true;
+}
+
+void GMimeMboxFilter::saveIndex(void)
+{
+	unsigned long long endHash = 0;
+
+	if ((m_indexPath.empty() == true) ||
+		(m_fd < 0) ||
+		(hashIndexedEnd(m_fd, (off_t)m_indexedEnd, endHash) == false))
+	{
+		return;
+	}
+
+	string buffer(INDEX_MAGIC, INDEX_MAGIC_LENGTH);
+
+	writeNumber(buffer, (unsigned long long)m_fileDevice);
+	writeNumber(buffer, (unsigned long long)m_fileInode);
+	writeNumber(buffer, (unsigned long long)m_fileSize);
+	writeNumber(buffer, (unsigned long long)m_fileModTime);
+	writeNumber(buffer, (unsigned long long)m_indexedEnd);
+	writeNumber(buffer, endHash);
+	writeNumber(buffer, (unsigned long long)m_messages.size());
+	for (vector<MessageEntry>::const_iterator entryIter = m_messages.begin();
+		entryIter != m_messages.end(); ++entryIter)
+	{
+		writeNumber(buffer, (unsigned long long)entryIter->m_start);
+		writeNumber(buffer, (unsigned long long)entryIter->m_end);
+		writeNumber(buffer, (entryIter->m_isDeleted == true) ? MESSAGE_DELETED : 0);
+		writeString(buffer, entryIter->m_date);
+		writeString(buffer, entryIter->m_subject);
+		writeString(buffer, entryIter->m_contentType);
+	}
+
+	// Replace the index in one go
+	string tempPath(m_indexPath + ".XXXXXX");
+	vector<char> tempTemplate(tempPath.begin(), tempPath.end());
+	tempTemplate.push_back('\0');
+
+	int indexFd = mkstemp(&tempTemplate[0]);
+	if (indexFd < 0)
+	{
+		return;
+	}
+
+	string::size_type pos = 0;
+	while (pos < buffer.length())
+	{
+		ssize_t bytesWritten = write(indexFd, buffer.c_str() + pos, buffer.length() - pos);
+
+		if (bytesWritten > 0)
+		{
+			pos += (string::size_type)bytesWritten;
+		}
+		else if ((bytesWritten == -1) &&
+			(errno != EINTR))
+		{
+			break;
+		}
+	}
+
+	if ((close(indexFd) != 0) ||
+		(pos < buffer.length()) ||
+		(rename(&tempTemplate[0], m_indexPath.c_str()) != 0))
+	{
+		unlink(&tempTemplate[0]);
+		return;
+	}
+	m_indexChanged = false;
+#ifdef DEBUG
+	cout << "GMimeMboxFilter::saveIndex: saved " << m_messages.size() << " messages to "
+		<< m_indexPath << endl;
+#endif
+}
+
+int GMimeMboxFilter::findMessage(GMIME_OFFSET_TYPE messageStart) const
+{
+	vector<MessageEntry>::size_type first = 0, last = m_messages.size();
+
+	// Entries are sorted by offset
+	while (first < last)
+	{
+		vector<MessageEntry>::size_type middle = first + (last - first) / 2;
+
+		if (m_messages[middle].m_start < messageStart)
+		{
+			first = middle + 1;
+		}
+		else
+		{
+			last = middle;
+		}
+	}
+
+	if ((first < m_messages.size()) &&
+		(m_messages[first].m_start == messageStart))
+	{
+		return (int)first;
+	}
+
+	return -1;
+}
+
+void GMimeMboxFilter::recordMessage(GMIME_OFFSET_TYPE messageEnd, bool isDeleted,
+	const string &subject)
+{
+	// Only messages that follow those already indexed are added
+	if ((m_isRecording == false) ||
+		(m_messageStart < m_indexedEnd))
+	{
+		return;
+	}
+
+	MessageEntry entry;
+
+	entry.m_start = m_messageStart;
+	entry.m_end = messageEnd;
+	entry.m_isDeleted = isDeleted;
+	if (isDeleted == false)
+	{
+		entry.m_date = m_messageDate;
+		entry.m_subject = subject;
+		entry.m_contentType = "text/plain";
+
+		// What metadata mode would find in the headers
+		GMimeObject *pMimePart = g_mime_message_get_mime_part(m_pMimeMessage);
+		if (pMimePart != NULL)
+		{
+			char *pType = g_mime_content_type_to_string(g_mime_object_get_content_type(pMimePart));
+
+			if (pType != NULL)
+			{
+				entry.m_contentType = pType;
+				for (string::size_type charPos = 0; charPos < entry.m_contentType.length(); ++charPos)
+				{
+					entry.m_contentType[charPos] = (char)tolower((unsigned char)entry.m_contentType[charPos]);
+				}
+				g_free(pType);
+			}
+#ifndef GMIME_ENABLE_RFC2047_WORKAROUNDS
+			g_mime_object_unref(pMimePart);
+#endif
+		}
+	}
+	addMessage(entry);
+}
+
+void GMimeMboxFilter::addMessage(const MessageEntry &entry)
+{
+	if ((m_isRecording == false) ||
+		(entry.m_start < m_indexedEnd))
+	{
+		return;
+	}
+
+	m_messages.push_back(entry);
+	m_indexedEnd = entry.m_end;
+	m_indexChanged = true;
+}
+
+GMIME_OFFSET_TYPE GMimeMboxFilter::findShardStart(GMIME_OFFSET_TYPE messageStart,
+	GMIME_OFFSET_TYPE offset)
+{
+	// The index knows where the parser found messages
+	if (offset < m_indexedEnd)
+	{
+		vector<MessageEntry>::size_type first = 0, last = m_messages.size();
+
+		while (first < last)
+		{
+			vector<MessageEntry>::size_type middle = first + (last - first) / 2;
+
+			if (m_messages[middle].m_start < offset)
+			{
+				first = middle + 1;
+			}
+			else
+			{
+				last = middle;
+			}
+		}
+
+		if (first < m_messages.size())
+		{
+			return m_messages[first].m_start;
+		}
+	}
+
+	if (messageStart < m_indexedEnd)
+	{
+		// Messages that follow those indexed start where they end
+		messageStart = m_indexedEnd;
+	}
+
+	// Go from message to message like the parser, as From lines in bodies it skips don't count
+	while ((messageStart >= 0) &&
+		(messageStart < offset))
+	{
+		map<string, string> headers;
+		GMIME_OFFSET_TYPE bodyStart = readHeaders(messageStart, headers);
+		GMIME_OFFSET_TYPE bodyEnd = findBodyEnd(bodyStart, headers);
+
+		messageStart = findFromLine((bodyEnd >= 0) ? bodyEnd : bodyStart);
+	}
+
+	return messageStart;
+}
+
+bool GMimeMboxFilter::startShards(void)
+{
+	struct stat fileStat;
+
+	if ((m_fd < 0) ||
+		(fstat(m_fd, &fileStat) != 0) ||
+		(fileStat.st_size < SHARD_SIZE * 2))
+	{
+		return false;
+	}
+
+	vector<GMIME_OFFSET_TYPE> shardStarts;
+
+	shardStarts.push_back(0);
+	while (shardStarts.back() + SHARD_SIZE < (GMIME_OFFSET_TYPE)fileStat.st_size)
+	{
+		GMIME_OFFSET_TYPE shardStart = findShardStart(shardStarts.back(),
+			shardStarts.back() + SHARD_SIZE);
+
+		if ((shardStart <= shardStarts.back()) ||
+			(shardStart >= (GMIME_OFFSET_TYPE)fileStat.st_size))
+		{
+			break;
+		}
+		shardStarts.push_back(shardStart);
+	}
+	if (shardStarts.size() < 2)
+	{
+		return false;
+	}
+
+	for (vector<GMIME_OFFSET_TYPE>::size_type shardNum = 0; shardNum < shardStarts.size(); ++shardNum)
+	{
+		// The last shard goes on to the end of the file
+		m_shards.push_back(new Shard(shardStarts[shardNum],
+			(shardNum + 1 < shardStarts.size()) ? shardStarts[shardNum + 1] : 0));
+	}
+
+	vector<GMimeMboxFilter *> filters;
+
+	while (filters.size() < min((vector<Shard *>::size_type)m_maxThreads, m_shards.size()))
+	{
+		GMimeMboxFilter *pFilter = new GMimeMboxFilter(m_mimeType);
+
+		pFilter->m_defaultCharset = m_defaultCharset;
+		pFilter->m_returnHeaders = m_returnHeaders;
+		pFilter->m_maxSize = m_maxSize;
+		filters.push_back(pFilter);
+		if (pFilter->set_document_file(m_filePath) == false)
+		{
+			for (vector<GMimeMboxFilter *>::iterator filterIter = filters.begin();
+				filterIter != filters.end(); ++filterIter)
+			{
+				delete *filterIter;
+			}
+			stopShards();
+
+			return false;
+		}
+	}
+#ifdef DEBUG
+	cout << "GMimeMboxFilter::startShards: " << m_shards.size() << " shards" << endl;
+#endif
+
+	return startShardThreads(filters);
+}
+
+bool GMimeMboxFilter::startShardThreads(const vector<GMimeMboxFilter *> &filters)
+{
+	bool startedThreads = true;
+
+	m_currentShard = 0;
+	for (vector<GMimeMboxFilter *>::size_type filterNum = 0; filterNum < filters.size(); ++filterNum)
+	{
+		ShardThread *pThread = new ShardThread(this, filters[filterNum],
+			(unsigned int)filterNum, (unsigned int)filters.size());
+
+		if ((startedThreads == false) ||
+			(pthread_create(&pThread->m_thread, NULL, runShardThread, pThread) != 0))
+		{
+			// This deletes the filter
+			delete pThread;
+			startedThreads = false;
+			continue;
+		}
+		m_shardThreads.push_back(pThread);
+	}
+
+	if ((startedThreads == false) ||
+		(m_shardThreads.empty() == true))
+	{
+		stopShards();
+
+		return false;
+	}
+
+	return true;
+}
+
+void GMimeMboxFilter::stopShards(void)
+{
+	if ((m_shards.empty() == true) &&
+		(m_shardThreads.empty() == true))
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&m_shardsMutex);
+	m_stopShards = true;
+	pthread_cond_broadcast(&m_shardsCond);
+	pthread_mutex_unlock(&m_shardsMutex);
+
+	for (vector<ShardThread *>::iterator threadIter = m_shardThreads.begin();
+		threadIter != m_shardThreads.end(); ++threadIter)
+	{
+		ShardThread *pThread = *threadIter;
+
+		// The thread may be in the middle of a message
+		pThread->m_pFilter->cancel();
+		pthread_join(pThread->m_thread, NULL);
+		delete pThread;
+	}
+	m_shardThreads.clear();
+
+	for (vector<Shard *>::iterator shardIter = m_shards.begin();
+		shardIter != m_shards.end(); ++shardIter)
+	{
+		delete *shardIter;
+	}
+	m_shards.clear();
+	m_currentShard = 0;
+	m_stopShards = false;
+}
+
+bool GMimeMboxFilter::nextShardDocument(void)
+{
+	ShardDocument *pDocument = NULL;
+	string previousTitle;
+
+	map<string, string>::const_iterator titleIter = m_metaData.find("title");
+	if (titleIter != m_metaData.end())
+	{
+		previousTitle = titleIter->second;
+	}
+	m_metaData.clear();
+	m_content.clear();
+
+	// Shards are read in order
+	pthread_mutex_lock(&m_shardsMutex);
+	while ((m_cancelled == false) &&
+		(m_currentShard < m_shards.size()))
+	{
+		Shard *pShard = m_shards[m_currentShard];
+
+		if (pShard->m_documents.empty() == false)
+		{
+			pDocument = pShard->m_documents.front();
+			pShard->m_documents.pop_front();
+			break;
+		}
+		if (pShard->m_isDone == true)
+		{
+			// Messages are indexed in order too
+			for (vector<MessageEntry>::const_iterator entryIter = pShard->m_messages.begin();
+				entryIter != pShard->m_messages.end(); ++entryIter)
+			{
+				addMessage(*entryIter);
+			}
+			pShard->m_messages.clear();
+
+			// Another shard may be started
+			++m_currentShard;
+			pthread_cond_broadcast(&m_shardsCond);
+			continue;
+		}
+
+		pthread_cond_wait(&m_shardsCond, &m_shardsMutex);
+	}
+	pthread_mutex_unlock(&m_shardsMutex);
+
+	if (pDocument == NULL)
+	{
+		m_foundDocument = false;
+
+		return false;
+	}
+
+	m_metaData = pDocument->m_metaData;
+	if (m_metaData["title"] == INHERITED_TITLE)
+	{
+		// As it would if the mailbox was extracted in one go
+		m_metaData["title"] = previousTitle;
+	}
+	if (is_content_streamed() == false)
+	{
+		m_content.assign(pDocument->m_content.c_str(), pDocument->m_content.length());
+	}
+	else
+	{
+		append_content(pDocument->m_content.c_str(), (unsigned int)pDocument->m_content.length());
+	}
+	delete pDocument;
+
+	return true;
+}
+
+bool GMimeMboxFilter::queueShardDocument(Shard *pShard, ShardDocument *pDocument)
+{
+	pthread_mutex_lock(&m_shardsMutex);
+	if (m_stopShards == true)
+	{
+		pthread_mutex_unlock(&m_shardsMutex);
+		delete pDocument;
+
+		return false;
+	}
+	pShard->m_documents.push_back(pDocument);
+	pthread_cond_broadcast(&m_shardsCond);
+	pthread_mutex_unlock(&m_shardsMutex);
+
+	return true;
+}
+
+bool GMimeMboxFilter::extractShard(GMimeMboxFilter *pFilter, Shard *pShard)
+{
+	char ipathStr[128];
+
+	// Ipaths are the same as when the mailbox is extracted in one go
+	pFilter->m_messagesEnd = pShard->m_end;
+	pFilter->m_defaultTitle = INHERITED_TITLE;
+	// The parent indexes messages
+	pFilter->m_messages.clear();
+	pFilter->m_indexedEnd = 0;
+	pFilter->m_isRecording = true;
+	snprintf(ipathStr, 128, "o=%llu&p=0", (unsigned long long)pShard->m_start);
+	bool foundDocument = pFilter->skip_to_document(ipathStr);
+
+	while (foundDocument == true)
+	{
+		if (queueShardDocument(pShard, new ShardDocument(*pFilter)) == false)
+		{
+			return false;
+		}
+
+		foundDocument = pFilter->next_document();
+	}
+
+	// This is read once the shard is done
+	pShard->m_messages.swap(pFilter->m_messages);
+	pFilter->m_indexedEnd = 0;
+
+	return true;
+}
+
+void *GMimeMboxFilter::runShardThread(void *pArg)
+{
+	ShardThread *pThread = (ShardThread *)pArg;
+	GMimeMboxFilter *pParent = pThread->m_pParent;
+
+	// Shards don't change while threads run
+	for (vector<Shard *>::size_type shardNum = pThread->m_firstShard;
+		shardNum < pParent->m_shards.size(); shardNum += pThread->m_shardsStep)
+	{
+		Shard *pShard = pParent->m_shards[shardNum];
+		bool stopShards = false;
+
+		// Don't get too far ahead of the client
+		pthread_mutex_lock(&pParent->m_shardsMutex);
+		while ((shardNum >= pParent->m_currentShard + pThread->m_shardsStep) &&
+			(pParent->m_stopShards == false))
+		{
+			pthread_cond_wait(&pParent->m_shardsCond, &pParent->m_shardsMutex);
+		}
+		stopShards = pParent->m_stopShards;
+		pthread_mutex_unlock(&pParent->m_shardsMutex);
+
+		if ((stopShards == true) ||
+			(pParent->extractShard(pThread->m_pFilter, pShard) == false))
+		{
+			break;
+		}
+
+		pthread_mutex_lock(&pParent->m_shardsMutex);
+		pShard->m_isDone = true;
+		pthread_cond_broadcast(&pParent->m_shardsCond);
+		pthread_mutex_unlock(&pParent->m_shardsMutex);
+	}
+
+	return NULL;
+}
+
+ssize_t GMimeMboxFilter::readMailbox(char *pBuffer, size_t bufferSize,
+	GMIME_OFFSET_TYPE offset)
+{
+	if (m_fd >= 0)
+	{
+		ssize_t bytesRead = 0;
+
+		do
+		{
+			bytesRead = pread(m_fd, pBuffer, bufferSize, (off_t)offset);
+		} while ((bytesRead == -1) &&
+			(errno == EINTR));
+
+		return bytesRead;
+	}
+
+	if ((m_pData == NULL) ||
+		(offset < 0) ||
+		(offset >= (GMIME_OFFSET_TYPE)m_dataLength))
+	{
+		return 0;
+	}
+
+	size_t bytesCount = min(bufferSize, (size_t)(m_dataLength - offset));
+	memcpy(pBuffer, m_pData + offset, bytesCount);
+
+	return (ssize_t)bytesCount;
+}
+
+GMIME_OFFSET_TYPE GMimeMboxFilter::findText(GMIME_OFFSET_TYPE offset, const string &text)
+{
+	char readBuffer[65536];
+	ssize_t bytesRead = 0;
+
+	do
+	{
+		bytesRead = readMailbox(readBuffer, 65536, offset);
+		if (bytesRead >= (ssize_t)text.length())
+		{
+			const char *pFound = std::search(readBuffer, readBuffer + bytesRead,
+				text.begin(), text.end());
+
+			if (pFound != readBuffer + bytesRead)
+			{
+				return offset + (GMIME_OFFSET_TYPE)(pFound - readBuffer);
+			}
+
+			// Reads overlap in case the text is split
+			offset += (GMIME_OFFSET_TYPE)(bytesRead - text.length() + 1);
+		}
+	} while (bytesRead >= (ssize_t)text.length());
+
+	return -1;
+}
+
+GMIME_OFFSET_TYPE GMimeMboxFilter::findFromLine(GMIME_OFFSET_TYPE offset)
+{
+	char fromStr[5];
+
+	// The offset is always at the start of a line
+	if ((readMailbox(fromStr, 5, offset) == 5) &&
+		(strncmp(fromStr, "From ", 5) == 0))
+	{
+		return offset;
+	}
+
+	GMIME_OFFSET_TYPE fromOffset = findText(offset, "\nFrom ");
+	if (fromOffset >= 0)
+	{
+		return fromOffset + 1;
+	}
+
+	return -1;
+}
+
+GMIME_OFFSET_TYPE GMimeMboxFilter::readHeaders(GMIME_OFFSET_TYPE messageStart,
+	map<string, string> &headers)
+{
+	// Read up to the empty line that ends headers
+	string headersBlock;
+	string::size_type headersEnd = string::npos, bodyStart = string::npos;
+	char readBuffer[4096];
+
+	while (headersBlock.length() < MAX_HEADERS_SIZE)
+	{
+		ssize_t bytesRead = readMailbox(readBuffer, 4096,
+			messageStart + (GMIME_OFFSET_TYPE)headersBlock.length());
+		if (bytesRead <= 0)
+		{
+			break;
+		}
+
+		string::size_type searchPos = (headersBlock.length() > 2) ? headersBlock.length() - 2 : 0;
+		headersBlock.append(readBuffer, (string::size_type)bytesRead);
+
+		string::size_type lfPos = headersBlock.find("\n\n", searchPos);
+		string::size_type crLfPos = headersBlock.find("\n\r\n", searchPos);
+		if (lfPos < crLfPos)
+		{
+			headersEnd = lfPos + 1;
+			bodyStart = lfPos + 2;
+			break;
+		}
+		else if (crLfPos != string::npos)
+		{
+			headersEnd = crLfPos + 1;
+			bodyStart = crLfPos + 3;
+			break;
+		}
+	}
+	if (bodyStart == string::npos)
+	{
+		// This message has no body
+		headersEnd = bodyStart = headersBlock.length();
+	}
+	headersBlock.resize(headersEnd);
+
+	parseHeaders(headersBlock, m_scanFrom, headers);
+
+	return messageStart + (GMIME_OFFSET_TYPE)bodyStart;
+}
+
+GMIME_OFFSET_TYPE GMimeMboxFilter::findBodyEnd(GMIME_OFFSET_TYPE bodyStart,
+	const map<string, string> &headers)
+{
+	map<string, string>::const_iterator headerIter = headers.find("content-length");
+	if (headerIter == headers.end())
+	{
+		return -1;
+	}
+
+	GMIME_OFFSET_TYPE bodyEnd = bodyStart + (GMIME_OFFSET_TYPE)atoll(headerIter->second.c_str());
+	char fromStr[6];
+	ssize_t bytesRead = readMailbox(fromStr, 6, bodyEnd);
+
+	// The length is right if the body is followed by the end of the mailbox or a From line
+	if ((bodyEnd > bodyStart) &&
+		((bytesRead == 0) ||
+		((bytesRead >= 5) && (strncmp(fromStr, "From ", 5) == 0)) ||
+		((bytesRead == 6) && (strncmp(fromStr, "\nFrom ", 6) == 0))))
+	{
+		return bodyEnd;
+	}
+
+	return -1;
+}
+
+bool GMimeMboxFilter::extractHeaders(const string &subject)
+{
+	while (m_cancelled == false)
+	{
+		// A lone message starts at the beginning
+		GMIME_OFFSET_TYPE messageStart = (m_scanFrom == true) ? findFromLine(m_scanOffset) :
+			((m_scanOffset == 0) ? 0 : -1);
+		if ((messageStart < 0) ||
+			((m_messagesEnd > 0) && (messageStart >= m_messagesEnd)))
+		{
+			break;
+		}
+
+		map<string, string> headers;
+
+		m_messageStart = messageStart;
+		m_scanOffset = readHeaders(messageStart, headers);
+#ifdef DEBUG
+		cout << "GMimeMboxFilter::extractHeaders: message at offset " << m_messageStart
+			<< ", body at " << m_scanOffset << endl;
+#endif
+
+		// Like the parser, skip the body if its length is right
+		GMIME_OFFSET_TYPE bodyEnd = findBodyEnd(m_scanOffset, headers);
+		if (bodyEnd >= 0)
+		{
+			m_scanOffset = bodyEnd;
+		}
+
+		const char *pMozStatus = NULL;
+		const char *pEvoStatus = NULL;
+
+		map<string, string>::const_iterator headerIter = headers.find("x-mozilla-status");
+		if (headerIter != headers.end())
+		{
+			pMozStatus = headerIter->second.c_str();
+		}
+		headerIter = headers.find("x-evolution");
+		if (headerIter != headers.end())
+		{
+			pEvoStatus = headerIter->second.c_str();
+		}
+		if (isDeletedMessage(pMozStatus, pEvoStatus) == true)
+		{
+			continue;
+		}
+
+		string msgSubject(subject);
+		string contentType("text/plain");
+		char posStr[128];
+
+		headerIter = headers.find("subject");
+		if (headerIter != headers.end())
+		{
+#ifdef GMIME_ENABLE_RFC2047_WORKAROUNDS
+			char *pSubject = g_mime_utils_header_decode_text(headerIter->second.c_str());
+#else
+			char *pSubject = g_mime_utils_header_decode_text((const unsigned char *)headerIter->second.c_str());
+#endif
+
+			if (pSubject != NULL)
+			{
+				msgSubject = pSubject;
+				g_free(pSubject);
+			}
+			else
+			{
+				msgSubject = headerIter->second;
+			}
+		}
+		headerIter = headers.find("date");
+		if (headerIter != headers.end())
+		{
+			m_messageDate = headerIter->second;
+		}
+		else
+		{
+			m_messageDate = getCurrentDate();
+		}
+		headerIter = headers.find("content-type");
+		if (headerIter != headers.end())
+		{
+			string::size_type typeEnd = headerIter->second.find_first_of("; \t");
+
+			contentType = headerIter->second.substr(0, typeEnd);
+			for (string::size_type charPos = 0; charPos < contentType.length(); ++charPos)
+			{
+				contentType[charPos] = (char)tolower((unsigned char)contentType[charPos]);
+			}
+		}
+
+		// New document, without content
+		m_metaData.clear();
+		m_content.clear();
+		m_metaData["title"] = msgSubject;
+		m_metaData["mimetype"] = contentType;
+		m_metaData["date"] = m_messageDate;
+		snprintf(posStr, 128, "o=%llu&p=0", (unsigned long long)m_messageStart);
+		m_metaData["ipath"] = posStr;
+
+		return true;
+	}
+
+	return false;
+}
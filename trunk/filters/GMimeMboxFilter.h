@@ -21,7 +21,11 @@
 
 #include <sys/types.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <string>
+#include <map>
+#include <deque>
+#include <vector>
 #include <gmime/gmime-object.h>
 #include <gmime/gmime-stream.h>
 #include <gmime/gmime-parser.h>
@@ -36,6 +40,21 @@
 
 namespace Dijon
 {
+    /** A filter for mailboxes.
+     * If INDEX_DIRECTORY is set, the offsets of messages found in a mailbox
+     * are kept in an index. This index is checked when skipping to a message,
+     * and extended as messages are appended to the mailbox. Skipping to an
+     * indexed message only parses that message, until next_document() goes
+     * on with the following ones, and in metadata mode its headers come from
+     * the index. Clients that
+     * indexed the mailbox before may skip to the last message they know of
+     * and go on with next_document() to get new messages only.
+     * If MAXIMUM_THREADS is set, large mailboxes are split into shards
+     * at message boundaries, and shards are extracted by several threads.
+     * If OPERATING_MODE is metadata, only messages' headers are read, and
+     * documents have metadata but no content.
+     * Files of type message/rfc822 hold a single message without a From line.
+     */
     class GMimeMboxFilter : public Filter
     {
     public:
@@ -127,17 +146,110 @@ namespace Dijon
 	std::string m_messageDate;
 	std::string m_partCharset;
 	bool m_foundDocument;
+	std::string m_indexDirectory;
+	std::string m_indexPath;
+	dev_t m_fileDevice;
+	ino_t m_fileInode;
+	off_t m_fileSize;
+	time_t m_fileModTime;
+	GMIME_OFFSET_TYPE m_indexedEnd;
+	bool m_isRecording;
+	bool m_indexChanged;
+	GMIME_OFFSET_TYPE m_messagesEnd;
+	bool m_boundedByIndex;
+	unsigned int m_maxThreads;
+	bool m_headersOnly;
+	/// The title of a message without a subject that's skipped to.
+	std::string m_defaultTitle;
+	GMIME_OFFSET_TYPE m_scanOffset;
+	bool m_scanFrom;
+
+	/// What the index knows about a message.
+	class MessageEntry
+	{
+		public:
+			MessageEntry();
+			~MessageEntry();
+
+			GMIME_OFFSET_TYPE m_start;
+			GMIME_OFFSET_TYPE m_end;
+			bool m_isDeleted;
+			std::string m_date;
+			std::string m_subject;
+			std::string m_contentType;
+	};
+
+	std::vector<MessageEntry> m_messages;
+
+	/// A document extracted from a shard.
+	class ShardDocument
+	{
+		public:
+			ShardDocument(const Filter &filter);
+			~ShardDocument();
+
+			std::map<std::string, std::string> m_metaData;
+			std::string m_content;
+
+		private:
+			ShardDocument(const ShardDocument &other);
+			ShardDocument& operator=(const ShardDocument& other);
+	};
+
+	/// A part of the mailbox and the documents extracted from it.
+	class Shard
+	{
+		public:
+			Shard(GMIME_OFFSET_TYPE start, GMIME_OFFSET_TYPE end);
+			~Shard();
+
+			GMIME_OFFSET_TYPE m_start;
+			GMIME_OFFSET_TYPE m_end;
+			std::deque<ShardDocument *> m_documents;
+			/// The messages found, for the index.
+			std::vector<MessageEntry> m_messages;
+			bool m_isDone;
+
+		private:
+			Shard(const Shard &other);
+			Shard& operator=(const Shard& other);
+	};
+
+	/// A thread that extracts every so many shards with its own filter.
+	class ShardThread
+	{
+		public:
+			ShardThread(GMimeMboxFilter *pParent, GMimeMboxFilter *pFilter,
+				unsigned int firstShard, unsigned int shardsStep);
+			~ShardThread();
+
+			GMimeMboxFilter *m_pParent;
+			GMimeMboxFilter *m_pFilter;
+			unsigned int m_firstShard;
+			unsigned int m_shardsStep;
+			pthread_t m_thread;
+
+		private:
+			ShardThread(const ShardThread &other);
+			ShardThread& operator=(const ShardThread& other);
+	};
+
+	std::vector<Shard *> m_shards;
+	std::vector<ShardThread *> m_shardThreads;
+	unsigned int m_currentShard;
+	bool m_stopShards;
+	pthread_mutex_t m_shardsMutex;
+	pthread_cond_t m_shardsCond;
 
 	class GMimeMboxPart
 	{
 		public:
-			GMimeMboxPart(const std::string &subject,
-				dstring &buffer);
+			GMimeMboxPart(const std::string &subject);
 			~GMimeMboxPart();
 
 			std::string m_subject;
 			std::string m_contentType;
-			dstring &m_buffer;
+			ssize_t m_size;
 
 		private:
 			GMimeMboxPart(const GMimeMboxPart &other);
@@ -152,9 +264,15 @@ namespace Dijon
 
 	bool initialize(void);
 
+	/// Opens the mailbox again, from m_messageStart up to m_messagesEnd if set.
+	bool reopen(void);
+
 	void finalize(bool fullReset);
 
-	bool readStream(GMimeStream *pStream, dstring &fileBuffer);
+	/// Closes the mailbox and saves its index, so that the filter may be reused.
+	virtual void rewind(void);
+
+	bool readStream(GMimeStream *pStream, ssize_t &totalSize);
 
 	bool nextPart(const std::string &subject);
 
@@ -162,6 +280,87 @@ namespace Dijon
 
 	bool extractMessage(const std::string &subject);
 
+	/** Loads the index of the opened mailbox, if it's still valid.
+	 * Returns false if the mailbox can't be indexed.
+	 */
+	bool loadIndex(void);
+
+	/** Checks the messages the index knows about are still where it says,
+	 * and flags those that were deleted since. Returns false if the index
+	 * has to be rebuilt.
+	 */
+	bool checkIndex(void);
+
+	/// Saves the index of the opened mailbox.
+	void saveIndex(void);
+
+	/// Returns the index entry of the message at the given offset, or -1.
+	int findMessage(GMIME_OFFSET_TYPE messageStart) const;
+
+	/** Adds the current message to the index if it's not there yet,
+	 * with its own subject.
+	 */
+	void recordMessage(GMIME_OFFSET_TYPE messageEnd, bool isDeleted,
+		const std::string &subject);
+
+	/// Adds the message to the index if it follows those already there.
+	void addMessage(const MessageEntry &entry);
+
+	/** Returns where the first message at or after the given offset starts,
+	 * going from the message at messageStart, or -1.
+	 */
+	GMIME_OFFSET_TYPE findShardStart(GMIME_OFFSET_TYPE messageStart,
+		GMIME_OFFSET_TYPE offset);
+
+	/// Splits the mailbox into shards and starts extracting them.
+	bool startShards(void);
+
+	/** Starts a thread for each filter, which it then owns, to extract
+	 * shards. Shards are shared out between threads in turn.
+	 */
+	bool startShardThreads(const std::vector<GMimeMboxFilter *> &filters);
+
+	/// Stops extracting shards and discards what they extracted.
+	void stopShards(void);
+
+	/// Moves to the next document extracted by shards.
+	bool nextShardDocument(void);
+
+	/** Queues a document extracted from the given shard.
+	 * Returns false if shards are being stopped.
+	 */
+	bool queueShardDocument(Shard *pShard, ShardDocument *pDocument);
+
+	/** Extracts the documents of a shard with the given filter.
+	 * Returns false if shards are being stopped.
+	 */
+	virtual bool extractShard(GMimeMboxFilter *pFilter, Shard *pShard);
+
+	/// Extracts the shards of a thread.
+	static void *runShardThread(void *pArg);
+
+	/// Reads the mailbox at the given offset, whether it's a file or data.
+	ssize_t readMailbox(char *pBuffer, size_t bufferSize, GMIME_OFFSET_TYPE offset);
+
+	/// Returns the offset of the given text at or after the given offset, or -1.
+	GMIME_OFFSET_TYPE findText(GMIME_OFFSET_TYPE offset, const std::string &text);
+
+	/// Returns the offset of the first From line at or after the given offset, or -1.
+	GMIME_OFFSET_TYPE findFromLine(GMIME_OFFSET_TYPE offset);
+
+	/// Reads the headers of the message at the given offset, and returns where its body starts.
+	GMIME_OFFSET_TYPE readHeaders(GMIME_OFFSET_TYPE messageStart,
+		std::map<std::string, std::string> &headers);
+
+	/** Returns where the body that starts at the given offset ends if
+	 * its Content-Length is right, as the parser then skips it, or -1.
+	 */
+	GMIME_OFFSET_TYPE findBodyEnd(GMIME_OFFSET_TYPE bodyStart,
+		const std::map<std::string, std::string> &headers);
+
+	/// Moves to the next message, reading only its headers.
+	bool extractHeaders(const std::string &subject);
+
     private:
 	/// GMimeMboxFilter objects cannot be copied.
 	GMimeMboxFilter(const GMimeMboxFilter &other);
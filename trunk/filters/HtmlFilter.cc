@@ -37,11 +37,18 @@ using std::map;
 using std::set;
 using std::copy;
 using std::inserter;
+using std::search;
 
 using namespace std;
 using namespace Dijon;
 
 static const unsigned int HASH_LEN = ((4 * 8 + 5) / 6);
+// How much text is passed on to a content sink at once
+static const unsigned int FLUSH_SIZE = 16384;
+// How much HTML is parsed at once when text is passed on
+static const unsigned int FEED_SIZE = 65536;
+// How much of the text after a link is kept for abstracts when text is passed on
+static const unsigned int MAX_LINK_TEXT = 65536;
 
 #ifdef _DYNAMIC_DIJON_HTMLFILTER
 DIJON_FILTER_EXPORT bool get_filter_types(std::set<std::string> &mime_types)
@@ -57,7 +64,8 @@ DIJON_FILTER_EXPORT bool check_filter_data_input(int data_input)
 	Filter::DataInput input = (Filter::DataInput)data_input;
 
 	if ((input == Filter::DOCUMENT_DATA) ||
-		(input == Filter::DOCUMENT_STRING))
+		(input == Filter::DOCUMENT_STRING) ||
+		(input == Filter::DOCUMENT_FILE_NAME))
 	{
 		return true;
 	}
@@ -77,7 +85,7 @@ struct ToLower
 	public:
 		void operator()(char &c)
 		{
-			c = (char)tolower((int)c);
+			c = (char)tolower((unsigned char)c);
 		}
 };
 
@@ -104,7 +112,7 @@ static unsigned int trimSpaces(string &str)
 
 	while ((str.empty() == false) && (pos < str.length()))
 	{
-		if (isspace(str[pos]) == 0)
+		if (isspace((unsigned char)str[pos]) == 0)
 		{
 			++pos;
 			break;
@@ -117,7 +125,7 @@ static unsigned int trimSpaces(string &str)
 	for (pos = str.length() - 1;
 		(str.empty() == false) && (pos >= 0); --pos)
 	{
-		if (isspace(str[pos]) == 0)
+		if (isspace((unsigned char)str[pos]) == 0)
 		{
 			break;
 		}
@@ -138,6 +146,25 @@ static string toLowerCase(const string &str)
         return tmp;
 }
 
+static unsigned int findDocType(const char *data_ptr, unsigned int data_length)
+{
+	static const char *docTypes[] = { "<!DOCTYPE", "<!doctype" };
+	const char *pEnd = data_ptr + data_length;
+
+	for (unsigned int docTypeNum = 0; docTypeNum < 2; ++docTypeNum)
+	{
+		const char *pDocType = search(data_ptr, pEnd,
+			docTypes[docTypeNum], docTypes[docTypeNum] + 9);
+
+		if (pDocType != pEnd)
+		{
+			return (unsigned int)(pDocType - data_ptr);
+		}
+	}
+
+	return 0;
+}
+
 static string findCharset(const string &content)
 {
 	// Is a charset specified ?
@@ -209,16 +236,19 @@ bool Link::operator<(const Link &other) const
 }
 
 HtmlFilter::ParserState::ParserState(dstring &text) :
+	m_pFilter(NULL),
 	m_isValid(true),
 	m_findAbstract(true),
 	m_textPos(0),
+	m_lastLinkEndPos(0),
 	m_inHead(false),
 	m_foundHead(false),
 	m_appendToTitle(false),
 	m_appendToText(false),
 	m_appendToLink(false),
 	m_skip(0),
-	m_text(text)
+	m_text(text),
+	m_linkTextPos(0)
 {
 }
 
@@ -226,53 +256,92 @@ HtmlFilter::ParserState::~ParserState()
 {
 }
 
-bool HtmlFilter::ParserState::get_links_text(unsigned int currentLinkIndex)
+bool HtmlFilter::ParserState::get_links_text(void)
 {
-	if ((m_links.empty() == true) ||
-		(m_currentLink.m_index == 0))
+	const char *pText = m_text.c_str();
+	unsigned int textPos = 0, textLength = m_text.length();
+	bool afterLink = false;
+
+	if (m_pFilter != NULL)
 	{
-		string abstract(m_text.c_str());
+		// Text was passed on, what's after the last link was kept
+		pText = m_linkText.c_str();
+		textPos = m_linkTextPos;
+		textLength = m_linkText.length();
+	}
 
-		trimSpaces(abstract);
+	const char *pStart = pText;
+	const char *pEnd = pText + textLength;
 
-		m_abstract = abstract;
+	if ((m_links.empty() == false) &&
+		(m_currentLink.m_index > 0))
+	{
+		// Get the text between the current link and the previous one
+		if (m_lastLinkEndPos + 1 >= m_textPos)
+		{
+			return false;
+		}
 
-		return true;
+		pStart = pText + min(m_lastLinkEndPos - textPos, textLength);
+		pEnd = pText + min(m_textPos - 1 - textPos, textLength);
+		afterLink = true;
 	}
 
-	// Get the text between the current link and the previous one
-	for (set<Link>::const_iterator linkIter = m_links.begin();
-		linkIter != m_links.end(); ++linkIter)
+	// Stop at the first NUL and trim spaces, without copying
+	const char *pNul = (const char *)memchr(pStart, '\0', pEnd - pStart);
+	if (pNul != NULL)
 	{
-		// Is this the previous link ?
-		if (linkIter->m_index == currentLinkIndex - 1)
-		{
-			// Is there text in between ?
-			if (linkIter->m_endPos + 1 < m_textPos)
-			{
-				unsigned int abstractLen = m_textPos - linkIter->m_endPos - 1;
-				string abstract(m_text.substr(linkIter->m_endPos, abstractLen).c_str());
+		pEnd = pNul;
+	}
+	while ((pStart < pEnd) &&
+		(isspace((unsigned char)*pStart) != 0))
+	{
+		++pStart;
+	}
+	while ((pEnd > pStart) &&
+		(isspace((unsigned char)*(pEnd - 1)) != 0))
+	{
+		--pEnd;
+	}
 
-				trimSpaces(abstract);
+	// The longer, the better
+	if ((afterLink == true) &&
+		((string::size_type)(pEnd - pStart) <= m_abstract.length()))
+	{
+		return false;
+	}
 
-				// The longer, the better
-				if (abstract.length() > m_abstract.length())
-				{
-					m_abstract = abstract;
+	m_abstract.assign(pStart, pEnd - pStart);
 #ifdef DEBUG
-					cout << "HtmlFilter::get_links_text: abstract after link "
-						<< linkIter->m_index << " to " << linkIter->m_url << endl;
+	if (afterLink == true)
+	{
+		cout << "HtmlFilter::get_links_text: abstract after link "
+			<< m_currentLink.m_index - 1 << endl;
+	}
 #endif
 
-					return true;
-				}
-			}
+	return true;
+}
 
-			break;
+void HtmlFilter::ParserState::append_to_text(const char *text_ptr, unsigned int text_length)
+{
+	m_text.append(text_ptr, text_length);
+	m_textPos += text_length;
+
+	if (m_pFilter != NULL)
+	{
+		// Keep the start of the text after the last link
+		if (m_linkText.length() < MAX_LINK_TEXT)
+		{
+			m_linkText.append(text_ptr, min(text_length,
+				MAX_LINK_TEXT - (unsigned int)m_linkText.length()));
 		}
-	}
 
-	return false;
+		if (m_text.length() >= FLUSH_SIZE)
+		{
+			m_pFilter->flush_text();
+		}
+	}
 }
 
 void HtmlFilter::ParserState::append_whitespace(void)
@@ -286,8 +355,7 @@ void HtmlFilter::ParserState::append_whitespace(void)
 	{
 		if (m_appendToText == true)
 		{
-			m_text += " ";
-			m_textPos += 1;
+			append_to_text(" ", 1);
 		}
 
 		// Appending to text and to link are not mutually exclusive operations
@@ -309,8 +377,7 @@ void HtmlFilter::ParserState::append_text(const string &text)
 	{
 		if (m_appendToText == true)
 		{
-			m_text.append(text.c_str(), text.length());
-			m_textPos += text.length();
+			append_to_text(text.c_str(), text.length());
 		}
 
 		// Appending to text and to link are not mutually exclusive operations
@@ -373,9 +440,8 @@ void HtmlFilter::ParserState::opening_tag(const string &tag)
 	}
 
 	// What tag is this ?
-	string tagName(toLowerCase(tag));
 	if ((m_foundHead == false) &&
-		(tagName == "head"))
+		(current_tag == TAG_HEAD))
 	{
 		// Expect to find META tags and a title
 		m_inHead = true;
@@ -383,7 +449,7 @@ void HtmlFilter::ParserState::opening_tag(const string &tag)
 		m_foundHead = true;
 	}
 	else if ((m_inHead == true) &&
-		(tagName == "meta"))
+		(current_tag == TAG_META))
 	{
 		string metaName, metaContent, httpEquiv;
 
@@ -415,17 +481,17 @@ void HtmlFilter::ParserState::opening_tag(const string &tag)
 		}
 	}
 	else if ((m_inHead == true) &&
-		(tagName == "title"))
+		(current_tag == TAG_TITLE))
 	{
 		// Extract title
 		m_appendToTitle = true;
 	}
-	else if (tagName == "body")
+	else if (current_tag == TAG_BODY)
 	{
 		// Index text
 		m_appendToText = true;
 	}
-	else if (tagName == "a")
+	else if (current_tag == TAG_A)
 	{
 		m_currentLink.m_url.clear();
 		m_currentLink.m_name.clear();
@@ -441,14 +507,14 @@ void HtmlFilter::ParserState::opening_tag(const string &tag)
 			// Find abstract ?
 			if (m_findAbstract == true)
 			{
-				get_links_text(m_currentLink.m_index);
+				get_links_text();
 			}
 
 			// Extract link
 			m_appendToLink = true;
 		}
 	}
-	else if (tagName == "frame")
+	else if (current_tag == TAG_FRAME)
 	{
 		Link frame;
 
@@ -462,9 +528,9 @@ void HtmlFilter::ParserState::opening_tag(const string &tag)
 			m_frames.insert(frame);
 		}
 	}
-	else if ((tagName == "frameset") ||
-		(tagName == "script") ||
-		(tagName == "style"))
+	else if ((current_tag == TAG_FRAMESET) ||
+		(current_tag == TAG_SCRIPT) ||
+		(current_tag == TAG_STYLE))
 	{
 		// Skip
 		++m_skip;
@@ -477,8 +543,7 @@ void HtmlFilter::ParserState::opening_tag(const string &tag)
 	}
 	if (m_appendToText == true)
 	{
-		m_text += " ";
-		m_textPos += 1;
+		append_to_text(" ", 1);
 	}
 	if (m_appendToLink == true)
 	{
@@ -494,12 +559,11 @@ void HtmlFilter::ParserState::closing_tag(const string &tag)
 	}
 
 	// Reset state
-	string tagName(toLowerCase(tag));
-	if (tagName == "head")
+	if (current_tag == TAG_HEAD)
 	{
 		m_inHead = false;
 	}
-	else if (tagName == "title")
+	else if (current_tag == TAG_TITLE)
 	{
 		trimSpaces(m_title);
 		removeCharacters(m_title, "\r\n");
@@ -508,18 +572,20 @@ void HtmlFilter::ParserState::closing_tag(const string &tag)
 #endif
 		m_appendToTitle = false;
 	}
-	else if (tagName == "body")
+	else if (current_tag == TAG_BODY)
 	{
 		m_appendToText = false;
 	}
-	else if (tagName == "a")
+	else if (current_tag == TAG_A)
 	{
 		if (m_currentLink.m_url.empty() == false)
 		{
 			trimSpaces(m_currentLink.m_name);
 			removeCharacters(m_currentLink.m_name, "\r\n");
 
-			m_currentLink.m_endPos = m_textPos;
+			m_currentLink.m_endPos = m_lastLinkEndPos = m_textPos;
+			m_linkText.clear();
+			m_linkTextPos = m_textPos;
 
 			// Store this link
 			m_links.insert(m_currentLink);
@@ -528,9 +594,9 @@ void HtmlFilter::ParserState::closing_tag(const string &tag)
 
 		m_appendToLink = false;
 	}
-	else if ((tagName == "frameset") ||
-		(tagName == "script") ||
-		(tagName == "style"))
+	else if ((current_tag == TAG_FRAMESET) ||
+		(current_tag == TAG_SCRIPT) ||
+		(current_tag == TAG_STYLE))
 	{
 		--m_skip;
 	}
@@ -540,7 +606,8 @@ HtmlFilter::HtmlFilter(const string &mime_type) :
 	Filter(mime_type),
 	m_pParserState(NULL),
 	m_skipText(false),
-	m_findAbstract(true)
+	m_findAbstract(true),
+	m_feeding(false)
 {
 }
 
@@ -552,7 +619,8 @@ HtmlFilter::~HtmlFilter()
 bool HtmlFilter::is_data_input_ok(DataInput input) const
 {
 	if ((input == DOCUMENT_DATA) ||
-		(input == DOCUMENT_STRING))
+		(input == DOCUMENT_STRING) ||
+		(input == DOCUMENT_FILE_NAME))
 	{
 		return true;
 	}
@@ -591,50 +659,98 @@ bool HtmlFilter::set_document_data(const char *data_ptr, unsigned int data_lengt
 		return false;
 	}
 
-	string html_doc(data_ptr, data_length);
-	return set_document_string(html_doc);
+	rewind();
+
+	// The caller keeps the data around, so there's no need to copy it
+	return parse_html(data_ptr, data_length);
 }
 
 bool HtmlFilter::set_document_string(const string &data_str)
 {
-	if (data_str.empty() == true)
+	return set_document_data(data_str.c_str(), data_str.length());
+}
+
+bool HtmlFilter::set_document_file(const string &file_path, bool unlink_when_done)
+{
+	if ((Filter::set_document_file(file_path, unlink_when_done) == false) ||
+		(map_file() == false))
 	{
 		return false;
 	}
 
-	rewind();
+	bool parsedHtml = parse_html(m_pMappedFile, m_mappedLength);
 
-	// Try to cope with pages that have scripts or other rubbish prepended
-	string::size_type htmlPos = data_str.find("<!DOCTYPE");
-	if (htmlPos == string::npos)
-	{
-		htmlPos = data_str.find("<!doctype");
-	}
-	if ((htmlPos != string::npos) &&
-		(htmlPos > 0))
+	// Parsing doesn't refer back to the input
+	unmap_file();
+
+	return parsedHtml;
+}
+
+bool HtmlFilter::set_document_uri(const string &uri)
+{
+	return false;
+}
+
+bool HtmlFilter::feed_document_data(const char *data_ptr, unsigned int data_length)
+{
+	if (m_feeding == false)
 	{
+		if ((data_ptr == NULL) ||
+			(data_length == 0))
+		{
+			return false;
+		}
+
+		rewind();
+
+		// Only the first chunk is checked for rubbish
+		unsigned int htmlPos = findDocType(data_ptr, data_length);
+		if (htmlPos > 0)
+		{
 #ifdef DEBUG
-		cout << "HtmlFilter::set_document_string: removed " << htmlPos << " characters" << endl;
+			cout << "HtmlFilter::feed_document_data: removed " << htmlPos << " characters" << endl;
 #endif
-		return parse_html(data_str.substr(htmlPos));
+			data_ptr += htmlPos;
+			data_length -= htmlPos;
+		}
+
+		start_parsing();
+		m_feeding = true;
+	}
+	else if (m_abortedContent == true)
+	{
+		return false;
 	}
 
-	return parse_html(data_str);
-}
+	if ((data_ptr != NULL) &&
+		(data_length > 0))
+	{
+		feed_parser(data_ptr, data_length);
+		// What may continue in the next chunk is kept
+		m_copiedSize = (off_t)m_pParserState->get_copied_size();
+	}
 
-bool HtmlFilter::set_document_file(const string &file_path, bool unlink_when_done)
-{
-	return false;
+	return !m_abortedContent;
 }
 
-bool HtmlFilter::set_document_uri(const string &uri)
+bool HtmlFilter::finish_document_data(void)
 {
-	return false;
+	if (m_feeding == false)
+	{
+		return false;
+	}
+
+	m_pParserState->finish();
+	m_feeding = false;
+	end_parsing();
+
+	return true;
 }
 
 bool HtmlFilter::has_documents(void) const
 {
-	if (m_pParserState != NULL)
+	if ((m_pParserState != NULL) &&
+		(m_feeding == false))
 	{
 		return true;
 	}
@@ -644,7 +760,8 @@ bool HtmlFilter::has_documents(void) const
 
 bool HtmlFilter::next_document(void)
 {
-	if (m_pParserState != NULL)
+	if ((m_pParserState != NULL) &&
+		(m_feeding == false))
 	{
 		m_metaData["charset"] = m_pParserState->m_charset;
 		m_metaData["title"] = m_pParserState->m_title;
@@ -695,30 +812,116 @@ void HtmlFilter::rewind(void)
 		delete m_pParserState;
 		m_pParserState = NULL;
 	}
+	m_feeding = false;
+	m_parsedText.clear();
 }
 
-bool HtmlFilter::parse_html(const string &html)
+bool HtmlFilter::parse_html(const char *html_ptr, unsigned int html_length)
 {
-
-	if (html.length() == true)
+	if ((html_ptr == NULL) ||
+		(html_length == 0))
 	{
 		return false;
 	}
 
+	// Try to cope with pages that have scripts or other rubbish prepended
+	unsigned int htmlPos = findDocType(html_ptr, html_length);
+	if (htmlPos > 0)
+	{
+#ifdef DEBUG
+		cout << "HtmlFilter::parse_html: removed " << htmlPos << " characters" << endl;
+#endif
+		html_ptr += htmlPos;
+		html_length -= htmlPos;
+	}
+
+	start_parsing();
+
+	if (m_pContentSink != NULL)
+	{
+		feed_parser(html_ptr, html_length);
+		if (m_abortedContent == false)
+		{
+			m_pParserState->finish();
+		}
+	}
+	else
+	{
+		m_pParserState->parse_html(html_ptr, html_length);
+	}
+	m_copiedSize = (off_t)m_pParserState->get_copied_size();
+
+	end_parsing();
+#ifdef DEBUG
+	cout << "HtmlFilter::parse_html: copied " << m_copiedSize << " bytes" << endl;
+#endif
+
+	return true;
+}
+
+void HtmlFilter::start_parsing(void)
+{
 	m_content.clear();
-	m_pParserState = new ParserState(m_content);
+	m_parsedText.clear();
+	// Text may be passed on before next_document() is called
+	m_metaData["mimetype"] = "text/plain";
+	if (m_pContentSink != NULL)
+	{
+		// Text is passed on as it comes, and only what abstracts need is kept
+		m_pParserState = new ParserState(m_parsedText);
+		m_pParserState->m_pFilter = this;
+	}
+	else
+	{
+		m_pParserState = new ParserState(m_content);
+	}
 	if (m_skipText == true)
 	{
 		++m_pParserState->m_skip;
 	}
+}
+
+void HtmlFilter::feed_parser(const char *data_ptr, unsigned int data_length)
+{
+	if (m_pContentSink == NULL)
+	{
+		m_pParserState->feed(data_ptr, data_length);
+		return;
+	}
 
-	// FIXME: parse here
-	m_pParserState->parse_html(html);
+	// Stop as soon as the sink doesn't want more text
+	while ((data_length > 0) &&
+		(m_abortedContent == false) &&
+		(m_cancelled == false))
+	{
+		unsigned int chunkLength = min(data_length, FEED_SIZE);
 
+		m_pParserState->feed(data_ptr, chunkLength);
+		flush_text();
+		data_ptr += chunkLength;
+		data_length -= chunkLength;
+	}
+}
+
+void HtmlFilter::flush_text(void)
+{
+	if ((m_pContentSink == NULL) ||
+		(m_parsedText.empty() == true))
+	{
+		return;
+	}
+
+	// Pass on what was added since the last time
+	append_content(m_parsedText.c_str(), m_parsedText.length());
+	m_parsedText.clear();
+}
+
+void HtmlFilter::end_parsing(void)
+{
 	// The text after the last link might make a good abstract
 	if (m_pParserState->m_findAbstract == true)
 	{
-		m_pParserState->get_links_text(m_pParserState->m_currentLink.m_index);
+		m_pParserState->get_links_text();
 	}
 
 	// Append META keywords, if any were found
@@ -728,9 +931,11 @@ bool HtmlFilter::parse_html(const string &html)
 		m_pParserState->m_text.append(keywordsIter->second.c_str(), keywordsIter->second.length());
 	}
 #ifdef DEBUG
-	cout << "HtmlFilter::parse_html: " << m_pParserState->m_text.size() << " bytes of text" << endl;
+	cout << "HtmlFilter::end_parsing: " << m_pParserState->m_text.size() << " bytes of text" << endl;
 #endif
 
+	flush_text();
+
 	// Assume charset is UTF-8 by default
 	if (m_pParserState->m_charset.empty() == true)
 	{
@@ -740,11 +945,9 @@ bool HtmlFilter::parse_html(const string &html)
 	{
 		m_pParserState->m_charset = toLowerCase(m_pParserState->m_charset);
 #ifdef DEBUG
-		cout << "HtmlFilter::parse_html: found charset " << m_pParserState->m_charset << endl;
+		cout << "HtmlFilter::end_parsing: found charset " << m_pParserState->m_charset << endl;
 #endif
 	}
-
-	return true;
 }
 
 bool HtmlFilter::get_links(set<Link> &links) const
@@ -95,6 +95,20 @@ namespace Dijon
 	 */
 	virtual bool set_document_uri(const std::string &uri);
 
+	/** (Re)initializes the filter and parses the given chunk of data,
+	 * or parses the next chunk if this was already called.
+	 * Chunks don't need to be kept around once this returns.
+	 * Call finish_document_data() after the last chunk.
+	 * Returns false if an error occured or the content sink stopped.
+	 */
+	bool feed_document_data(const char *data_ptr, unsigned int data_length);
+
+	/** Parses what's left of the chunks passed to feed_document_data().
+	 * Call next_document() to position the filter onto the first document.
+	 * Returns false if no data was fed.
+	 */
+	bool finish_document_data(void);
+
 
 	// Going from one nested document to the next.
 
@@ -133,11 +147,13 @@ namespace Dijon
 			virtual void opening_tag(const string &tag);
 			virtual void closing_tag(const string &tag);
 
-			bool get_links_text(unsigned int currentLinkIndex);
+			bool get_links_text(void);
 
+			HtmlFilter *m_pFilter;
 			bool m_isValid;
 			bool m_findAbstract;
 			unsigned int m_textPos;
+			unsigned int m_lastLinkEndPos;
 			bool m_inHead;
 			bool m_foundHead;
 			bool m_appendToTitle;
@@ -147,6 +163,8 @@ namespace Dijon
 			std::string m_charset;
 			std::string m_title;
 			dstring &m_text;
+			std::string m_linkText;
+			unsigned int m_linkTextPos;
 			std::string m_abstract;
 			Link m_currentLink;
 			std::set<Link> m_links;
@@ -154,6 +172,7 @@ namespace Dijon
 			std::map<std::string, std::string> m_metaTags;
 
 		protected:
+			void append_to_text(const char *text_ptr, unsigned int text_length);
 			void append_whitespace(void);
 			void append_text(const string &text);
 
@@ -164,10 +183,23 @@ namespace Dijon
 	std::string m_error;
 	bool m_skipText;
 	bool m_findAbstract;
+	bool m_feeding;
+	dstring m_parsedText;
 
 	virtual void rewind(void);
 
-	bool parse_html(const string &html);
+	bool parse_html(const char *html_ptr, unsigned int html_length);
+
+	void start_parsing(void);
+
+	/** Feeds data to the parser. If text goes to a content sink,
+	 * parsing stops as soon as it doesn't want more.
+	 */
+	void feed_parser(const char *data_ptr, unsigned int data_length);
+
+	void flush_text(void);
+
+	void end_parsing(void);
 
     private:
 	/// HtmlFilter objects cannot be copied.
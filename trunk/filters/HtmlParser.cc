@@ -40,8 +40,6 @@ lowercase_string(string &str)
     }
 }
 
-map<string, unsigned int> HtmlParser::named_ents;
-
 inline static bool
 p_notdigit(char c)
 {
@@ -111,350 +109,692 @@ nonascii_to_utf8(unsigned ch, char * buf)
     return 0;
 }
 
-bool
-HtmlParser::get_parameter(const string & param, string & value)
-{
-    map<string, string>::const_iterator i = parameters.find(param);
-    if (i == parameters.end()) return false;
-    value = i->second;
-    return true;
-}
-
-HtmlParser::HtmlParser()
-{
-    static const struct ent { const char *n; unsigned int v; } ents[] = {
 // Names and values from: "Character entity references in HTML 4"
 // http://www.w3.org/TR/html4/sgml/entities.html
-{ "quot", 34 },
-{ "amp", 38 },
-{ "apos", 39 }, // Not in HTML 4 list but used in OpenOffice XML.
-{ "lt", 60 },
-{ "gt", 62 },
-{ "nbsp", 160 },
-{ "iexcl", 161 },
-{ "cent", 162 },
-{ "pound", 163 },
-{ "curren", 164 },
-{ "yen", 165 },
-{ "brvbar", 166 },
-{ "sect", 167 },
-{ "uml", 168 },
-{ "copy", 169 },
-{ "ordf", 170 },
-{ "laquo", 171 },
-{ "not", 172 },
-{ "shy", 173 },
-{ "reg", 174 },
-{ "macr", 175 },
-{ "deg", 176 },
-{ "plusmn", 177 },
-{ "sup2", 178 },
-{ "sup3", 179 },
-{ "acute", 180 },
-{ "micro", 181 },
-{ "para", 182 },
-{ "middot", 183 },
-{ "cedil", 184 },
-{ "sup1", 185 },
-{ "ordm", 186 },
-{ "raquo", 187 },
-{ "frac14", 188 },
-{ "frac12", 189 },
-{ "frac34", 190 },
-{ "iquest", 191 },
-{ "Agrave", 192 },
+// Sorted by name in strcmp() order, so that entities can be looked up
+// with a binary search.
+static const struct named_ent { const char *n; unsigned int v; } named_ents[] = {
+{ "AElig", 198 },
 { "Aacute", 193 },
 { "Acirc", 194 },
+{ "Agrave", 192 },
+{ "Alpha", 913 },
+{ "Aring", 197 },
 { "Atilde", 195 },
 { "Auml", 196 },
-{ "Aring", 197 },
-{ "AElig", 198 },
+{ "Beta", 914 },
 { "Ccedil", 199 },
-{ "Egrave", 200 },
+{ "Chi", 935 },
+{ "Dagger", 8225 },
+{ "Delta", 916 },
+{ "ETH", 208 },
 { "Eacute", 201 },
 { "Ecirc", 202 },
+{ "Egrave", 200 },
+{ "Epsilon", 917 },
+{ "Eta", 919 },
 { "Euml", 203 },
-{ "Igrave", 204 },
+{ "Gamma", 915 },
 { "Iacute", 205 },
 { "Icirc", 206 },
+{ "Igrave", 204 },
+{ "Iota", 921 },
 { "Iuml", 207 },
-{ "ETH", 208 },
+{ "Kappa", 922 },
+{ "Lambda", 923 },
+{ "Mu", 924 },
 { "Ntilde", 209 },
-{ "Ograve", 210 },
+{ "Nu", 925 },
+{ "OElig", 338 },
 { "Oacute", 211 },
 { "Ocirc", 212 },
+{ "Ograve", 210 },
+{ "Omega", 937 },
+{ "Omicron", 927 },
+{ "Oslash", 216 },
 { "Otilde", 213 },
 { "Ouml", 214 },
-{ "times", 215 },
-{ "Oslash", 216 },
-{ "Ugrave", 217 },
+{ "Phi", 934 },
+{ "Pi", 928 },
+{ "Prime", 8243 },
+{ "Psi", 936 },
+{ "Rho", 929 },
+{ "Scaron", 352 },
+{ "Sigma", 931 },
+{ "THORN", 222 },
+{ "Tau", 932 },
+{ "Theta", 920 },
 { "Uacute", 218 },
 { "Ucirc", 219 },
+{ "Ugrave", 217 },
+{ "Upsilon", 933 },
 { "Uuml", 220 },
+{ "Xi", 926 },
 { "Yacute", 221 },
-{ "THORN", 222 },
-{ "szlig", 223 },
-{ "agrave", 224 },
+{ "Yuml", 376 },
+{ "Zeta", 918 },
 { "aacute", 225 },
 { "acirc", 226 },
+{ "acute", 180 },
+{ "aelig", 230 },
+{ "agrave", 224 },
+{ "alefsym", 8501 },
+{ "alpha", 945 },
+{ "amp", 38 },
+{ "and", 8743 },
+{ "ang", 8736 },
+{ "apos", 39 }, // Not in HTML 4 list but used in OpenOffice XML.
+{ "aring", 229 },
+{ "asymp", 8776 },
 { "atilde", 227 },
 { "auml", 228 },
-{ "aring", 229 },
-{ "aelig", 230 },
+{ "bdquo", 8222 },
+{ "beta", 946 },
+{ "brvbar", 166 },
+{ "bull", 8226 },
+{ "cap", 8745 },
 { "ccedil", 231 },
-{ "egrave", 232 },
+{ "cedil", 184 },
+{ "cent", 162 },
+{ "chi", 967 },
+{ "circ", 710 },
+{ "clubs", 9827 },
+{ "cong", 8773 },
+{ "copy", 169 },
+{ "crarr", 8629 },
+{ "cup", 8746 },
+{ "curren", 164 },
+{ "dArr", 8659 },
+{ "dagger", 8224 },
+{ "darr", 8595 },
+{ "deg", 176 },
+{ "delta", 948 },
+{ "diams", 9830 },
+{ "divide", 247 },
 { "eacute", 233 },
 { "ecirc", 234 },
-{ "euml", 235 },
-{ "igrave", 236 },
-{ "iacute", 237 },
-{ "icirc", 238 },
-{ "iuml", 239 },
+{ "egrave", 232 },
+{ "empty", 8709 },
+{ "emsp", 8195 },
+{ "ensp", 8194 },
+{ "epsilon", 949 },
+{ "equiv", 8801 },
+{ "eta", 951 },
 { "eth", 240 },
-{ "ntilde", 241 },
-{ "ograve", 242 },
-{ "oacute", 243 },
-{ "ocirc", 244 },
-{ "otilde", 245 },
-{ "ouml", 246 },
-{ "divide", 247 },
-{ "oslash", 248 },
-{ "ugrave", 249 },
-{ "uacute", 250 },
-{ "ucirc", 251 },
-{ "uuml", 252 },
-{ "yacute", 253 },
-{ "thorn", 254 },
-{ "yuml", 255 },
-{ "OElig", 338 },
-{ "oelig", 339 },
-{ "Scaron", 352 },
-{ "scaron", 353 },
-{ "Yuml", 376 },
+{ "euml", 235 },
+{ "euro", 8364 },
+{ "exist", 8707 },
 { "fnof", 402 },
-{ "circ", 710 },
-{ "tilde", 732 },
-{ "Alpha", 913 },
-{ "Beta", 914 },
-{ "Gamma", 915 },
-{ "Delta", 916 },
-{ "Epsilon", 917 },
-{ "Zeta", 918 },
-{ "Eta", 919 },
-{ "Theta", 920 },
-{ "Iota", 921 },
-{ "Kappa", 922 },
-{ "Lambda", 923 },
-{ "Mu", 924 },
-{ "Nu", 925 },
-{ "Xi", 926 },
-{ "Omicron", 927 },
-{ "Pi", 928 },
-{ "Rho", 929 },
-{ "Sigma", 931 },
-{ "Tau", 932 },
-{ "Upsilon", 933 },
-{ "Phi", 934 },
-{ "Chi", 935 },
-{ "Psi", 936 },
-{ "Omega", 937 },
-{ "alpha", 945 },
-{ "beta", 946 },
+{ "forall", 8704 },
+{ "frac12", 189 },
+{ "frac14", 188 },
+{ "frac34", 190 },
+{ "frasl", 8260 },
 { "gamma", 947 },
-{ "delta", 948 },
-{ "epsilon", 949 },
-{ "zeta", 950 },
-{ "eta", 951 },
-{ "theta", 952 },
-{ "iota", 953 },
-{ "kappa", 954 },
-{ "lambda", 955 },
-{ "mu", 956 },
-{ "nu", 957 },
-{ "xi", 958 },
-{ "omicron", 959 },
-{ "pi", 960 },
-{ "rho", 961 },
-{ "sigmaf", 962 },
-{ "sigma", 963 },
-{ "tau", 964 },
-{ "upsilon", 965 },
-{ "phi", 966 },
-{ "chi", 967 },
-{ "psi", 968 },
-{ "omega", 969 },
-{ "thetasym", 977 },
-{ "upsih", 978 },
-{ "piv", 982 },
-{ "ensp", 8194 },
-{ "emsp", 8195 },
-{ "thinsp", 8201 },
-{ "zwnj", 8204 },
-{ "zwj", 8205 },
-{ "lrm", 8206 },
-{ "rlm", 8207 },
-{ "ndash", 8211 },
-{ "mdash", 8212 },
-{ "lsquo", 8216 },
-{ "rsquo", 8217 },
-{ "sbquo", 8218 },
-{ "ldquo", 8220 },
-{ "rdquo", 8221 },
-{ "bdquo", 8222 },
-{ "dagger", 8224 },
-{ "Dagger", 8225 },
-{ "bull", 8226 },
+{ "ge", 8805 },
+{ "gt", 62 },
+{ "hArr", 8660 },
+{ "harr", 8596 },
+{ "hearts", 9829 },
 { "hellip", 8230 },
-{ "permil", 8240 },
-{ "prime", 8242 },
-{ "Prime", 8243 },
-{ "lsaquo", 8249 },
-{ "rsaquo", 8250 },
-{ "oline", 8254 },
-{ "frasl", 8260 },
-{ "euro", 8364 },
+{ "iacute", 237 },
+{ "icirc", 238 },
+{ "iexcl", 161 },
+{ "igrave", 236 },
 { "image", 8465 },
-{ "weierp", 8472 },
-{ "real", 8476 },
-{ "trade", 8482 },
-{ "alefsym", 8501 },
-{ "larr", 8592 },
-{ "uarr", 8593 },
-{ "rarr", 8594 },
-{ "darr", 8595 },
-{ "harr", 8596 },
-{ "crarr", 8629 },
-{ "lArr", 8656 },
-{ "uArr", 8657 },
-{ "rArr", 8658 },
-{ "dArr", 8659 },
-{ "hArr", 8660 },
-{ "forall", 8704 },
-{ "part", 8706 },
-{ "exist", 8707 },
-{ "empty", 8709 },
-{ "nabla", 8711 },
-{ "isin", 8712 },
-{ "notin", 8713 },
-{ "ni", 8715 },
-{ "prod", 8719 },
-{ "sum", 8721 },
-{ "minus", 8722 },
-{ "lowast", 8727 },
-{ "radic", 8730 },
-{ "prop", 8733 },
 { "infin", 8734 },
-{ "ang", 8736 },
-{ "and", 8743 },
-{ "or", 8744 },
-{ "cap", 8745 },
-{ "cup", 8746 },
 { "int", 8747 },
-{ "there4", 8756 },
-{ "sim", 8764 },
-{ "cong", 8773 },
-{ "asymp", 8776 },
-{ "ne", 8800 },
-{ "equiv", 8801 },
+{ "iota", 953 },
+{ "iquest", 191 },
+{ "isin", 8712 },
+{ "iuml", 239 },
+{ "kappa", 954 },
+{ "lArr", 8656 },
+{ "lambda", 955 },
+{ "lang", 9001 },
+{ "laquo", 171 },
+{ "larr", 8592 },
+{ "lceil", 8968 },
+{ "ldquo", 8220 },
 { "le", 8804 },
-{ "ge", 8805 },
-{ "sub", 8834 },
-{ "sup", 8835 },
+{ "lfloor", 8970 },
+{ "lowast", 8727 },
+{ "loz", 9674 },
+{ "lrm", 8206 },
+{ "lsaquo", 8249 },
+{ "lsquo", 8216 },
+{ "lt", 60 },
+{ "macr", 175 },
+{ "mdash", 8212 },
+{ "micro", 181 },
+{ "middot", 183 },
+{ "minus", 8722 },
+{ "mu", 956 },
+{ "nabla", 8711 },
+{ "nbsp", 160 },
+{ "ndash", 8211 },
+{ "ne", 8800 },
+{ "ni", 8715 },
+{ "not", 172 },
+{ "notin", 8713 },
 { "nsub", 8836 },
-{ "sube", 8838 },
-{ "supe", 8839 },
+{ "ntilde", 241 },
+{ "nu", 957 },
+{ "oacute", 243 },
+{ "ocirc", 244 },
+{ "oelig", 339 },
+{ "ograve", 242 },
+{ "oline", 8254 },
+{ "omega", 969 },
+{ "omicron", 959 },
 { "oplus", 8853 },
+{ "or", 8744 },
+{ "ordf", 170 },
+{ "ordm", 186 },
+{ "oslash", 248 },
+{ "otilde", 245 },
 { "otimes", 8855 },
+{ "ouml", 246 },
+{ "para", 182 },
+{ "part", 8706 },
+{ "permil", 8240 },
 { "perp", 8869 },
-{ "sdot", 8901 },
-{ "lceil", 8968 },
+{ "phi", 966 },
+{ "pi", 960 },
+{ "piv", 982 },
+{ "plusmn", 177 },
+{ "pound", 163 },
+{ "prime", 8242 },
+{ "prod", 8719 },
+{ "prop", 8733 },
+{ "psi", 968 },
+{ "quot", 34 },
+{ "rArr", 8658 },
+{ "radic", 8730 },
+{ "rang", 9002 },
+{ "raquo", 187 },
+{ "rarr", 8594 },
 { "rceil", 8969 },
-{ "lfloor", 8970 },
+{ "rdquo", 8221 },
+{ "real", 8476 },
+{ "reg", 174 },
 { "rfloor", 8971 },
-{ "lang", 9001 },
-{ "rang", 9002 },
-{ "loz", 9674 },
+{ "rho", 961 },
+{ "rlm", 8207 },
+{ "rsaquo", 8250 },
+{ "rsquo", 8217 },
+{ "sbquo", 8218 },
+{ "scaron", 353 },
+{ "sdot", 8901 },
+{ "sect", 167 },
+{ "shy", 173 },
+{ "sigma", 963 },
+{ "sigmaf", 962 },
+{ "sim", 8764 },
 { "spades", 9824 },
-{ "clubs", 9827 },
-{ "hearts", 9829 },
-{ "diams", 9830 },
-{ NULL, 0 }
-    };
-    if (named_ents.empty()) {
-	const struct ent *i = ents;
-	while (i->n) {
-	    named_ents[string(i->n)] = i->v;
-	    ++i;
+{ "sub", 8834 },
+{ "sube", 8838 },
+{ "sum", 8721 },
+{ "sup", 8835 },
+{ "sup1", 185 },
+{ "sup2", 178 },
+{ "sup3", 179 },
+{ "supe", 8839 },
+{ "szlig", 223 },
+{ "tau", 964 },
+{ "there4", 8756 },
+{ "theta", 952 },
+{ "thetasym", 977 },
+{ "thinsp", 8201 },
+{ "thorn", 254 },
+{ "tilde", 732 },
+{ "times", 215 },
+{ "trade", 8482 },
+{ "uArr", 8657 },
+{ "uacute", 250 },
+{ "uarr", 8593 },
+{ "ucirc", 251 },
+{ "ugrave", 249 },
+{ "uml", 168 },
+{ "upsih", 978 },
+{ "upsilon", 965 },
+{ "uuml", 252 },
+{ "weierp", 8472 },
+{ "xi", 958 },
+{ "yacute", 253 },
+{ "yen", 165 },
+{ "yuml", 255 },
+{ "zeta", 950 },
+{ "zwj", 8205 },
+{ "zwnj", 8204 },
+};
+
+static const unsigned int named_ents_count = sizeof(named_ents) / sizeof(named_ents[0]);
+
+static unsigned int
+lookup_named_entity(const char *name, size_t name_len)
+{
+    unsigned int low = 0, high = named_ents_count;
+
+    while (low < high) {
+	unsigned int mid = (low + high) / 2;
+	const char *ent_name = named_ents[mid].n;
+	int cmp = strncmp(ent_name, name, name_len);
+	if (cmp == 0 && ent_name[name_len] != '\0') cmp = 1;
+
+	if (cmp == 0) return named_ents[mid].v;
+	if (cmp < 0) {
+	    low = mid + 1;
+	} else {
+	    high = mid;
+	}
+    }
+
+    return 0;
+}
+
+// Tags the parser and its users care about, sorted by name.
+static const struct tag_name { const char *n; HtmlParser::tag_id id; } tag_names[] = {
+{ "a", HtmlParser::TAG_A },
+{ "body", HtmlParser::TAG_BODY },
+{ "frame", HtmlParser::TAG_FRAME },
+{ "frameset", HtmlParser::TAG_FRAMESET },
+{ "head", HtmlParser::TAG_HEAD },
+{ "meta", HtmlParser::TAG_META },
+{ "script", HtmlParser::TAG_SCRIPT },
+{ "style", HtmlParser::TAG_STYLE },
+{ "title", HtmlParser::TAG_TITLE },
+};
+
+static const unsigned int tag_names_count = sizeof(tag_names) / sizeof(tag_names[0]);
+
+HtmlParser::tag_id
+HtmlParser::lookup_tag(const string &tag)
+{
+    unsigned int low = 0, high = tag_names_count;
+
+    while (low < high) {
+	unsigned int mid = (low + high) / 2;
+	int cmp = tag.compare(tag_names[mid].n);
+
+	if (cmp == 0) return tag_names[mid].id;
+	if (cmp > 0) {
+	    low = mid + 1;
+	} else {
+	    high = mid;
+	}
+    }
+
+    return TAG_OTHER;
+}
+
+// Moves start past the next parameter of a tag, or returns false at the
+// end of the tag.  value is NULL for parameters that have no value.
+// unclosed is set if a quoted value runs past the end of the buffer.
+static bool
+next_parameter(const char *&start, const char *end,
+	       const char *&name, const char *&name_end,
+	       const char *&value, const char *&value_end, bool &unclosed)
+{
+    if (start >= end || *start == '>') return false;
+
+    const char *p = find_if(start, end, p_whitespaceeqgt);
+    name = start;
+    name_end = p;
+    value = value_end = NULL;
+
+    p = find_if(p, end, p_notwhitespace);
+
+    start = p;
+    if (start != end && *start == '=') {
+	start = find_if(start + 1, end, p_notwhitespace);
+
+	p = end;
+
+	int quote = (start != end) ? *start : 0;
+	if (quote == '"' || quote == '\'') {
+	    start++;
+	    p = find(start, end, quote);
+	    if (p == end) unclosed = true;
+	}
+
+	if (p == end) {
+	    // unquoted or no closing quote
+	    p = find_if(start, end, p_whitespacegt);
 	}
+	value = start;
+	value_end = p;
+	start = find_if(p, end, p_notwhitespace);
+    }
+
+    return true;
+}
+
+bool
+HtmlParser::get_parameter(const char *param, string & value) const
+{
+    const char *start = tag_params, *name, *name_end, *value_begin, *value_end;
+    string::size_type param_len = strlen(param);
+    bool unclosed = false;
+
+    // Parameters are only parsed when asked for.
+    while (next_parameter(start, tag_params_end, name, name_end,
+			  value_begin, value_end, unclosed)) {
+	if (value_begin == NULL ||
+	    static_cast<string::size_type>(name_end - name) != param_len) continue;
+
+	string::size_type i = 0;
+	while (i < param_len &&
+	       tolower(static_cast<unsigned char>(name[i])) == param[i]) ++i;
+	if (i < param_len) continue;
+
+	// in case of multiple entries, use the first (as Netscape does)
+	value.assign(value_begin, value_end - value_begin);
+	return true;
     }
+
+    return false;
+}
+
+bool
+HtmlParser::get_parameter(const string & param, string & value) const
+{
+    return get_parameter(param.c_str(), value);
+}
+
+HtmlParser::HtmlParser() :
+    tag_params(NULL),
+    tag_params_end(NULL),
+    copied_size(0),
+    at_document_start(true),
+    pending(PENDING_NONE),
+    pending_state(PARAM_TAG_NAME),
+    pending_quote(0),
+    pending_offset(0),
+    in_script(false),
+    current_tag(TAG_OTHER)
+{
 }
 
 void
 HtmlParser::decode_entities(string &s)
 {
-    // We need a const_iterator version of s.end() - otherwise the
-    // find() and find_if() templates don't work...
-    string::const_iterator amp = s.begin(), s_end = s.end();
-    while ((amp = find(amp, s_end, '&')) != s_end) {
+    string decoded;
+
+    decode_entities(s.data(), s.length(), decoded);
+    s.swap(decoded);
+}
+
+void
+HtmlParser::decode_entities(const char *text, string::size_type length,
+			    string &decoded)
+{
+    // Copy text to the output as we go, rather than replacing entities
+    // in place and shifting the rest of the string each time.
+    const char *start = text, *amp, *s_end = text + length;
+
+    decoded.reserve(decoded.length() + length);
+    while ((amp = find(start, s_end, '&')) != s_end) {
 	unsigned int val = 0;
-	string::const_iterator end, p = amp + 1;
+	const char *end, *p = amp + 1;
 	if (p != s_end && *p == '#') {
 	    p++;
 	    if (p != s_end && (*p == 'x' || *p == 'X')) {
 		// hex
 		p++;
 		end = find_if(p, s_end, p_notxdigit);
-		sscanf(s.substr(p - s.begin(), end - p).c_str(), "%x", &val);
+		for (const char *d = p; d != end; ++d) {
+		    unsigned char ch = static_cast<unsigned char>(*d);
+		    val = (val << 4) | (isdigit(ch) ? ch - '0' : (tolower(ch) - 'a' + 10));
+		    // Don't overflow, but read all the digits.
+		    if (val > 0x10ffff) val = 0x110000;
+		}
 	    } else {
 		// number
 		end = find_if(p, s_end, p_notdigit);
-		val = atoi(s.substr(p - s.begin(), end - p).c_str());
+		for (const char *d = p; d != end; ++d) {
+		    val = (val * 10) + (*d - '0');
+		    if (val > 0x10ffff) val = 0x110000;
+		}
 	    }
+	    // Not a unicode value, keep the reference as it is.
+	    if (val > 0x10ffff) val = 0;
 	} else {
 	    end = find_if(p, s_end, p_notalnum);
-	    string code = s.substr(p - s.begin(), end - p);
-	    map<string, unsigned int>::const_iterator i;
-	    i = named_ents.find(code);
-	    if (i != named_ents.end()) val = i->second;
+	    val = lookup_named_entity(p, end - p);
 	}
 	if (end < s_end && *end == ';') end++;
+	decoded.append(start, amp - start);
 	if (val) {
-	    string::size_type amp_pos = amp - s.begin();
 	    if (val < 0x80) {
-		s.replace(amp_pos, end - amp, 1u, char(val));
+		decoded += char(val);
 	    } else {
 		// Convert unicode value val to UTF-8.
 		char seq[4];
 		unsigned len = nonascii_to_utf8(val, seq);
-		s.replace(amp_pos, end - amp, seq, len);
+		decoded.append(seq, len);
 	    }
-	    s_end = s.end();
-	    // We've modified the string, so the iterators are no longer
-	    // valid...
-	    amp = s.begin() + amp_pos + 1;
 	} else {
-	    amp = end;
+	    decoded.append(amp, end - amp);
 	}
+	start = end;
+    }
+    decoded.append(start, s_end - start);
+}
+
+// Marks the end of htdig's "ignore this bit" comments.
+static const char noindex_end[] = "<!--/htdig_noindex-->";
+
+// Returns where text at the end of a chunk should be cut, so that
+// trailing whitespace isn't lost and partial entities aren't decoded.
+static const char *
+find_text_break(const char *start, const char *end)
+{
+    const char *word = end;
+    while (word > start && end - word < 64 &&
+	   !isspace(static_cast<unsigned char>(word[-1]))) --word;
+    if (word > start && isspace(static_cast<unsigned char>(word[-1]))) {
+	// Keep the last word and the whitespace before it.
+	while (word > start && isspace(static_cast<unsigned char>(word[-1])))
+	    --word;
+	return word;
     }
+    if (word == start) return start;
+
+    // A long run of text, only keep a possible entity.
+    const char *amp = end;
+    while (amp > start && end - amp < 32 && amp[-1] != '&') --amp;
+    if (amp > start && amp[-1] == '&') return amp - 1;
+
+    return end;
 }
 
 void
 HtmlParser::parse_html(const string &body)
 {
+    parse_html(body.data(), body.length());
+}
+
+void
+HtmlParser::parse_html(const char *body_ptr, string::size_type body_length)
+{
+    unparsed.clear();
+    copied_size = 0;
+    at_document_start = true;
+    pending = PENDING_NONE;
     in_script = false;
 
-    parameters.clear();
-    string::const_iterator start = body.begin();
+    parse_chunk(body_ptr, body_length, true);
+}
+
+void
+HtmlParser::feed(const char *text, string::size_type length)
+{
+    if (unparsed.empty()) {
+	// Work directly off the caller's buffer and only keep what's left.
+	string::size_type used = parse_chunk(text, length, false);
+	if (used > 0) at_document_start = false;
+	unparsed.assign(text + used, length - used);
+	copied_size += length - used;
+    } else {
+	unparsed.append(text, length);
+	copied_size += length;
+	// Don't parse again what was kept until what it started may be over.
+	if (!scan_pending()) return;
+	string::size_type used = parse_chunk(unparsed.data(), unparsed.length(), false);
+	if (used > 0) at_document_start = false;
+	unparsed.erase(0, used);
+    }
+}
+
+void
+HtmlParser::finish()
+{
+    string rest;
+
+    rest.swap(unparsed);
+    parse_chunk(rest.data(), rest.length(), true);
+    pending = PENDING_NONE;
+}
+
+// Records what parse_chunk() stopped at, so that feed() can look for its
+// end in the bytes that follow, and returns where it begins.
+string::size_type
+HtmlParser::stop_at(pending_id what, string::size_type offset)
+{
+    pending = what;
+    pending_state = PARAM_TAG_NAME;
+    pending_quote = 0;
+    // Skip what identified the construct, eg "<!--".
+    switch (what) {
+	case PENDING_TAG:
+	    pending_offset = 1;
+	    break;
+	case PENDING_CLOSING_TAG:
+	case PENDING_DECLARATION:
+	    pending_offset = 2;
+	    break;
+	case PENDING_PHP:
+	    pending_offset = 3;
+	    break;
+	case PENDING_COMMENT:
+	    pending_offset = 4;
+	    break;
+	default:
+	    pending_offset = 0;
+	    break;
+    }
+
+    return offset;
+}
+
+// Carries on looking for the end of what parse_chunk() stopped at from
+// where the last call left off, the same way parse_chunk() does.  Returns
+// true if it may be complete and the unparsed text should be parsed again.
+bool
+HtmlParser::scan_pending()
+{
+    const char *begin = unparsed.data(), *end = begin + unparsed.length();
+    const char *p = begin + pending_offset;
+
+    switch (pending) {
+	case PENDING_TAG:
+	    // Parameters are delimited as next_parameter() does.
+	    for ( ; p != end; ++p) {
+		char ch = *p;
+		if (pending_state == PARAM_QUOTED) {
+		    // The closing quote starts the next parameter.
+		    if (ch == pending_quote) pending_state = PARAM_NAME;
+		    continue;
+		}
+		if (pending_state == PARAM_TAG_NAME) {
+		    if (!p_nottag(ch)) continue;
+		    pending_state = PARAM_NAME;
+		}
+		if (pending_state == PARAM_BEFORE_VALUE) {
+		    if (isspace(static_cast<unsigned char>(ch))) continue;
+		    if (ch == '"' || ch == '\'') {
+			pending_quote = ch;
+			pending_state = PARAM_QUOTED;
+			continue;
+		    }
+		    pending_state = PARAM_UNQUOTED;
+		}
+		if (ch == '>') return true;
+		if (pending_state == PARAM_UNQUOTED) {
+		    if (isspace(static_cast<unsigned char>(ch)))
+			pending_state = PARAM_NAME;
+		} else if (ch == '=') {
+		    pending_state = PARAM_BEFORE_VALUE;
+		}
+	    }
+	    break;
+	case PENDING_CLOSING_TAG:
+	case PENDING_DECLARATION:
+	    p = find(p, end, '>');
+	    break;
+	case PENDING_COMMENT:
+	    // look for -->
+	    p = find(p, end, '>');
+	    while (p != end && (*(p - 1) != '-' || *(p - 2) != '-'))
+		p = find(p + 1, end, '>');
+	    if (p == end) break;
+	    if (p - begin != 19 || memcmp(begin + 4, "htdig_noindex", 13) != 0)
+		return true;
+	    pending = PENDING_NOINDEX;
+	    pending_offset = p + 1 - begin;
+	    return scan_pending();
+	case PENDING_NOINDEX:
+	    if (search(p, end, noindex_end, noindex_end + 21) != end)
+		return true;
+	    // The end marker may start in the last 20 bytes.
+	    if (end - p > 20) pending_offset = end - begin - 20;
+	    return false;
+	case PENDING_PHP:
+	    // look for ?>
+	    p = find(p, end, '>');
+	    while (p != end && *(p - 1) != '?')
+		p = find(p + 1, end, '>');
+	    break;
+	default:
+	    return true;
+    }
+    if (p != end) return true;
+
+    pending_offset = end - begin;
+    return false;
+}
+
+string::size_type
+HtmlParser::parse_chunk(const char *body_ptr, string::size_type body_length,
+			bool at_end)
+{
+    // Work directly off the caller's buffer.
+    const char *body_begin = body_ptr, *body_end = body_ptr + body_length;
+    bool at_start = at_document_start;
+
+    pending = PENDING_NONE;
+
+    // Unless this is the end of the document, stop before anything that
+    // may continue in the next chunk and return how much was parsed.
+    const char *start = body_begin;
 
     while (true) {
+	if (start > body_begin) at_document_start = false;
+
 	// Skip through until we find an HTML tag, a comment, or the end of
 	// document.  Ignore isolated occurrences of `<' which don't start
 	// a tag or comment.
-	string::const_iterator p = start;
+	const char *p = start;
 	while (true) {
-	    p = find(p, body.end(), '<');
-	    if (p == body.end()) break;
-	    unsigned char ch = *(p + 1);
+	    p = find(p, body_end, '<');
+	    if (p == body_end) break;
+	    // Is this a tag ? Can't tell yet.
+	    if (!at_end && p + 1 == body_end) {
+		p = body_end;
+		break;
+	    }
+	    unsigned char ch = (p + 1 < body_end) ? *(p + 1) : '\0';
 
 	    // Tag, closing tag, or comment (or SGML declaration).
 	    if ((!in_script && isalpha(ch)) || ch == '/' || ch == '!') break;
@@ -463,15 +803,22 @@ HtmlParser::parse_html(const string &body)
 		// PHP code or XML declaration.
 		// XML declaration is only valid at the start of the first line.
 		// FIXME: need to deal with BOMs...
-		if (p != body.begin() || body.size() < 20) break;
+		if (p != body_begin || !at_start) break;
+		if (body_length < 20) {
+		    if (!at_end) return 0;
+		    break;
+		}
 
 		// XML declaration looks something like this:
 		// <?xml version="1.0" encoding="UTF-8"?>
 		if (p[2] != 'x' || p[3] != 'm' || p[4] != 'l') break;
 		if (strchr(" \t\r\n", p[5]) == NULL) break;
 
-		string::const_iterator decl_end = find(p + 6, body.end(), '?');
-		if (decl_end == body.end()) break;
+		const char *decl_end = find(p + 6, body_end, '?');
+		if (decl_end == body_end) {
+		    if (!at_end) return 0;
+		    break;
+		}
 
 		// Default charset for XML is UTF-8.
 		charset = "UTF-8";
@@ -501,150 +848,164 @@ HtmlParser::parse_html(const string &body)
 	    p++;
 	}
 
+	// Text at the end of a chunk may continue in the next one.
+	const char *text_end = p;
+	if (!at_end && p == body_end) {
+	    text_end = find_text_break(start, p);
+	    // Keep back a trailing `<' too.
+	    if (text_end == p && p > start && *(p - 1) == '<') --text_end;
+	}
+
 	// Process text up to start of tag.
-	if (p > start) {
-	    string text = body.substr(start - body.begin(), p - start);
+	if (text_end > start) {
+	    string text;
+	    decode_entities(start, text_end - start, text);
 #if 0
 	    convert_to_utf8(text, charset);
 #endif
-	    decode_entities(text);
 	    process_text(text);
 	}
 
-	if (p == body.end()) break;
+	if (p == body_end) {
+	    if (!at_end) return text_end - body_begin;
+	    break;
+	}
+
+	// Where to resume if this tag isn't complete.
+	const char *tag_begin = p;
 
 	start = p + 1;
 
-	if (start == body.end()) break;
+	if (start == body_end) break;
 
 	if (*start == '!') {
-	    if (++start == body.end()) break;
-	    if (++start == body.end()) break;
+	    if (++start == body_end) {
+		if (!at_end) return tag_begin - body_begin;
+		break;
+	    }
+	    if (++start == body_end) {
+		if (!at_end) return tag_begin - body_begin;
+		break;
+	    }
 	    // comment or SGML declaration
 	    if (*(start - 1) == '-' && *start == '-') {
 		++start;
-		string::const_iterator close = find(start, body.end(), '>');
+		const char *close = find(start, body_end, '>');
 		// An unterminated comment swallows rest of document
 		// (like Netscape, but unlike MSIE IIRC)
-		if (close == body.end()) break;
+		if (close == body_end) {
+		    if (!at_end)
+			return stop_at(PENDING_COMMENT, tag_begin - body_begin);
+		    break;
+		}
 
 		p = close;
 		// look for -->
-		while (p != body.end() && (*(p - 1) != '-' || *(p - 2) != '-'))
-		    p = find(p + 1, body.end(), '>');
+		while (p != body_end && (*(p - 1) != '-' || *(p - 2) != '-'))
+		    p = find(p + 1, body_end, '>');
 
-		if (p != body.end()) {
+		if (p != body_end) {
 		    // Check for htdig's "ignore this bit" comments.
 		    if (p - start == 15 && string(start, p - 2) == "htdig_noindex") {
-			string::size_type i;
-			i = body.find("<!--/htdig_noindex-->", p + 1 - body.begin());
-			if (i == string::npos) break;
-			start = body.begin() + i + 21;
+			const char *i = search(p + 1, body_end,
+			    noindex_end, noindex_end + 21);
+			if (i == body_end) {
+			    if (!at_end)
+				return stop_at(PENDING_COMMENT, tag_begin - body_begin);
+			    break;
+			}
+			start = i + 21;
 			continue;
 		    }
 		    // If we found --> skip to there.
 		    start = p;
 		} else {
 		    // Otherwise skip to the first > we found (as Netscape does).
+		    if (!at_end)
+			return stop_at(PENDING_COMMENT, tag_begin - body_begin);
 		    start = close;
 		}
 	    } else {
 		// just an SGML declaration, perhaps giving the DTD - ignore it
-		start = find(start - 1, body.end(), '>');
-		if (start == body.end()) break;
+		start = find(start - 1, body_end, '>');
+		if (start == body_end) {
+		    if (!at_end)
+			return stop_at(PENDING_DECLARATION, tag_begin - body_begin);
+		    break;
+		}
 	    }
 	    ++start;
 	} else if (*start == '?') {
-	    if (++start == body.end()) break;
+	    if (++start == body_end) {
+		if (!at_end) return tag_begin - body_begin;
+		break;
+	    }
 	    // PHP - swallow until ?> or EOF
-	    start = find(start + 1, body.end(), '>');
+	    start = find(start + 1, body_end, '>');
 
 	    // look for ?>
-	    while (start != body.end() && *(start - 1) != '?')
-		start = find(start + 1, body.end(), '>');
+	    while (start != body_end && *(start - 1) != '?')
+		start = find(start + 1, body_end, '>');
 
 	    // unterminated PHP swallows rest of document (rather arbitrarily
 	    // but it avoids polluting the database when things go wrong)
-	    if (start != body.end()) ++start;
+	    if (start != body_end) {
+		++start;
+	    } else if (!at_end) {
+		return stop_at(PENDING_PHP, tag_begin - body_begin);
+	    }
 	} else {
 	    // opening or closing tag
 	    int closing = 0;
 
 	    if (*start == '/') {
 		closing = 1;
-		start = find_if(start + 1, body.end(), p_notwhitespace);
+		start = find_if(start + 1, body_end, p_notwhitespace);
 	    }
 
 	    p = start;
-	    start = find_if(start, body.end(), p_nottag);
-	    string tag = body.substr(p - body.begin(), start - p);
+	    start = find_if(start, body_end, p_nottag);
+	    // Reuse the buffer rather than allocate for each tag
+	    tag.assign(p, start - p);
 	    // convert tagname to lowercase
 	    lowercase_string(tag);
 
 	    if (closing) {
+		/* ignore any bogus parameters on closing tags */
+		p = find(start, body_end, '>');
+		if (!at_end && p == body_end)
+		    return stop_at(PENDING_CLOSING_TAG, tag_begin - body_begin);
+
+		current_tag = lookup_tag(tag);
 		closing_tag(tag);
-		if (in_script && tag == "script") in_script = false;
+		if (in_script && current_tag == TAG_SCRIPT) in_script = false;
 
-		/* ignore any bogus parameters on closing tags */
-		p = find(start, body.end(), '>');
-		if (p == body.end()) break;
+		if (p == body_end) break;
 		start = p + 1;
 	    } else {
-		// FIXME: parse parameters lazily.
-		while (start < body.end() && *start != '>') {
-		    string name, value;
-
-		    p = find_if(start, body.end(), p_whitespaceeqgt);
-
-		    name.assign(body, start - body.begin(), p - start);
-
-		    p = find_if(p, body.end(), p_notwhitespace);
-
-		    start = p;
-		    if (start != body.end() && *start == '=') {
-			start = find_if(start + 1, body.end(), p_notwhitespace);
-
-			p = body.end();
-
-			int quote = *start;
-			if (quote == '"' || quote == '\'') {
-			    start++;
-			    p = find(start, body.end(), quote);
-			}
-
-			if (p == body.end()) {
-			    // unquoted or no closing quote
-			    p = find_if(start, body.end(), p_whitespacegt);
-			}
-			value.assign(body, start - body.begin(), p - start);
-			start = find_if(p, body.end(), p_notwhitespace);
-
-			if (!name.empty()) {
-			    // convert parameter name to lowercase
-			    lowercase_string(name);
-			    // in case of multiple entries, use the first
-			    // (as Netscape does)
-			    parameters.insert(make_pair(name, value));
-			}
-		    }
-		}
-#if 0
-		cout << "<" << tag;
-		map<string, string>::const_iterator x;
-		for (x = parameters.begin(); x != parameters.end(); x++) {
-		    cout << " " << x->first << "=\"" << x->second << "\"";
-		}
-		cout << ">\n";
-#endif
+		// Find where the parameters end, they are only parsed
+		// if get_parameter() is called.
+		const char *params = start, *name, *name_end, *value, *value_end;
+		bool unclosed = false;
+		while (next_parameter(start, body_end, name, name_end,
+				      value, value_end, unclosed)) { }
+		if (!at_end && (start == body_end || unclosed))
+		    return stop_at(PENDING_TAG, tag_begin - body_begin);
+
+		tag_params = params;
+		tag_params_end = start;
+		current_tag = lookup_tag(tag);
 		opening_tag(tag);
-		parameters.clear();
+		tag_params = tag_params_end = NULL;
 
 		// In <script> tags we ignore opening tags to avoid problems
 		// with "a<b".
-		if (tag == "script") in_script = true;
+		if (current_tag == TAG_SCRIPT) in_script = true;
 
-		if (start != body.end() && *start == '>') ++start;
+		if (start != body_end && *start == '>') ++start;
 	    }
 	}
     }
+
+    return body_length;
 }
@@ -29,19 +29,56 @@ using std::string;
 using std::map;
 
 class HtmlParser {
-	map<string, string> parameters;
+    public:
+	enum tag_id { TAG_OTHER = 0, TAG_A, TAG_BODY, TAG_FRAME, TAG_FRAMESET,
+		TAG_HEAD, TAG_META, TAG_SCRIPT, TAG_STYLE, TAG_TITLE };
+
+    private:
+	// What parse_chunk() stopped at because it may continue in the next
+	// chunk, and how far feed() has looked for its end.
+	enum pending_id { PENDING_NONE = 0, PENDING_TAG, PENDING_CLOSING_TAG,
+		PENDING_COMMENT, PENDING_NOINDEX, PENDING_DECLARATION,
+		PENDING_PHP };
+	enum param_state { PARAM_TAG_NAME = 0, PARAM_NAME, PARAM_BEFORE_VALUE,
+		PARAM_QUOTED, PARAM_UNQUOTED };
+
+	// Parameters of the current opening tag, parsed on demand.
+	const char *tag_params, *tag_params_end;
+	string tag;
+	string unparsed;
+	string::size_type copied_size;
+	bool at_document_start;
+	pending_id pending;
+	param_state pending_state;
+	char pending_quote;
+	string::size_type pending_offset;
+
+	string::size_type parse_chunk(const char *text, string::size_type length,
+				      bool at_end);
+	string::size_type stop_at(pending_id what, string::size_type offset);
+	bool scan_pending();
     protected:
 	void decode_entities(string &s);
 	bool in_script;
 	string charset;
-	static map<string, unsigned int> named_ents;
+	tag_id current_tag;
 
-	bool get_parameter(const string & param, string & value);
+	bool get_parameter(const char *param, string & value) const;
+	bool get_parameter(const string & param, string & value) const;
     public:
 	virtual void process_text(const string &/*text*/) { }
 	virtual void opening_tag(const string &/*tag*/) { }
 	virtual void closing_tag(const string &/*tag*/) { }
 	virtual void parse_html(const string &text);
+	virtual void parse_html(const char *text, string::size_type length);
+	// Incremental parsing, one chunk at a time, then finish().
+	void feed(const char *text, string::size_type length);
+	void finish();
+	// How many bytes of input were kept between chunks.
+	string::size_type get_copied_size() const { return copied_size; }
+	static void decode_entities(const char *text, string::size_type length,
+				    string &decoded);
+	static tag_id lookup_tag(const string &tag);
 	HtmlParser();
 	virtual ~HtmlParser() { }
 };
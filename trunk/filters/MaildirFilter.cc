@@ -0,0 +1,513 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <iostream>
+#include <algorithm>
+
+#include <gmime/gmime.h>
+
+#include "MaildirFilter.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::map;
+using std::vector;
+using std::max;
+using std::min;
+using std::sort;
+
+using namespace Dijon;
+
+// How many messages a shard holds
+static const vector<string>::size_type MESSAGES_PER_SHARD = 32;
+
+static bool isMHNumber(const char *pName)
+{
+	if (*pName == '\0')
+	{
+		return false;
+	}
+
+	for (; *pName != '\0'; ++pName)
+	{
+		if (isdigit((unsigned char)*pName) == 0)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool isTrashedMessage(const string &fileName)
+{
+	// Flags follow the info separator, in ASCII order
+	string::size_type infoPos = fileName.rfind(":2,");
+	if ((infoPos != string::npos) &&
+		(fileName.find('T', infoPos + 3) != string::npos))
+	{
+		return true;
+	}
+
+	return false;
+}
+
+static bool lessMHNumber(const string &first, const string &second)
+{
+	return (strtoul(first.c_str(), NULL, 10) < strtoul(second.c_str(), NULL, 10));
+}
+
+// Returns the name of a message's file, without sub-directory and flags
+static string getMessageName(const string &messageFile)
+{
+	string::size_type nameStart = messageFile.find('/');
+
+	if (nameStart == string::npos)
+	{
+		nameStart = 0;
+	}
+	else
+	{
+		++nameStart;
+	}
+
+	string::size_type infoPos = messageFile.rfind(":2,");
+	if ((infoPos == string::npos) ||
+		(infoPos < nameStart))
+	{
+		return messageFile.substr(nameStart);
+	}
+
+	return messageFile.substr(nameStart, infoPos - nameStart);
+}
+
+static bool lessMessageName(const string &first, const string &second)
+{
+	// Names start with the time of delivery
+	return (getMessageName(first) < getMessageName(second));
+}
+
+MaildirFilter::MaildirFilter(const string &mime_type) :
+	GMimeMboxFilter(mime_type),
+	m_isMH(mime_type == "application/x-mh"),
+	m_nextMessage(0),
+	m_pMessageFilter(new GMimeMboxFilter("message/rfc822"))
+{
+}
+
+MaildirFilter::~MaildirFilter()
+{
+	// Threads use this filter
+	stopShards();
+	delete m_pMessageFilter;
+}
+
+bool MaildirFilter::is_data_input_ok(DataInput input) const
+{
+	if (input == DOCUMENT_FILE_NAME)
+	{
+		return true;
+	}
+
+	return false;
+}
+
+bool MaildirFilter::set_property(Properties prop_name, const string &prop_value)
+{
+	// Filters built later need those too
+	m_properties[prop_name] = prop_value;
+	m_pMessageFilter->set_property(prop_name, prop_value);
+
+	return GMimeMboxFilter::set_property(prop_name, prop_value);
+}
+
+bool MaildirFilter::set_document_data(const char *data_ptr, unsigned int data_length)
+{
+	return false;
+}
+
+bool MaildirFilter::set_document_file(const string &file_path, bool unlink_when_done)
+{
+	// Close/free whatever was opened/allocated on a previous call to set_document()
+	finalize(true);
+	m_messageFiles.clear();
+	m_nextMessage = 0;
+	m_messageName.clear();
+	m_foundDocument = false;
+
+	// Folders are never deleted
+	Filter::set_document_file(file_path, false);
+
+	if (m_isMH == true)
+	{
+		listMessages("");
+		sort(m_messageFiles.begin(), m_messageFiles.end(), lessMHNumber);
+	}
+	else
+	{
+		listMessages("cur");
+		listMessages("new");
+		sort(m_messageFiles.begin(), m_messageFiles.end(), lessMessageName);
+	}
+#ifdef DEBUG
+	cout << "MaildirFilter::set_document_file: " << m_messageFiles.size() << " messages in " << file_path << endl;
+#endif
+
+	// Don't read anything until next or skip is called
+	m_foundDocument = (m_messageFiles.empty() == false);
+
+	return m_foundDocument;
+}
+
+bool MaildirFilter::next_document(void)
+{
+	m_metaData.clear();
+	m_content.clear();
+
+	while (m_shards.empty() == true)
+	{
+		// The current message may have parts left
+		if ((m_messageName.empty() == false) &&
+			(m_pMessageFilter->next_document() == true))
+		{
+			copyMessageDocument();
+
+			return true;
+		}
+		m_messageName.clear();
+
+		if ((m_cancelled == true) ||
+			(m_nextMessage >= m_messageFiles.size()))
+		{
+			m_foundDocument = false;
+
+			return false;
+		}
+
+		if ((m_maxThreads > 1) &&
+			(startMessageShards() == true))
+		{
+			break;
+		}
+
+		// Parse one message at a time
+		m_pMessageFilter->set_content_sink(m_pContentSink);
+		if ((readMessage(m_nextMessage, m_messageData) == true) &&
+			(m_pMessageFilter->set_document_data(m_messageData.c_str(), (unsigned int)m_messageData.length()) == true))
+		{
+			m_messageName = getMessageName(m_messageFiles[m_nextMessage]);
+		}
+		++m_nextMessage;
+	}
+
+	return nextShardDocument();
+}
+
+bool MaildirFilter::skip_to_document(const string &ipath)
+{
+	stopShards();
+	m_messageName.clear();
+	m_metaData.clear();
+	m_content.clear();
+
+	if (ipath.empty() == true)
+	{
+		// Reset
+		m_nextMessage = 0;
+		m_foundDocument = (m_messageFiles.empty() == false);
+
+		return true;
+	}
+
+	// ipath's format is "f=name&p=part_number"
+	string::size_type partPos = ipath.rfind("&p=");
+	if ((ipath.compare(0, 2, "f=") != 0) ||
+		(partPos == string::npos) ||
+		(partPos < 2))
+	{
+		return false;
+	}
+	string name(ipath.substr(2, partPos - 2));
+	char partIpath[64];
+
+	snprintf(partIpath, 64, "o=0&p=%d", max(atoi(ipath.c_str() + partPos + 3), 0));
+	m_foundDocument = false;
+
+	for (vector<string>::size_type messageNum = 0; messageNum < m_messageFiles.size(); ++messageNum)
+	{
+		if (getMessageName(m_messageFiles[messageNum]) != name)
+		{
+			continue;
+		}
+
+		// Extract that part of the message, and go on from there
+		m_pMessageFilter->set_content_sink(m_pContentSink);
+		if ((readMessage(messageNum, m_messageData) == true) &&
+			(m_pMessageFilter->set_document_data(m_messageData.c_str(), (unsigned int)m_messageData.length()) == true) &&
+			(m_pMessageFilter->skip_to_document(partIpath) == true))
+		{
+			m_messageName = name;
+			m_nextMessage = messageNum + 1;
+			copyMessageDocument();
+			m_foundDocument = true;
+		}
+		break;
+	}
+#ifdef DEBUG
+	if (m_foundDocument == false)
+	{
+		cout << "MaildirFilter::skip_to_document: no document at " << ipath << endl;
+	}
+#endif
+
+	return m_foundDocument;
+}
+
+void MaildirFilter::cancel(void)
+{
+	Filter::cancel();
+	m_pMessageFilter->cancel();
+}
+
+void MaildirFilter::rewind(void)
+{
+	string emptyData;
+
+	// This stops shards, which use the message filter
+	GMimeMboxFilter::rewind();
+	m_messageFiles.clear();
+	m_nextMessage = 0;
+	m_messageData.swap(emptyData);
+	m_messageName.clear();
+	m_pMessageFilter->reset();
+}
+
+void MaildirFilter::listMessages(const string &subDir)
+{
+	string dirPath(m_filePath);
+
+	if (subDir.empty() == false)
+	{
+		dirPath += "/";
+		dirPath += subDir;
+	}
+
+	DIR *pDir = opendir(dirPath.c_str());
+	if (pDir == NULL)
+	{
+#ifdef DEBUG
+		cout << "MaildirFilter::listMessages: couldn't open " << dirPath << endl;
+#endif
+		return;
+	}
+
+	struct dirent *pDirEntry = readdir(pDir);
+	while (pDirEntry != NULL)
+	{
+		const char *pName = pDirEntry->d_name;
+
+		// Skip dot files, trashed messages and, in MH folders, anything that's not a message
+		if ((pName[0] != '.') &&
+			(((m_isMH == true) && (isMHNumber(pName) == true)) ||
+			((m_isMH == false) && (isTrashedMessage(pName) == false))))
+		{
+			string messageFile(pName);
+
+			if (subDir.empty() == false)
+			{
+				messageFile = subDir + "/" + messageFile;
+			}
+			m_messageFiles.push_back(messageFile);
+		}
+
+		// Next entry
+		pDirEntry = readdir(pDir);
+	}
+	closedir(pDir);
+}
+
+bool MaildirFilter::readMessage(vector<string>::size_type messageNum,
+	string &messageData)
+{
+	struct stat fileStat;
+	string filePath(m_filePath);
+
+	filePath += "/";
+	filePath += m_messageFiles[messageNum];
+	messageData.clear();
+
+	int fd = openFile(filePath);
+	if (fd < 0)
+	{
+		// It may have been moved to cur, or deleted
+		return false;
+	}
+	if ((fstat(fd, &fileStat) != 0) ||
+		(!S_ISREG(fileStat.st_mode)))
+	{
+		close(fd);
+		return false;
+	}
+
+	// Read the whole message in one go
+	messageData.resize((string::size_type)fileStat.st_size);
+
+	string::size_type totalSize = 0;
+	while (totalSize < messageData.length())
+	{
+		ssize_t bytesRead = read(fd, &messageData[totalSize], messageData.length() - totalSize);
+
+		if (bytesRead > 0)
+		{
+			totalSize += (string::size_type)bytesRead;
+		}
+		else if ((bytesRead == 0) ||
+			(errno != EINTR))
+		{
+			break;
+		}
+	}
+	close(fd);
+	messageData.resize(totalSize);
+
+	return (totalSize > 0);
+}
+
+string MaildirFilter::getIpath(const string &messageName, const Filter &filter)
+{
+	const map<string, string> &metaData = filter.get_meta_data();
+	string ipath("f=");
+
+	ipath += messageName;
+
+	// Keep the message filter's part number
+	map<string, string>::const_iterator ipathIter = metaData.find("ipath");
+	if (ipathIter != metaData.end())
+	{
+		string::size_type partPos = ipathIter->second.rfind("&p=");
+
+		if (partPos != string::npos)
+		{
+			ipath += ipathIter->second.substr(partPos);
+
+			return ipath;
+		}
+	}
+	ipath += "&p=0";
+
+	return ipath;
+}
+
+GMimeMboxFilter *MaildirFilter::newMessageFilter(void)
+{
+	GMimeMboxFilter *pFilter = new GMimeMboxFilter("message/rfc822");
+
+	for (map<Properties, string>::const_iterator propIter = m_properties.begin();
+		propIter != m_properties.end(); ++propIter)
+	{
+		pFilter->set_property(propIter->first, propIter->second);
+	}
+
+	return pFilter;
+}
+
+void MaildirFilter::copyMessageDocument(void)
+{
+	m_metaData = m_pMessageFilter->get_meta_data();
+	m_metaData["ipath"] = getIpath(m_messageName, *m_pMessageFilter);
+
+	// With a sink, text went straight to it
+	if (is_content_streamed() == false)
+	{
+		const dstring &content = m_pMessageFilter->get_content();
+
+		m_content.assign(content.c_str(), content.length());
+	}
+	m_abortedContent = m_pMessageFilter->is_content_aborted();
+}
+
+bool MaildirFilter::startMessageShards(void)
+{
+	vector<string>::size_type messagesCount = m_messageFiles.size() - m_nextMessage;
+
+	// Threads are only worth it for many messages
+	if (messagesCount < MESSAGES_PER_SHARD * 2)
+	{
+		return false;
+	}
+
+	for (vector<string>::size_type messageNum = m_nextMessage; messageNum < m_messageFiles.size();
+		messageNum += MESSAGES_PER_SHARD)
+	{
+		// Shards hold message numbers rather than offsets
+		m_shards.push_back(new Shard((GMIME_OFFSET_TYPE)messageNum,
+			(GMIME_OFFSET_TYPE)min(messageNum + MESSAGES_PER_SHARD, m_messageFiles.size())));
+	}
+	m_nextMessage = m_messageFiles.size();
+
+	vector<GMimeMboxFilter *> filters;
+
+	while (filters.size() < min((vector<Shard *>::size_type)m_maxThreads, m_shards.size()))
+	{
+		filters.push_back(newMessageFilter());
+	}
+#ifdef DEBUG
+	cout << "MaildirFilter::startMessageShards: " << m_shards.size() << " shards" << endl;
+#endif
+
+	return startShardThreads(filters);
+}
+
+bool MaildirFilter::extractShard(GMimeMboxFilter *pFilter, Shard *pShard)
+{
+	string messageData;
+
+	for (GMIME_OFFSET_TYPE messageNum = pShard->m_start; messageNum < pShard->m_end; ++messageNum)
+	{
+		if ((readMessage((vector<string>::size_type)messageNum, messageData) == false) ||
+			(pFilter->set_document_data(messageData.c_str(), (unsigned int)messageData.length()) == false))
+		{
+			continue;
+		}
+
+		string messageName(getMessageName(m_messageFiles[(vector<string>::size_type)messageNum]));
+
+		while (pFilter->next_document() == true)
+		{
+			ShardDocument *pDocument = new ShardDocument(*pFilter);
+
+			pDocument->m_metaData["ipath"] = getIpath(messageName, *pFilter);
+			if (queueShardDocument(pShard, pDocument) == false)
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
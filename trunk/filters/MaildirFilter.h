@@ -0,0 +1,139 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DIJON_MAILDIRFILTER_H
+#define _DIJON_MAILDIRFILTER_H
+
+#include <string>
+#include <map>
+#include <vector>
+
+#include "GMimeMboxFilter.h"
+
+namespace Dijon
+{
+    /** A filter for Maildir and MH folders.
+     * Messages are files in the cur and new sub-directories of a Maildir,
+     * or files with numeric names in a MH folder. Each is read in one go
+     * and parsed like a mailbox with a single message. Maildir messages
+     * flagged as trashed are skipped.
+     * Ipaths are of the form "f=name&p=part_number", where name is that
+     * of the message's file without its Maildir flags, so that they don't
+     * change when the message is read or moved to cur.
+     * If MAXIMUM_THREADS is set, messages are parsed by several threads.
+     */
+    class MaildirFilter : public GMimeMboxFilter
+    {
+    public:
+	/// Builds an empty filter.
+	MaildirFilter(const std::string &mime_type);
+	/// Destroys the filter.
+	virtual ~MaildirFilter();
+
+
+	// Information.
+
+	/// Returns what data the filter requires as input.
+	virtual bool is_data_input_ok(DataInput input) const;
+
+
+	// Initialization.
+
+	/** Sets a property, prior to calling set_document_XXX().
+	 * Returns false if the property is not supported.
+	 */
+	virtual bool set_property(Properties prop_name, const std::string &prop_value);
+
+	/** (Re)initializes the filter with the given data.
+	 * Returns false, as folders are directories.
+	 */
+	virtual bool set_document_data(const char *data_ptr, unsigned int data_length);
+
+	/** (Re)initializes the filter with the given folder.
+	 * Call next_document() to position the filter onto the first document.
+	 * Returns false if this input is not supported or an error occured.
+	 */
+	virtual bool set_document_file(const std::string &file_path,
+		bool unlink_when_done = false);
+
+
+	// Going from one nested document to the next.
+
+	/** Moves to the next nested document.
+	 * Returns false if there are none left.
+	 */
+	virtual bool next_document(void);
+
+	/** Skips to the nested document with the given ipath.
+	 * Returns false if no such document exists.
+	 */
+	virtual bool skip_to_document(const std::string &ipath);
+
+
+	// Cancellation.
+
+	/// Asks the filter to give up on the current document as soon as it can.
+	virtual void cancel(void);
+
+    protected:
+	bool m_isMH;
+	std::map<Properties, std::string> m_properties;
+	std::vector<std::string> m_messageFiles;
+	std::vector<std::string>::size_type m_nextMessage;
+	GMimeMboxFilter *m_pMessageFilter;
+	std::string m_messageData;
+	std::string m_messageName;
+
+	/// Adds the messages found in the given sub-directory of the folder.
+	void listMessages(const std::string &subDir);
+
+	/// Reads the given message's file in one go.
+	bool readMessage(std::vector<std::string>::size_type messageNum,
+		std::string &messageData);
+
+	/// Returns the folder's ipath of a document from a message's filter.
+	static std::string getIpath(const std::string &messageName,
+		const Filter &filter);
+
+	/// Builds a filter for messages with this filter's properties.
+	GMimeMboxFilter *newMessageFilter(void);
+
+	/// Copies the current document of the message's filter.
+	void copyMessageDocument(void);
+
+	/// Forgets the folder's messages, so that the filter may be reused.
+	virtual void rewind(void);
+
+	/// Splits the messages left into shards and starts extracting them.
+	bool startMessageShards(void);
+
+	/** Extracts the messages of a shard with the given filter.
+	 * Returns false if shards are being stopped.
+	 */
+	virtual bool extractShard(GMimeMboxFilter *pFilter, Shard *pShard);
+
+    private:
+	/// MaildirFilter objects cannot be copied.
+	MaildirFilter(const MaildirFilter &other);
+	/// MaildirFilter objects cannot be copied.
+	MaildirFilter& operator=(const MaildirFilter& other);
+
+    };
+}
+
+#endif // _DIJON_MAILDIRFILTER_H
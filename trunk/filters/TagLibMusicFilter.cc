@@ -127,6 +127,7 @@ bool TagLibMusicFilter::next_document(void)
 		m_parseDocument = false;
 
 		m_content.clear();
+		m_abortedContent = false;
 		m_metaData.clear();
 
 		TagLib::FileRef fileRef(m_filePath.c_str(), false);
@@ -146,21 +147,22 @@ bool TagLibMusicFilter::next_document(void)
 #ifdef DEBUG
 				cout << "TagLibMusicFilter::next_document: " << trackTitle.length() << " bytes of text" << endl;
 #endif
-				m_content.append(trackTitle.c_str(), trackTitle.length());
-				m_content += " ";
-				m_content += pTag->album().toCString(true);
-				m_content += " ";
-				m_content += pTag->comment().toCString(true);
-				m_content += " ";
-				m_content += pTag->genre().toCString(true);
+				string trackText(trackTitle);
+				trackText += " ";
+				trackText += pTag->album().toCString(true);
+				trackText += " ";
+				trackText += pTag->comment().toCString(true);
+				trackText += " ";
+				trackText += pTag->genre().toCString(true);
 				snprintf(yearStr, 64, " %u", pTag->year());
-				m_content += yearStr;
+				trackText += yearStr;
 
 				m_metaData["title"] = trackTitle;
 				m_metaData["ipath"] = "";
 				m_metaData["mimetype"] = "text/plain";
 				m_metaData["charset"] = "utf-8";
 				m_metaData["author"] = pTag->artist().toCString(true);
+				append_content(trackText.c_str(), trackText.length());
 			}
 			else
 			{
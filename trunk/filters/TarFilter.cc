@@ -175,6 +175,7 @@ bool TarFilter::next_document(const std::string &ipath)
 	size_t size = th_get_size(m_pHandle);
 
 	m_content.clear();
+	m_abortedContent = false;
 	m_metaData.clear();
 	m_metaData["title"] = pFileName;
 	m_metaData["ipath"] = pFileName;
@@ -222,9 +223,10 @@ bool TarFilter::next_document(const std::string &ipath)
 
 			if (blockNum > T_BLOCKSIZE)
 			{
-				if (readFile == true)
+				if ((readFile == true) &&
+					(append_content(pBuffer, T_BLOCKSIZE) == false))
 				{
-					m_content.append(pBuffer, T_BLOCKSIZE);
+					readFile = false;
 				}
 				blockNum -= T_BLOCKSIZE;
 			}
@@ -232,7 +234,7 @@ bool TarFilter::next_document(const std::string &ipath)
 			{
 				if (readFile == true)
 				{
-					m_content.append(pBuffer, blockNum);
+					append_content(pBuffer, blockNum);
 				}
 				blockNum = 0;
 			}
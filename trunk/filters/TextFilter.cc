@@ -17,6 +17,7 @@
  */
 
 #include <unistd.h>
+#include <iostream>
 
 #include "TextFilter.h"
 
@@ -39,7 +40,8 @@ TextFilter::~TextFilter()
 bool TextFilter::is_data_input_ok(DataInput input) const
 {
 	if ((input == DOCUMENT_DATA) ||
-		(input == DOCUMENT_STRING))
+		(input == DOCUMENT_STRING) ||
+		(input == DOCUMENT_FILE_NAME))
 	{
 		return true;
 	}
@@ -60,33 +62,30 @@ bool TextFilter::set_document_data(const char *data_ptr, unsigned int data_lengt
 		return false;
 	}
 
-	string text_doc(data_ptr, data_length);
-	return set_document_string(text_doc);
+	rewind();
+
+	return set_text(data_ptr, data_length);
 }
 
 bool TextFilter::set_document_string(const string &data_str)
 {
-	if (data_str.empty() == true)
+	return set_document_data(data_str.c_str(), data_str.length());
+}
+
+bool TextFilter::set_document_file(const string &file_path, bool unlink_when_done)
+{
+	if ((Filter::set_document_file(file_path, unlink_when_done) == false) ||
+		(map_file() == false))
 	{
 		return false;
 	}
 
-	rewind();
+	bool setText = set_text(m_pMappedFile, m_mappedLength);
 
-#ifdef DEBUG
-	cout << "TextFilter::set_document_string: " << data_str.length() << " bytes of text" << endl;
-#endif
-	m_content.reserve(data_str.length());
-	m_content.append(data_str.c_str(), data_str.length());
-	m_metaData["ipath"] = "";
-	m_metaData["mimetype"] = "text/plain";
+	// The text was either copied or passed on
+	unmap_file();
 
-	return true;
-}
-
-bool TextFilter::set_document_file(const string &file_path, bool unlink_when_done)
-{
-	return false;
+	return setText;
 }
 
 bool TextFilter::set_document_uri(const string &uri)
@@ -133,6 +132,26 @@ string TextFilter::get_error(void) const
 	return "";
 }
 
+bool TextFilter::set_text(const char *data_ptr, unsigned int data_length)
+{
+	m_metaData["ipath"] = "";
+	m_metaData["mimetype"] = "text/plain";
+
+	// A sink gets the caller's data as is, otherwise it's copied once
+	if (is_content_streamed() == false)
+	{
+		m_content.reserve(data_length);
+		m_copiedSize = (off_t)data_length;
+	}
+#ifdef DEBUG
+	cout << "TextFilter::set_text: " << data_length << " bytes of text, copied "
+		<< m_copiedSize << " bytes" << endl;
+#endif
+	append_content(data_ptr, data_length);
+
+	return true;
+}
+
 void TextFilter::rewind(void)
 {
 	Filter::rewind();
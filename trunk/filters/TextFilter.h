@@ -105,6 +105,8 @@ namespace Dijon
 
 	virtual void rewind(void);
 
+	bool set_text(const char *data_ptr, unsigned int data_length);
+
     private:
 	/// TextFilter objects cannot be copied.
 	TextFilter(const TextFilter &other);
@@ -17,13 +17,18 @@
  */
 
 #include <unistd.h>
+#include <string.h>
 #include <iostream>
+#include <algorithm>
 
+#include "HtmlParser.h"
 #include "XmlFilter.h"
 
 using std::string;
 using std::cout;
 using std::endl;
+using std::find;
+using std::search;
 
 using namespace Dijon;
 
@@ -42,7 +47,8 @@ DIJON_FILTER_EXPORT bool check_filter_data_input(int data_input)
 	Filter::DataInput input = (Filter::DataInput)data_input;
 
 	if ((input == Filter::DOCUMENT_DATA) ||
-		(input == Filter::DOCUMENT_STRING))
+		(input == Filter::DOCUMENT_STRING) ||
+		(input == Filter::DOCUMENT_FILE_NAME))
 	{
 		return true;
 	}
@@ -56,68 +62,24 @@ DIJON_FILTER_EXPORT Filter *get_filter(const std::string &mime_type)
 }
 #endif
 
-static dstring replaceEntities(const string &str)
-{
-	// FIXME: replace all
-	static const char *escapedChars[] = { "quot", "amp", "lt", "gt", "nbsp", "eacute", "egrave", "agrave", "ccedil"};
-	static const char *unescapedChars[] = { "\"", "&", "<", ">", " ", "e", "e", "a", "c"};
-	static const unsigned int escapedCharsCount = 9;
-	dstring unescapedStr;
-	dstring::size_type startPos = 0;
+// Text is passed on in chunks of this size
+static const unsigned int TEXT_CHUNK_SIZE = 65536;
 
-#ifdef DEBUG
-	cout << "replaceEntities: " << str.length() << " bytes of text" << endl;
-#endif
-	unescapedStr.reserve(str.length());
-
-	string::size_type pos = str.find("&");
-	while (pos != string::npos)
+static bool startsWith(const char *pStr, const char *pEnd, const char *pPrefix,
+	unsigned int prefixLength)
+{
+	if ((unsigned int)(pEnd - pStr) < prefixLength)
 	{
-		string leftSubstring(str.substr(startPos, pos - startPos));
-
-		unescapedStr.append(leftSubstring.c_str(), leftSubstring.length());
-
-		startPos = pos + 1;
-		pos = str.find(";", startPos);
-		if ((pos != string::npos) &&
-			(pos < startPos + 10))
-		{
-			string escapedChar(str.substr(startPos, pos - startPos));
-			bool replacedChar = false;
-
-			// See if we can replace this with an actual character
-			for (unsigned int count = 0; count < escapedCharsCount; ++count)
-			{
-				if (escapedChar == escapedChars[count])
-				{
-					unescapedStr += unescapedChars[count];
-					replacedChar = true;
-					break;
-				}
-			}
-
-			if (replacedChar == false)
-			{
-				// This couldn't be replaced, leave it as it is...
-				unescapedStr += "&";
-				unescapedStr.append(escapedChar.c_str(), escapedChar.length());
-				unescapedStr += ";";
-			}
-
-			startPos = pos + 1;
-		}
-
-		// Next
-		pos = str.find("&", startPos);
+		return false;
 	}
-	if (startPos < str.length())
-	{
-		string remainder(str.substr(startPos));
 
-		unescapedStr.append(remainder.c_str(), remainder.length());
-	}
+	return (strncmp(pStr, pPrefix, prefixLength) == 0);
+}
 
-	return unescapedStr;
+static const char *findString(const char *pStr, const char *pEnd, const char *pNeedle,
+	unsigned int needleLength)
+{
+	return search(pStr, pEnd, pNeedle, pNeedle + needleLength);
 }
 
 XmlFilter::XmlFilter(const string &mime_type) :
@@ -134,7 +96,8 @@ XmlFilter::~XmlFilter()
 bool XmlFilter::is_data_input_ok(DataInput input) const
 {
 	if ((input == DOCUMENT_DATA) ||
-		(input == DOCUMENT_STRING))
+		(input == DOCUMENT_STRING) ||
+		(input == DOCUMENT_FILE_NAME))
 	{
 		return true;
 	}
@@ -155,20 +118,36 @@ bool XmlFilter::set_document_data(const char *data_ptr, unsigned int data_length
 		return false;
 	}
 
-	string xml_doc(data_ptr, data_length);
-	return set_document_string(xml_doc);
+	rewind();
+
+	// The caller keeps the data around, so there's no need to copy it
+	if (parse_xml(data_ptr, data_length) == true)
+	{
+		m_doneWithDocument = false;
+		return true;
+	}
+
+	return false;
 }
 
 bool XmlFilter::set_document_string(const string &data_str)
 {
-	if (data_str.empty() == true)
+	return set_document_data(data_str.c_str(), data_str.length());
+}
+
+bool XmlFilter::set_document_file(const string &file_path, bool unlink_when_done)
+{
+	if ((Filter::set_document_file(file_path, unlink_when_done) == false) ||
+		(map_file() == false))
 	{
 		return false;
 	}
 
-	rewind();
+	bool parsedXml = parse_xml(m_pMappedFile, m_mappedLength);
 
-	if (parse_xml(data_str) == true)
+	// Parsing doesn't refer back to the input
+	unmap_file();
+	if (parsedXml == true)
 	{
 		m_doneWithDocument = false;
 		return true;
@@ -177,11 +156,6 @@ bool XmlFilter::set_document_string(const string &data_str)
 	return false;
 }
 
-bool XmlFilter::set_document_file(const string &file_path, bool unlink_when_done)
-{
-	return false;
-}
-
 bool XmlFilter::set_document_uri(const string &uri)
 {
 	return false;
@@ -233,46 +207,99 @@ void XmlFilter::rewind(void)
 	m_doneWithDocument = false;
 }
 
-bool XmlFilter::parse_xml(const string &xml_doc)
+bool XmlFilter::parse_xml(const char *xml_ptr, unsigned int xml_length)
 {
-	if (xml_doc.empty() == true)
+	if ((xml_ptr == NULL) ||
+		(xml_length == 0))
 	{
 		return false;
 	}
 
+	const char *pEnd = xml_ptr + xml_length;
+	const char *pText = xml_ptr;
+	string text;
+
 	m_metaData.clear();
-	m_content = replaceEntities(xml_doc);
+	m_metaData["ipath"] = "";
+	m_metaData["mimetype"] = "text/plain";
+	if (is_content_streamed() == false)
+	{
+		m_content.reserve(xml_length);
+	}
+	text.reserve(TEXT_CHUNK_SIZE);
+
+	// The input may start with a partial tag, eg "a>...</a><b>...</b>"
+	const char *pTagStart = find(pText, pEnd, '<');
+	const char *pTagEnd = find(pText, pTagStart, '>');
+	if (pTagEnd != pTagStart)
+	{
+		pText = pTagEnd + 1;
+	}
 
-	// Tag start
-	dstring::size_type startPos = m_content.find("<");
-	while (startPos != string::npos)
+	// Scan the document once, keeping text between tags
+	while (pText < pEnd)
 	{
-		dstring::size_type endPos = m_content.find(">", startPos);
-		if (endPos == string::npos)
+		pTagStart = find(pText, pEnd, '<');
+		if (pTagStart > pText)
+		{
+			HtmlParser::decode_entities(pText, pTagStart - pText, text);
+		}
+		if (pTagStart == pEnd)
 		{
 			break;
 		}
 
-		m_content.replace(startPos, endPos - startPos + 1, " ");
+		if (startsWith(pTagStart, pEnd, "<![CDATA[", 9) == true)
+		{
+			// Character data is kept as is
+			const char *pDataEnd = findString(pTagStart + 9, pEnd, "]]>", 3);
 
-		// Next
-		startPos = m_content.find("<");
-	}
+			text.append(pTagStart + 9, pDataEnd - pTagStart - 9);
+			if (pDataEnd == pEnd)
+			{
+				break;
+			}
+			pText = pDataEnd + 3;
+		}
+		else
+		{
+			if (startsWith(pTagStart, pEnd, "<!--", 4) == true)
+			{
+				// Comments may contain tags
+				pTagEnd = findString(pTagStart + 4, pEnd, "-->", 3);
+				if (pTagEnd != pEnd)
+				{
+					pTagEnd += 2;
+				}
+			}
+			else
+			{
+				pTagEnd = find(pTagStart + 1, pEnd, '>');
+			}
+			// The input may end with a partial tag, eg "...<c"
+			if (pTagEnd == pEnd)
+			{
+				break;
+			}
 
-	// The input may contain partial tags, eg "a>...</a><b>...</b>...<c"
-	dstring::size_type pos = m_content.find(">");
-	if (pos != string::npos)
-	{
-		m_content.erase(0, pos + 1);
-	}
-	pos = m_content.find("<");
-	if (pos != string::npos)
-	{
-		m_content.erase(pos);
-	}
+			// Replace the tag with a space
+			text += " ";
+			pText = pTagEnd + 1;
+		}
 
-	m_metaData["ipath"] = "";
-	m_metaData["mimetype"] = "text/plain";
+		if (text.length() >= TEXT_CHUNK_SIZE)
+		{
+			if (append_content(text.c_str(), text.length()) == false)
+			{
+				break;
+			}
+			text.clear();
+		}
+	}
+	append_content(text.c_str(), text.length());
+#ifdef DEBUG
+	cout << "XmlFilter::parse_xml: " << xml_length << " bytes of XML" << endl;
+#endif
 
 	return true;
 }
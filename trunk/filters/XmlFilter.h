@@ -25,6 +25,11 @@
 
 namespace Dijon
 {
+    /** A filter for XML documents, that keeps the text between tags.
+     * Entities are decoded with HtmlParser, so HtmlParser.cc has to be
+     * built and linked in wherever XmlFilter.cc is, eg in the library
+     * built with _DYNAMIC_DIJON_XMLFILTER.
+     */
     class XmlFilter : public Filter
     {
     public:
@@ -105,7 +110,7 @@ namespace Dijon
 
 	virtual void rewind(void);
 
-	bool parse_xml(const std::string &xml_doc);
+	bool parse_xml(const char *xml_ptr, unsigned int xml_length);
 
     private:
 	/// XmlFilter objects cannot be copied.
@@ -0,0 +1,421 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <zlib.h>
+#include <iostream>
+#include <algorithm>
+
+#include "ZipFilter.h"
+
+using std::string;
+using std::cout;
+using std::endl;
+using std::min;
+using std::max;
+
+using namespace Dijon;
+
+// Which members hold the text of each type
+static const struct
+{
+	const char *m_mimeType;
+	const char *m_memberPattern;
+} g_zipTypes[] = {
+	{ "application/vnd.oasis.opendocument.chart", "content.xml" },
+	{ "application/vnd.oasis.opendocument.database", "content.xml" },
+	{ "application/vnd.oasis.opendocument.formula", "content.xml" },
+	{ "application/vnd.oasis.opendocument.graphics", "content.xml" },
+	{ "application/vnd.oasis.opendocument.graphics-template", "content.xml" },
+	{ "application/vnd.oasis.opendocument.presentation", "content.xml" },
+	{ "application/vnd.oasis.opendocument.presentation-template", "content.xml" },
+	{ "application/vnd.oasis.opendocument.spreadsheet", "content.xml" },
+	{ "application/vnd.oasis.opendocument.spreadsheet-template", "content.xml" },
+	{ "application/vnd.oasis.opendocument.text", "content.xml" },
+	{ "application/vnd.oasis.opendocument.text-master", "content.xml" },
+	{ "application/vnd.oasis.opendocument.text-template", "content.xml" },
+	{ "application/vnd.oasis.opendocument.text-web", "content.xml" },
+	{ "application/vnd.openxmlformats-officedocument.presentationml.presentation", "ppt/slides/slide*.xml" },
+	{ "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet", "xl/sharedStrings.xml" },
+	{ "application/vnd.openxmlformats-officedocument.wordprocessingml.document", "word/document.xml" },
+	{ "application/vnd.sun.xml.calc", "content.xml" },
+	{ "application/vnd.sun.xml.calc.template", "content.xml" },
+	{ "application/vnd.sun.xml.draw", "content.xml" },
+	{ "application/vnd.sun.xml.draw.template", "content.xml" },
+	{ "application/vnd.sun.xml.impress", "content.xml" },
+	{ "application/vnd.sun.xml.impress.template", "content.xml" },
+	{ "application/vnd.sun.xml.math", "content.xml" },
+	{ "application/vnd.sun.xml.writer", "content.xml" },
+	{ "application/vnd.sun.xml.writer.global", "content.xml" },
+	{ "application/vnd.sun.xml.writer.template", "content.xml" }
+};
+static const unsigned int g_zipTypesCount = sizeof(g_zipTypes) / sizeof(g_zipTypes[0]);
+
+#ifdef _DYNAMIC_DIJON_FILTERS
+DIJON_FILTER_EXPORT bool get_filter_types(std::set<std::string> &mime_types)
+{
+	mime_types.clear();
+	for (unsigned int typeNum = 0; typeNum < g_zipTypesCount; ++typeNum)
+	{
+		mime_types.insert(g_zipTypes[typeNum].m_mimeType);
+	}
+
+	return true;
+}
+
+DIJON_FILTER_EXPORT bool check_filter_data_input(int data_input)
+{
+	Filter::DataInput input = (Filter::DataInput)data_input;
+
+	if ((input == Filter::DOCUMENT_DATA) ||
+		(input == Filter::DOCUMENT_STRING) ||
+		(input == Filter::DOCUMENT_FILE_NAME))
+	{
+		return true;
+	}
+
+	return false;
+}
+
+DIJON_FILTER_EXPORT Filter *get_filter(const std::string &mime_type)
+{
+	return new ZipFilter(mime_type);
+}
+#endif
+
+// ZIP records are little-endian
+static unsigned int readUInt16(const unsigned char *pData)
+{
+	return (unsigned int)pData[0] | ((unsigned int)pData[1] << 8);
+}
+
+static unsigned int readUInt32(const unsigned char *pData)
+{
+	return (unsigned int)pData[0] | ((unsigned int)pData[1] << 8) |
+		((unsigned int)pData[2] << 16) | ((unsigned int)pData[3] << 24);
+}
+
+static const char *findMemberPattern(const string &mimeType)
+{
+	for (unsigned int typeNum = 0; typeNum < g_zipTypesCount; ++typeNum)
+	{
+		if (mimeType == g_zipTypes[typeNum].m_mimeType)
+		{
+			return g_zipTypes[typeNum].m_memberPattern;
+		}
+	}
+
+	return NULL;
+}
+
+ZipFilter::ZipFilter(const string &mime_type) :
+	XmlFilter(mime_type),
+	m_maxSize(0)
+{
+}
+
+ZipFilter::~ZipFilter()
+{
+	rewind();
+}
+
+bool ZipFilter::is_data_input_ok(DataInput input) const
+{
+	if ((input == DOCUMENT_DATA) ||
+		(input == DOCUMENT_STRING) ||
+		(input == DOCUMENT_FILE_NAME))
+	{
+		return true;
+	}
+
+	return false;
+}
+
+bool ZipFilter::set_property(Properties prop_name, const string &prop_value)
+{
+	if ((prop_name == MAXIMUM_NESTED_SIZE) &&
+		(prop_value.empty() == false))
+	{
+		m_maxSize = (off_t)atoll(prop_value.c_str());
+	}
+
+	return true;
+}
+
+bool ZipFilter::set_document_data(const char *data_ptr, unsigned int data_length)
+{
+	rewind();
+
+	if (parse_zip(data_ptr, data_length) == true)
+	{
+		m_doneWithDocument = false;
+		return true;
+	}
+
+	return false;
+}
+
+bool ZipFilter::set_document_string(const string &data_str)
+{
+	return set_document_data(data_str.c_str(), data_str.length());
+}
+
+bool ZipFilter::set_document_file(const string &file_path, bool unlink_when_done)
+{
+	if ((Filter::set_document_file(file_path, unlink_when_done) == false) ||
+		(map_file() == false))
+	{
+		return false;
+	}
+
+	bool parsedZip = parse_zip(m_pMappedFile, m_mappedLength);
+
+	// Members are inflated out of the mapping
+	unmap_file();
+	if (parsedZip == true)
+	{
+		m_doneWithDocument = false;
+		return true;
+	}
+
+	return false;
+}
+
+string ZipFilter::get_error(void) const
+{
+	return m_error;
+}
+
+void ZipFilter::rewind(void)
+{
+	XmlFilter::rewind();
+
+	m_error.clear();
+}
+
+bool ZipFilter::parse_zip(const char *zip_ptr, unsigned int zip_length)
+{
+	const unsigned char *pZip = (const unsigned char *)zip_ptr;
+	const char *pPattern = findMemberPattern(m_mimeType);
+	dstring xml;
+
+	if (pPattern == NULL)
+	{
+		m_error = "unsupported type";
+		return false;
+	}
+	if ((zip_ptr == NULL) ||
+		(zip_length < 22))
+	{
+		m_error = "not a ZIP file";
+		return false;
+	}
+
+	// Look for the end of central directory record, it may be followed by a comment
+	unsigned int eocdPos = zip_length - 22;
+	unsigned int minEocdPos = (eocdPos > 65535) ? eocdPos - 65535 : 0;
+	while (readUInt32(pZip + eocdPos) != 0x06054b50)
+	{
+		if (eocdPos == minEocdPos)
+		{
+			m_error = "no central directory";
+			return false;
+		}
+		--eocdPos;
+	}
+
+	unsigned int entriesCount = readUInt16(pZip + eocdPos + 10);
+	unsigned int dirLength = readUInt32(pZip + eocdPos + 12);
+	unsigned int dirPos = readUInt32(pZip + eocdPos + 16);
+	if ((entriesCount == 0xffff) ||
+		(dirPos == 0xffffffff))
+	{
+		m_error = "ZIP64 files are not supported";
+		return false;
+	}
+	if ((dirPos > eocdPos) ||
+		(dirLength > eocdPos - dirPos))
+	{
+		m_error = "bad central directory";
+		return false;
+	}
+#ifdef DEBUG
+	cout << "ZipFilter::parse_zip: " << entriesCount << " entries, looking for " << pPattern << endl;
+#endif
+
+	// Members are concatenated in the order of the central directory, as with unzip -p
+	unsigned int entryPos = dirPos;
+	for (unsigned int entryNum = 0; entryNum < entriesCount; ++entryNum)
+	{
+		if ((eocdPos - entryPos < 46) ||
+			(readUInt32(pZip + entryPos) != 0x02014b50))
+		{
+			m_error = "bad central directory entry";
+			break;
+		}
+
+		unsigned int flags = readUInt16(pZip + entryPos + 8);
+		unsigned int method = readUInt16(pZip + entryPos + 10);
+		unsigned int compressedLength = readUInt32(pZip + entryPos + 20);
+		unsigned int uncompressedLength = readUInt32(pZip + entryPos + 24);
+		unsigned int nameLength = readUInt16(pZip + entryPos + 28);
+		unsigned int extraLength = readUInt16(pZip + entryPos + 30);
+		unsigned int commentLength = readUInt16(pZip + entryPos + 32);
+		unsigned int localPos = readUInt32(pZip + entryPos + 42);
+
+		if (eocdPos - entryPos - 46 < nameLength)
+		{
+			m_error = "bad central directory entry";
+			break;
+		}
+
+		string name(zip_ptr + entryPos + 46, nameLength);
+
+		entryPos += 46 + nameLength + extraLength + commentLength;
+		if (entryPos > eocdPos)
+		{
+			entryPos = eocdPos;
+		}
+
+		if (fnmatch(pPattern, name.c_str(), 0) != 0)
+		{
+			continue;
+		}
+		if (flags & 1)
+		{
+#ifdef DEBUG
+			cout << "ZipFilter::parse_zip: " << name << " is encrypted" << endl;
+#endif
+			continue;
+		}
+
+		// The data follows the local header, whose extra field may differ
+		if ((zip_length < 30) ||
+			(localPos > zip_length - 30) ||
+			(readUInt32(pZip + localPos) != 0x04034b50))
+		{
+			m_error = "bad local header for " + name;
+			continue;
+		}
+		unsigned int dataPos = localPos + 30 + readUInt16(pZip + localPos + 26) +
+			readUInt16(pZip + localPos + 28);
+		if ((dataPos > zip_length) ||
+			(compressedLength > zip_length - dataPos))
+		{
+			m_error = "truncated member " + name;
+			continue;
+		}
+
+		if (inflate_member(zip_ptr + dataPos, compressedLength, method,
+			uncompressedLength, xml) == false)
+		{
+			m_error = "couldn't inflate " + name;
+		}
+#ifdef DEBUG
+		cout << "ZipFilter::parse_zip: " << name << " gave " << xml.length() << " bytes" << endl;
+#endif
+
+		if ((m_maxSize > 0) &&
+			((off_t)xml.length() >= m_maxSize))
+		{
+#ifdef DEBUG
+			cout << "ZipFilter::parse_zip: stopping at " << xml.length() << endl;
+#endif
+			xml.resize(m_maxSize);
+			break;
+		}
+	}
+
+	if (xml.empty() == true)
+	{
+		if (m_error.empty() == true)
+		{
+			m_error = "no member matches ";
+			m_error += pPattern;
+		}
+
+		return false;
+	}
+
+	return parse_xml(xml.c_str(), xml.length());
+}
+
+bool ZipFilter::inflate_member(const char *data_ptr, unsigned int data_length,
+	unsigned int method, unsigned int uncompressed_length, dstring &xml)
+{
+	if (method == 0)
+	{
+		// Stored
+		xml.append(data_ptr, data_length);
+
+		return true;
+	}
+	else if (method != Z_DEFLATED)
+	{
+#ifdef DEBUG
+		cout << "ZipFilter::inflate_member: unsupported method " << method << endl;
+#endif
+		return false;
+	}
+
+	z_stream zipStream;
+
+	memset(&zipStream, 0, sizeof(z_stream));
+	zipStream.next_in = (Bytef *)data_ptr;
+	zipStream.avail_in = data_length;
+
+	// Members are raw deflate streams
+	if (inflateInit2(&zipStream, -MAX_WBITS) != Z_OK)
+	{
+		return false;
+	}
+
+	// The central directory's size is a hint, don't trust it blindly
+	char inflateBuffer[65536];
+	int status = Z_OK;
+
+	xml.reserve(xml.length() + min(uncompressed_length, 16777216U));
+	while (status == Z_OK)
+	{
+		if ((m_maxSize > 0) &&
+			((off_t)xml.length() >= m_maxSize))
+		{
+			break;
+		}
+
+		zipStream.next_out = (Bytef *)inflateBuffer;
+		zipStream.avail_out = (uInt)sizeof(inflateBuffer);
+
+		status = inflate(&zipStream, Z_NO_FLUSH);
+		xml.append(inflateBuffer, sizeof(inflateBuffer) - zipStream.avail_out);
+	}
+	inflateEnd(&zipStream);
+
+	if ((status == Z_OK) ||
+		(status == Z_STREAM_END))
+	{
+		return true;
+	}
+#ifdef DEBUG
+	cout << "ZipFilter::inflate_member: inflate failed with " << status << endl;
+#endif
+
+	return false;
+}
@@ -0,0 +1,103 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DIJON_ZIPFILTER_H
+#define _DIJON_ZIPFILTER_H
+
+#include <sys/types.h>
+#include <string>
+
+#include "XmlFilter.h"
+
+namespace Dijon
+{
+    /** A filter for documents that are ZIP files with their text in XML
+     * members, eg OpenDocument and Office Open XML.
+     * Matching members are inflated and parsed without running unzip.
+     */
+    class ZipFilter : public XmlFilter
+    {
+    public:
+	/// Builds an empty filter.
+	ZipFilter(const std::string &mime_type);
+	/// Destroys the filter.
+	virtual ~ZipFilter();
+
+
+	// Information.
+
+	/// Returns what data the filter requires as input.
+	virtual bool is_data_input_ok(DataInput input) const;
+
+
+	// Initialization.
+
+	/** Sets a property, prior to calling set_document_XXX().
+	 * Returns false if the property is not supported.
+	 */
+	virtual bool set_property(Properties prop_name, const std::string &prop_value);
+
+	/** (Re)initializes the filter with the given data.
+	 * Caller should ensure the given pointer is valid until the
+	 * Filter object is destroyed, as some filters may not need to
+	 * do a deep copy of the data.
+	 * Call next_document() to position the filter onto the first document.
+	 * Returns false if this input is not supported or an error occured.
+	 */
+	virtual bool set_document_data(const char *data_ptr, unsigned int data_length);
+
+	/** (Re)initializes the filter with the given data.
+	 * Call next_document() to position the filter onto the first document.
+	 * Returns false if this input is not supported or an error occured.
+	 */
+	virtual bool set_document_string(const std::string &data_str);
+
+	/** (Re)initializes the filter with the given file.
+	 * Call next_document() to position the filter onto the first document.
+	 * Returns false if this input is not supported or an error occured.
+	 */
+	virtual bool set_document_file(const std::string &file_path,
+		bool unlink_when_done = false);
+
+
+	// Accessing documents' contents.
+
+	/// Returns the message for the most recent error that has occured.
+	virtual std::string get_error(void) const;
+
+    protected:
+	off_t m_maxSize;
+	std::string m_error;
+
+	virtual void rewind(void);
+
+	bool parse_zip(const char *zip_ptr, unsigned int zip_length);
+
+	bool inflate_member(const char *data_ptr, unsigned int data_length,
+		unsigned int method, unsigned int uncompressed_length, dstring &xml);
+
+    private:
+	/// ZipFilter objects cannot be copied.
+	ZipFilter(const ZipFilter &other);
+	/// ZipFilter objects cannot be copied.
+	ZipFilter& operator=(const ZipFilter& other);
+
+    };
+}
+
+#endif // _DIJON_ZIPFILTER_H
@@ -0,0 +1,502 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <iostream>
+#include <string>
+#include <map>
+#include <algorithm>
+
+#include "HtmlParser.h"
+
+using namespace std;
+
+static double getTime(void)
+{
+	struct timeval timeNow;
+
+	gettimeofday(&timeNow, NULL);
+
+	return (double)timeNow.tv_sec + (double)timeNow.tv_usec / 1000000.0;
+}
+
+// Builds entity-dense text, like tables of &nbsp; or escaped code listings
+static void buildText(string &text, string::size_type minSize)
+{
+	static const char *pieces[] = { "&nbsp;", "&lt;td&gt;", "caf&eacute; ",
+		"&#233;", "&#x20AC;", "a&amp;b ", "&quot;x&quot; ", "word ",
+		"AT&T ", "&bogus; ", "&#65 ", "&amp;lt; " };
+	unsigned int pieceNum = 0;
+
+	while (text.length() < minSize)
+	{
+		text += pieces[pieceNum];
+		// Go through all pieces, in a mixed order
+		pieceNum = (pieceNum + 7) % 12;
+	}
+}
+
+// HtmlParser's decoder before it decoded in one pass, copied as is so that
+// the new decoder is checked against what it replaced
+namespace Baseline
+{
+
+static map<string, unsigned int> named_ents;
+
+
+inline static bool
+p_notdigit(char c)
+{
+    return !isdigit(static_cast<unsigned char>(c));
+}
+
+inline static bool
+p_notxdigit(char c)
+{
+    return !isxdigit(static_cast<unsigned char>(c));
+}
+
+inline static bool
+p_notalnum(char c)
+{
+    return !isalnum(static_cast<unsigned char>(c));
+}
+
+static unsigned
+nonascii_to_utf8(unsigned ch, char * buf)
+{
+    // FIXME: use CJKVTokenizer's _unicode_to_char()
+    if (ch < 0x800) {
+	buf[0] = 0xc0 | (ch >> 6);
+	buf[1] = 0x80 | (ch & 0x3f);
+	return 2;
+    }
+    if (ch < 0x10000) {
+	buf[0] = 0xe0 | (ch >> 12);
+	buf[1] = 0x80 | ((ch >> 6) & 0x3f);
+	buf[2] = 0x80 | (ch & 0x3f);
+	return 3;
+    }
+    if (ch < 0x200000) {
+	buf[0] = 0xf0 | (ch >> 18);
+	buf[1] = 0x80 | ((ch >> 12) & 0x3f);
+	buf[2] = 0x80 | ((ch >> 6) & 0x3f);
+	buf[3] = 0x80 | (ch & 0x3f);
+	return 4;
+    }
+
+    return 0;
+}
+
+static void
+init_named_ents()
+{
+    static const struct ent { const char *n; unsigned int v; } ents[] = {
+// Names and values from: "Character entity references in HTML 4"
+// http://www.w3.org/TR/html4/sgml/entities.html
+{ "quot", 34 },
+{ "amp", 38 },
+{ "apos", 39 }, // Not in HTML 4 list but used in OpenOffice XML.
+{ "lt", 60 },
+{ "gt", 62 },
+{ "nbsp", 160 },
+{ "iexcl", 161 },
+{ "cent", 162 },
+{ "pound", 163 },
+{ "curren", 164 },
+{ "yen", 165 },
+{ "brvbar", 166 },
+{ "sect", 167 },
+{ "uml", 168 },
+{ "copy", 169 },
+{ "ordf", 170 },
+{ "laquo", 171 },
+{ "not", 172 },
+{ "shy", 173 },
+{ "reg", 174 },
+{ "macr", 175 },
+{ "deg", 176 },
+{ "plusmn", 177 },
+{ "sup2", 178 },
+{ "sup3", 179 },
+{ "acute", 180 },
+{ "micro", 181 },
+{ "para", 182 },
+{ "middot", 183 },
+{ "cedil", 184 },
+{ "sup1", 185 },
+{ "ordm", 186 },
+{ "raquo", 187 },
+{ "frac14", 188 },
+{ "frac12", 189 },
+{ "frac34", 190 },
+{ "iquest", 191 },
+{ "Agrave", 192 },
+{ "Aacute", 193 },
+{ "Acirc", 194 },
+{ "Atilde", 195 },
+{ "Auml", 196 },
+{ "Aring", 197 },
+{ "AElig", 198 },
+{ "Ccedil", 199 },
+{ "Egrave", 200 },
+{ "Eacute", 201 },
+{ "Ecirc", 202 },
+{ "Euml", 203 },
+{ "Igrave", 204 },
+{ "Iacute", 205 },
+{ "Icirc", 206 },
+{ "Iuml", 207 },
+{ "ETH", 208 },
+{ "Ntilde", 209 },
+{ "Ograve", 210 },
+{ "Oacute", 211 },
+{ "Ocirc", 212 },
+{ "Otilde", 213 },
+{ "Ouml", 214 },
+{ "times", 215 },
+{ "Oslash", 216 },
+{ "Ugrave", 217 },
+{ "Uacute", 218 },
+{ "Ucirc", 219 },
+{ "Uuml", 220 },
+{ "Yacute", 221 },
+{ "THORN", 222 },
+{ "szlig", 223 },
+{ "agrave", 224 },
+{ "aacute", 225 },
+{ "acirc", 226 },
+{ "atilde", 227 },
+{ "auml", 228 },
+{ "aring", 229 },
+{ "aelig", 230 },
+{ "ccedil", 231 },
+{ "egrave", 232 },
+{ "eacute", 233 },
+{ "ecirc", 234 },
+{ "euml", 235 },
+{ "igrave", 236 },
+{ "iacute", 237 },
+{ "icirc", 238 },
+{ "iuml", 239 },
+{ "eth", 240 },
+{ "ntilde", 241 },
+{ "ograve", 242 },
+{ "oacute", 243 },
+{ "ocirc", 244 },
+{ "otilde", 245 },
+{ "ouml", 246 },
+{ "divide", 247 },
+{ "oslash", 248 },
+{ "ugrave", 249 },
+{ "uacute", 250 },
+{ "ucirc", 251 },
+{ "uuml", 252 },
+{ "yacute", 253 },
+{ "thorn", 254 },
+{ "yuml", 255 },
+{ "OElig", 338 },
+{ "oelig", 339 },
+{ "Scaron", 352 },
+{ "scaron", 353 },
+{ "Yuml", 376 },
+{ "fnof", 402 },
+{ "circ", 710 },
+{ "tilde", 732 },
+{ "Alpha", 913 },
+{ "Beta", 914 },
+{ "Gamma", 915 },
+{ "Delta", 916 },
+{ "Epsilon", 917 },
+{ "Zeta", 918 },
+{ "Eta", 919 },
+{ "Theta", 920 },
+{ "Iota", 921 },
+{ "Kappa", 922 },
+{ "Lambda", 923 },
+{ "Mu", 924 },
+{ "Nu", 925 },
+{ "Xi", 926 },
+{ "Omicron", 927 },
+{ "Pi", 928 },
+{ "Rho", 929 },
+{ "Sigma", 931 },
+{ "Tau", 932 },
+{ "Upsilon", 933 },
+{ "Phi", 934 },
+{ "Chi", 935 },
+{ "Psi", 936 },
+{ "Omega", 937 },
+{ "alpha", 945 },
+{ "beta", 946 },
+{ "gamma", 947 },
+{ "delta", 948 },
+{ "epsilon", 949 },
+{ "zeta", 950 },
+{ "eta", 951 },
+{ "theta", 952 },
+{ "iota", 953 },
+{ "kappa", 954 },
+{ "lambda", 955 },
+{ "mu", 956 },
+{ "nu", 957 },
+{ "xi", 958 },
+{ "omicron", 959 },
+{ "pi", 960 },
+{ "rho", 961 },
+{ "sigmaf", 962 },
+{ "sigma", 963 },
+{ "tau", 964 },
+{ "upsilon", 965 },
+{ "phi", 966 },
+{ "chi", 967 },
+{ "psi", 968 },
+{ "omega", 969 },
+{ "thetasym", 977 },
+{ "upsih", 978 },
+{ "piv", 982 },
+{ "ensp", 8194 },
+{ "emsp", 8195 },
+{ "thinsp", 8201 },
+{ "zwnj", 8204 },
+{ "zwj", 8205 },
+{ "lrm", 8206 },
+{ "rlm", 8207 },
+{ "ndash", 8211 },
+{ "mdash", 8212 },
+{ "lsquo", 8216 },
+{ "rsquo", 8217 },
+{ "sbquo", 8218 },
+{ "ldquo", 8220 },
+{ "rdquo", 8221 },
+{ "bdquo", 8222 },
+{ "dagger", 8224 },
+{ "Dagger", 8225 },
+{ "bull", 8226 },
+{ "hellip", 8230 },
+{ "permil", 8240 },
+{ "prime", 8242 },
+{ "Prime", 8243 },
+{ "lsaquo", 8249 },
+{ "rsaquo", 8250 },
+{ "oline", 8254 },
+{ "frasl", 8260 },
+{ "euro", 8364 },
+{ "image", 8465 },
+{ "weierp", 8472 },
+{ "real", 8476 },
+{ "trade", 8482 },
+{ "alefsym", 8501 },
+{ "larr", 8592 },
+{ "uarr", 8593 },
+{ "rarr", 8594 },
+{ "darr", 8595 },
+{ "harr", 8596 },
+{ "crarr", 8629 },
+{ "lArr", 8656 },
+{ "uArr", 8657 },
+{ "rArr", 8658 },
+{ "dArr", 8659 },
+{ "hArr", 8660 },
+{ "forall", 8704 },
+{ "part", 8706 },
+{ "exist", 8707 },
+{ "empty", 8709 },
+{ "nabla", 8711 },
+{ "isin", 8712 },
+{ "notin", 8713 },
+{ "ni", 8715 },
+{ "prod", 8719 },
+{ "sum", 8721 },
+{ "minus", 8722 },
+{ "lowast", 8727 },
+{ "radic", 8730 },
+{ "prop", 8733 },
+{ "infin", 8734 },
+{ "ang", 8736 },
+{ "and", 8743 },
+{ "or", 8744 },
+{ "cap", 8745 },
+{ "cup", 8746 },
+{ "int", 8747 },
+{ "there4", 8756 },
+{ "sim", 8764 },
+{ "cong", 8773 },
+{ "asymp", 8776 },
+{ "ne", 8800 },
+{ "equiv", 8801 },
+{ "le", 8804 },
+{ "ge", 8805 },
+{ "sub", 8834 },
+{ "sup", 8835 },
+{ "nsub", 8836 },
+{ "sube", 8838 },
+{ "supe", 8839 },
+{ "oplus", 8853 },
+{ "otimes", 8855 },
+{ "perp", 8869 },
+{ "sdot", 8901 },
+{ "lceil", 8968 },
+{ "rceil", 8969 },
+{ "lfloor", 8970 },
+{ "rfloor", 8971 },
+{ "lang", 9001 },
+{ "rang", 9002 },
+{ "loz", 9674 },
+{ "spades", 9824 },
+{ "clubs", 9827 },
+{ "hearts", 9829 },
+{ "diams", 9830 },
+{ NULL, 0 }
+    };
+    if (named_ents.empty()) {
+	const struct ent *i = ents;
+	while (i->n) {
+	    named_ents[string(i->n)] = i->v;
+	    ++i;
+	}
+    }
+}
+
+static void
+decode_entities(string &s)
+{
+    // We need a const_iterator version of s.end() - otherwise the
+    // find() and find_if() templates don't work...
+    string::const_iterator amp = s.begin(), s_end = s.end();
+    while ((amp = find(amp, s_end, '&')) != s_end) {
+	unsigned int val = 0;
+	string::const_iterator end, p = amp + 1;
+	if (p != s_end && *p == '#') {
+	    p++;
+	    if (p != s_end && (*p == 'x' || *p == 'X')) {
+		// hex
+		p++;
+		end = find_if(p, s_end, p_notxdigit);
+		sscanf(s.substr(p - s.begin(), end - p).c_str(), "%x", &val);
+	    } else {
+		// number
+		end = find_if(p, s_end, p_notdigit);
+		val = atoi(s.substr(p - s.begin(), end - p).c_str());
+	    }
+	} else {
+	    end = find_if(p, s_end, p_notalnum);
+	    string code = s.substr(p - s.begin(), end - p);
+	    map<string, unsigned int>::const_iterator i;
+	    i = named_ents.find(code);
+	    if (i != named_ents.end()) val = i->second;
+	}
+	if (end < s_end && *end == ';') end++;
+	if (val) {
+	    string::size_type amp_pos = amp - s.begin();
+	    if (val < 0x80) {
+		s.replace(amp_pos, end - amp, 1u, char(val));
+	    } else {
+		// Convert unicode value val to UTF-8.
+		char seq[4];
+		unsigned len = nonascii_to_utf8(val, seq);
+		s.replace(amp_pos, end - amp, seq, len);
+	    }
+	    s_end = s.end();
+	    // We've modified the string, so the iterators are no longer
+	    // valid...
+	    amp = s.begin() + amp_pos + 1;
+	} else {
+	    amp = end;
+	}
+    }
+}
+
+}
+
+// References to values past unicode's are kept as they are
+static bool checkOutOfRange(void)
+{
+	static const char *cases[][2] = {
+		{ "&#1114111;x", "\xf4\x8f\xbf\xbfx" },
+		{ "&#x10FFFF;x", "\xf4\x8f\xbf\xbfx" },
+		{ "&#1114112;x", "&#1114112;x" },
+		{ "&#x110000;x", "&#x110000;x" },
+		{ "&#11141120;x", "&#11141120;x" },
+		{ "&#x10FFFFF;x", "&#x10FFFFF;x" },
+		{ "&#99999999999999999999;x", "&#99999999999999999999;x" },
+		{ "&#xfffffffffffffffff41;x", "&#xfffffffffffffffff41;x" },
+		{ "&#x0000041;x", "Ax" } };
+	bool passed = true;
+
+	for (unsigned int caseNum = 0; caseNum < sizeof(cases) / sizeof(cases[0]); ++caseNum)
+	{
+		string decoded;
+
+		HtmlParser::decode_entities(cases[caseNum][0], strlen(cases[caseNum][0]), decoded);
+		if (decoded != cases[caseNum][1])
+		{
+			cerr << "Decoded " << cases[caseNum][0] << " wrongly" << endl;
+			passed = false;
+		}
+	}
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	string::size_type textSize = 1024 * 1024;
+	string text, inPlace, onePass;
+
+	if (argc > 1)
+	{
+		textSize = (string::size_type)atol(argv[1]);
+	}
+	buildText(text, textSize);
+	Baseline::init_named_ents();
+
+	double startTime = getTime();
+	inPlace = text;
+	Baseline::decode_entities(inPlace);
+	double inPlaceTime = getTime() - startTime;
+
+	startTime = getTime();
+	HtmlParser::decode_entities(text.data(), text.length(), onePass);
+	double onePassTime = getTime() - startTime;
+
+	cout << text.length() << " bytes of entity-dense text" << endl;
+	cout << "In place: " << inPlaceTime << " s, "
+		<< (double)text.length() / inPlaceTime / 1048576.0 << " MB/s" << endl;
+	cout << "One pass: " << onePassTime << " s, "
+		<< (double)text.length() / onePassTime / 1048576.0 << " MB/s" << endl;
+
+	if (inPlace != onePass)
+	{
+		cerr << "Outputs differ" << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "Outputs are identical" << endl;
+
+	if (checkOutOfRange() == false)
+	{
+		return EXIT_FAILURE;
+	}
+	cout << "Out of range references are kept" << endl;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,161 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <iostream>
+#include <string>
+
+#include "FilterFactory.h"
+
+using namespace std;
+using namespace Dijon;
+
+// Built-in types, a type with parameters, and types that may be in libraries or not at all
+static const char *g_types[] = { "text/plain", "text/html; charset=utf-8", "text/xml",
+	"application/pdf", "application/x-lim", "image/png" };
+static const unsigned int g_typesCount = sizeof(g_types) / sizeof(g_types[0]);
+
+typedef enum { IS_SUPPORTED = 0, GET_FILTER, ACQUIRE_FILTER } CallType;
+static const char *g_callNames[] = { "isSupportedType", "getFilter", "acquireFilter" };
+
+static CallType g_callType = IS_SUPPORTED;
+static unsigned long g_iterations = 1000000;
+
+static double getTime(void)
+{
+	struct timeval timeNow;
+
+	gettimeofday(&timeNow, NULL);
+
+	return (double)timeNow.tv_sec + (double)timeNow.tv_usec / 1000000.0;
+}
+
+static void *callFactory(void *pData)
+{
+	string types[g_typesCount];
+	unsigned long foundCount = 0;
+
+	for (unsigned int typeNum = 0; typeNum < g_typesCount; ++typeNum)
+	{
+		types[typeNum] = g_types[typeNum];
+	}
+
+	for (unsigned long iterNum = 0; iterNum < g_iterations; ++iterNum)
+	{
+		const string &mimeType = types[iterNum % g_typesCount];
+
+		if (g_callType == IS_SUPPORTED)
+		{
+			if (FilterFactory::isSupportedType(mimeType) == true)
+			{
+				++foundCount;
+			}
+		}
+		else if (g_callType == GET_FILTER)
+		{
+			Filter *pFilter = FilterFactory::getFilter(mimeType);
+
+			if (pFilter != NULL)
+			{
+				++foundCount;
+				delete pFilter;
+			}
+		}
+		else
+		{
+			Filter *pFilter = FilterFactory::acquireFilter(mimeType);
+
+			if (pFilter != NULL)
+			{
+				++foundCount;
+				FilterFactory::releaseFilter(pFilter);
+			}
+		}
+	}
+
+	return (void *)foundCount;
+}
+
+int main(int argc, char **argv)
+{
+	string dirName;
+	unsigned int threadsCount = 1;
+
+	if (argc > 1)
+	{
+		dirName = argv[1];
+	}
+	if (argc > 2)
+	{
+		g_iterations = (unsigned long)atol(argv[2]);
+	}
+	if (argc > 3)
+	{
+		threadsCount = (unsigned int)atoi(argv[3]);
+	}
+	if ((g_iterations == 0) ||
+		(threadsCount == 0) ||
+		(threadsCount > 64))
+	{
+		cerr << "Usage: " << argv[0] << " [FILTERS_DIRECTORY [ITERATIONS [THREADS]]]" << endl;
+		return EXIT_FAILURE;
+	}
+
+	if (dirName.empty() == false)
+	{
+		unsigned int librariesCount = FilterFactory::loadFilters(dirName);
+
+		cout << "Loaded " << librariesCount << " libraries from " << dirName << endl;
+	}
+
+	for (int callType = IS_SUPPORTED; callType <= ACQUIRE_FILTER; ++callType)
+	{
+		pthread_t threads[64];
+		unsigned long foundCount = 0;
+
+		g_callType = (CallType)callType;
+
+		double startTime = getTime();
+		for (unsigned int threadNum = 0; threadNum < threadsCount; ++threadNum)
+		{
+			if (pthread_create(&threads[threadNum], NULL, callFactory, NULL) != 0)
+			{
+				cerr << "Couldn't start thread " << threadNum << endl;
+				return EXIT_FAILURE;
+			}
+		}
+		for (unsigned int threadNum = 0; threadNum < threadsCount; ++threadNum)
+		{
+			void *pFound = NULL;
+
+			pthread_join(threads[threadNum], &pFound);
+			foundCount += (unsigned long)pFound;
+		}
+		double callsTime = getTime() - startTime;
+
+		cout << g_callNames[callType] << ": " << threadsCount << " threads, "
+			<< foundCount << " found, "
+			<< (double)g_iterations * threadsCount / callsTime / 1000000.0 << " Mcalls/s" << endl;
+	}
+
+	FilterFactory::unloadFilters();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,814 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <gmime/gmime.h>
+
+#include "GMimeMboxFilter.h"
+#include "MaildirFilter.h"
+
+using namespace std;
+using namespace Dijon;
+
+// The second message starts this far in, past what 32 bits can hold
+static const off_t FAR_OFFSET = 4LL * 1024 * 1024 * 1024 + 1000;
+
+static const char *g_subjects[] = { "first", "second", "third" };
+
+// Large enough to be split into shards
+static const string::size_type SHARDED_SIZE = 24 * 1024 * 1024;
+// The filter's shard size
+static const string::size_type SHARD_SIZE = 8 * 1024 * 1024;
+// Less than the length of long bodies
+static const string::size_type LONG_BODY_SIZE = 50000;
+// Enough for folders to be split into shards
+static const unsigned int FOLDER_MESSAGES = 150;
+
+static string buildMessage(const char *subject)
+{
+	string message("From sender@example.com Mon Jan 10 10:00:00 2011\n"
+		"From: sender@example.com\n"
+		"To: recipient@example.com\n"
+		"Date: Mon, 10 Jan 2011 10:00:00 +0000\n"
+		"Subject: ");
+
+	message += subject;
+	message += "\n\nThis is the ";
+	message += subject;
+	message += " message.\n\n";
+
+	return message;
+}
+
+/** Writes a mailbox with a first message, then a deleted message whose
+ * Content-Length spans a hole, then two more messages. As it's deleted,
+ * parsing doesn't extract that body.
+ */
+static bool buildMailbox(const string &filePath, vector<off_t> &offsets)
+{
+	int fd = open(filePath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	string first(buildMessage(g_subjects[0]));
+	string rest("\n\n");
+	off_t restOffset = FAR_OFFSET - (off_t)rest.length();
+	string deleted("From sender@example.com Mon Jan 10 10:00:00 2011\n"
+		"From: sender@example.com\n"
+		"Subject: deleted\n"
+		"X-Mozilla-Status: 0008\n"
+		"Content-Length: ");
+	char lengthStr[64];
+
+	// The body ends with the line feed before the next From line,
+	// and starts after the length's own digits
+	off_t bodyStart = (off_t)(first.length() + deleted.length()) + 2;
+	snprintf(lengthStr, 64, "%llu", (unsigned long long)(FAR_OFFSET - 1 - bodyStart));
+	bodyStart += (off_t)strlen(lengthStr);
+	snprintf(lengthStr, 64, "%llu", (unsigned long long)(FAR_OFFSET - 1 - bodyStart));
+	deleted += lengthStr;
+	deleted += "\n\n";
+	first += deleted;
+
+	offsets.push_back(0);
+	offsets.push_back(FAR_OFFSET);
+	rest += buildMessage(g_subjects[1]);
+	offsets.push_back(restOffset + (off_t)rest.length());
+	rest += buildMessage(g_subjects[2]);
+
+	bool builtMailbox = ((pwrite(fd, first.c_str(), first.length(), 0) == (ssize_t)first.length()) &&
+		(pwrite(fd, rest.c_str(), rest.length(), restOffset) == (ssize_t)rest.length()));
+	close(fd);
+
+	return builtMailbox;
+}
+
+static string getIpath(off_t offset)
+{
+	char ipath[128];
+
+	snprintf(ipath, 128, "o=%llu&p=0", (unsigned long long)offset);
+
+	return ipath;
+}
+
+// Checks the current document is the given message
+static bool checkDocument(const Filter &filter, const vector<off_t> &offsets,
+	unsigned int messageNum)
+{
+	const map<string, string> &metaData = filter.get_meta_data();
+	map<string, string>::const_iterator ipathIter = metaData.find("ipath");
+	map<string, string>::const_iterator titleIter = metaData.find("title");
+	string expectedIpath(getIpath(offsets[messageNum]));
+
+	if ((ipathIter == metaData.end()) ||
+		(ipathIter->second != expectedIpath))
+	{
+		cerr << "Message " << messageNum << ": expected ipath " << expectedIpath << ", got "
+			<< (ipathIter == metaData.end() ? string("none") : ipathIter->second) << endl;
+		return false;
+	}
+	if ((titleIter == metaData.end()) ||
+		(titleIter->second != g_subjects[messageNum]))
+	{
+		cerr << "Message " << messageNum << ": expected title " << g_subjects[messageNum] << endl;
+		return false;
+	}
+	cout << "Message " << messageNum << " at " << ipathIter->second << endl;
+
+	return true;
+}
+
+// Goes through the mailbox, then skips to each message past 4 GB
+static bool checkMailbox(const string &filePath, const vector<off_t> &offsets,
+	const string &mode)
+{
+	bool passed = true;
+
+	cout << "Checking " << mode << " mode" << endl;
+
+	// Go through all messages
+	{
+		GMimeMboxFilter filter("application/mbox");
+		unsigned int messageNum = 0;
+
+		filter.set_property(Filter::OPERATING_MODE, mode);
+		if (filter.set_document_file(filePath) == false)
+		{
+			cerr << "Couldn't open " << filePath << endl;
+			passed = false;
+		}
+		while ((passed == true) &&
+			(filter.next_document() == true))
+		{
+			if ((messageNum >= offsets.size()) ||
+				(checkDocument(filter, offsets, messageNum) == false))
+			{
+				passed = false;
+			}
+			++messageNum;
+		}
+		if (messageNum != offsets.size())
+		{
+			cerr << "Found " << messageNum << " messages instead of " << offsets.size() << endl;
+			passed = false;
+		}
+	}
+
+	// Skip to each message past 4 GB, then carry on from there
+	for (unsigned int messageNum = 1; (passed == true) && (messageNum < offsets.size()); ++messageNum)
+	{
+		GMimeMboxFilter filter("application/mbox");
+
+		filter.set_property(Filter::OPERATING_MODE, mode);
+		if ((filter.set_document_file(filePath) == false) ||
+			(filter.skip_to_document(getIpath(offsets[messageNum])) == false))
+		{
+			cerr << "Couldn't skip to message " << messageNum << endl;
+			passed = false;
+			break;
+		}
+		passed = checkDocument(filter, offsets, messageNum);
+
+		for (unsigned int nextNum = messageNum + 1; (passed == true) && (nextNum < offsets.size()); ++nextNum)
+		{
+			if (filter.next_document() == false)
+			{
+				cerr << "No message after " << nextNum - 1 << endl;
+				passed = false;
+				break;
+			}
+			passed = checkDocument(filter, offsets, nextNum);
+		}
+	}
+
+	return passed;
+}
+
+/** Writes a mailbox that is split into shards. Every tenth message, and
+ * the one each shard ends in, has a long body with From lines that only
+ * its Content-Length tells apart. The message each shard starts with has
+ * no subject, as does every tenth message. Some messages are deleted.
+ */
+static bool buildShardedMailbox(const string &filePath)
+{
+	ofstream mailbox(filePath.c_str(), ios::out|ios::trunc|ios::binary);
+	string::size_type mailboxSize = 0, shardEnd = SHARD_SIZE;
+
+	for (unsigned int messageNum = 0; mailboxSize < SHARDED_SIZE; ++messageNum)
+	{
+		stringstream message, body;
+		bool startsShard = false, hasLength = (messageNum % 10 == 0);
+
+		if (mailboxSize >= shardEnd)
+		{
+			// The filter starts the next shard with the first message past its size
+			startsShard = true;
+			shardEnd = mailboxSize + SHARD_SIZE;
+		}
+		else if (mailboxSize + LONG_BODY_SIZE > shardEnd)
+		{
+			hasLength = true;
+		}
+
+		message << "From sender@example.com Mon Jan 10 10:00:00 2011\n"
+			<< "From: sender@example.com\n"
+			<< "Date: Mon, 10 Jan 2011 10:00:00 +0000\n";
+		if ((startsShard == false) &&
+			(messageNum % 10 != 1))
+		{
+			message << "Subject: message " << messageNum << "\n";
+		}
+		if ((startsShard == false) &&
+			(messageNum % 7 == 3))
+		{
+			message << "X-Mozilla-Status: 0008\n";
+		}
+		if (hasLength == true)
+		{
+			for (unsigned int lineNum = 0; lineNum < 2000; ++lineNum)
+			{
+				body << "\nFrom line " << lineNum << " of message " << messageNum << "\n";
+			}
+			message << "Content-Length: " << body.str().length() << "\n";
+		}
+		else
+		{
+			for (unsigned int lineNum = 0; lineNum < 20; ++lineNum)
+			{
+				body << "Line " << lineNum << " of message " << messageNum << "\n";
+			}
+			body << "\n";
+		}
+		message << "\n" << body.str();
+
+		mailbox << message.str();
+		mailboxSize += message.str().length();
+	}
+	mailbox.close();
+
+	return mailbox.good();
+}
+
+// Returns the contents of the only file in the given directory
+static string readIndex(const string &dirName)
+{
+	string contents;
+	DIR *pDir = opendir(dirName.c_str());
+
+	if (pDir == NULL)
+	{
+		return "";
+	}
+
+	struct dirent *pEntry = readdir(pDir);
+	while (pEntry != NULL)
+	{
+		string fileName(pEntry->d_name);
+
+		if ((fileName != ".") &&
+			(fileName != ".."))
+		{
+			string filePath(dirName + "/" + fileName);
+			ifstream indexFile(filePath.c_str(), ios::in|ios::binary);
+			stringstream fileContents;
+
+			fileContents << indexFile.rdbuf();
+			contents = fileContents.str();
+			unlink(filePath.c_str());
+		}
+		pEntry = readdir(pDir);
+	}
+	closedir(pDir);
+	rmdir(dirName.c_str());
+
+	return contents;
+}
+
+// Returns the current document's metadata and content
+static string getDocument(const Filter &filter)
+{
+	const map<string, string> &metaData = filter.get_meta_data();
+	const dstring &content = filter.get_content();
+	string document;
+
+	for (map<string, string>::const_iterator metaIter = metaData.begin();
+		metaIter != metaData.end(); ++metaIter)
+	{
+		document += metaIter->first + "=" + metaIter->second + "\n";
+	}
+	document.append(content.c_str(), content.length());
+
+	return document;
+}
+
+// Extracts all documents with the given number of threads, and returns the index built
+static bool extractSharded(const string &filePath, const string &threadsCount,
+	vector<string> &documents, string &index)
+{
+	char dirTemplate[] = "/tmp/mbox-test-XXXXXX";
+
+	if (mkdtemp(dirTemplate) == NULL)
+	{
+		return false;
+	}
+
+	{
+		GMimeMboxFilter filter("application/mbox");
+
+		filter.set_property(Filter::OPERATING_MODE, "index");
+		filter.set_property(Filter::MAXIMUM_THREADS, threadsCount);
+		filter.set_property(Filter::INDEX_DIRECTORY, dirTemplate);
+		if (filter.set_document_file(filePath) == false)
+		{
+			return false;
+		}
+		while (filter.next_document() == true)
+		{
+			documents.push_back(getDocument(filter));
+		}
+	}
+
+	// The index is saved when the filter is destroyed
+	index = readIndex(dirTemplate);
+
+	return true;
+}
+
+// Checks extracting a large mailbox with several threads gives the same results as one
+static bool checkShards(const string &filePath)
+{
+	vector<string> documents, shardedDocuments;
+	string index, shardedIndex;
+
+	cout << "Checking shards" << endl;
+
+	if (buildShardedMailbox(filePath) == false)
+	{
+		cerr << "Couldn't write " << filePath << endl;
+		return false;
+	}
+
+	bool passed = ((extractSharded(filePath, "1", documents, index) == true) &&
+		(extractSharded(filePath, "4", shardedDocuments, shardedIndex) == true));
+	unlink(filePath.c_str());
+	if (passed == false)
+	{
+		cerr << "Couldn't extract " << filePath << endl;
+		return false;
+	}
+
+	for (vector<string>::size_type docNum = 0; docNum < documents.size(); ++docNum)
+	{
+		if ((docNum >= shardedDocuments.size()) ||
+			(documents[docNum] != shardedDocuments[docNum]))
+		{
+			cerr << "Document " << docNum << " differs with shards" << endl;
+			return false;
+		}
+	}
+	if (documents.size() != shardedDocuments.size())
+	{
+		cerr << "Found " << shardedDocuments.size() << " documents with shards instead of "
+			<< documents.size() << endl;
+		return false;
+	}
+	if ((index.empty() == true) ||
+		(index != shardedIndex))
+	{
+		cerr << "The index differs with shards" << endl;
+		return false;
+	}
+	cout << documents.size() << " documents and the index are the same with shards" << endl;
+
+	return true;
+}
+
+// Skips to the given message, and returns the document found there
+static bool skipToMessage(const string &filePath, const string &mode,
+	const string &indexDirectory, const string &ipath, string &document)
+{
+	GMimeMboxFilter filter("application/mbox");
+
+	filter.set_property(Filter::OPERATING_MODE, mode);
+	if (indexDirectory.empty() == false)
+	{
+		filter.set_property(Filter::INDEX_DIRECTORY, indexDirectory);
+	}
+	if ((filter.set_document_file(filePath) == false) ||
+		(filter.skip_to_document(ipath) == false))
+	{
+		return false;
+	}
+	document = getDocument(filter);
+
+	return true;
+}
+
+/** Indexes a mailbox, then flags its second message as deleted in place,
+ * and checks skipping to that message gives the same document with the
+ * index as without.
+ */
+static bool checkRewrittenMailbox(const string &filePath)
+{
+	string mailbox, statusHeader("X-Mozilla-Status: ");
+	off_t deletedOffset = 0, statusOffset = 0;
+
+	cout << "Checking mailboxes rewritten in place" << endl;
+
+	for (unsigned int messageNum = 0; messageNum < 3; ++messageNum)
+	{
+		stringstream message;
+
+		if (messageNum == 1)
+		{
+			deletedOffset = (off_t)mailbox.length();
+		}
+		message << "From sender@example.com Mon Jan 10 10:00:00 2011\n"
+			<< "From: sender@example.com\n"
+			<< "Date: Mon, 10 Jan 2011 10:00:00 +0000\n"
+			<< "Subject: m" << messageNum << "\n"
+			<< statusHeader;
+		if (messageNum == 1)
+		{
+			statusOffset = (off_t)(mailbox.length() + message.str().length());
+		}
+		message << "0000\n\nThis is message " << messageNum << ".\n";
+		if (messageNum == 2)
+		{
+			// Past what the index checks before its end
+			message << string(8192, 'x') << "\n";
+		}
+		message << "\n";
+		mailbox += message.str();
+	}
+
+	char dirTemplate[] = "/tmp/mbox-test-XXXXXX";
+	int fd = open(filePath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if ((fd < 0) ||
+		(mkdtemp(dirTemplate) == NULL))
+	{
+		cerr << "Couldn't write " << filePath << endl;
+		return false;
+	}
+	bool passed = (write(fd, mailbox.c_str(), mailbox.length()) == (ssize_t)mailbox.length());
+	close(fd);
+
+	// Index the whole mailbox
+	if (passed == true)
+	{
+		GMimeMboxFilter filter("application/mbox");
+
+		filter.set_property(Filter::OPERATING_MODE, "index");
+		filter.set_property(Filter::INDEX_DIRECTORY, dirTemplate);
+		passed = filter.set_document_file(filePath);
+		while ((passed == true) &&
+			(filter.next_document() == true));
+	}
+
+	// Flag the second message as deleted, without changing the size
+	struct timeval times[2];
+	fd = open(filePath.c_str(), O_WRONLY);
+	if ((passed == false) ||
+		(fd < 0) ||
+		(pwrite(fd, "0008", 4, statusOffset) != 4) ||
+		(gettimeofday(&times[0], NULL) != 0))
+	{
+		cerr << "Couldn't rewrite " << filePath << endl;
+		passed = false;
+	}
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+	// The modification time has to change
+	times[0].tv_sec += 10;
+	times[1] = times[0];
+	utimes(filePath.c_str(), times);
+
+	const char *modes[] = { "metadata", "index" };
+	for (unsigned int modeNum = 0; (passed == true) && (modeNum < 2); ++modeNum)
+	{
+		string document, indexedDocument;
+
+		if ((skipToMessage(filePath, modes[modeNum], "", getIpath(deletedOffset), document) == false) ||
+			(skipToMessage(filePath, modes[modeNum], dirTemplate, getIpath(deletedOffset), indexedDocument) == false))
+		{
+			cerr << "Couldn't skip to the deleted message in " << modes[modeNum] << " mode" << endl;
+			passed = false;
+		}
+		else if ((indexedDocument != document) ||
+			(document.find("title=m2\n") == string::npos))
+		{
+			cerr << "The deleted message was found with the index in " << modes[modeNum] << " mode" << endl;
+			passed = false;
+		}
+	}
+	readIndex(dirTemplate);
+	unlink(filePath.c_str());
+
+	if (passed == true)
+	{
+		cout << "Deleted messages are skipped with the index" << endl;
+	}
+
+	return passed;
+}
+
+/** Writes a Maildir or MH folder, and returns the names of the messages
+ * that aren't trashed in the order they should be found. Every tenth
+ * message has no subject. MH folders hold files that aren't messages.
+ * Some Maildir messages are new, others are read and some of those trashed.
+ */
+static bool buildFolder(const string &dirPath, bool isMH, vector<string> &files,
+	vector<string> &names)
+{
+	if ((mkdir(dirPath.c_str(), 0755) != 0) ||
+		((isMH == false) &&
+		((mkdir((dirPath + "/cur").c_str(), 0755) != 0) ||
+		(mkdir((dirPath + "/new").c_str(), 0755) != 0))))
+	{
+		return false;
+	}
+
+	if (isMH == true)
+	{
+		files.push_back(".mh_sequences");
+		files.push_back("notes");
+	}
+	for (unsigned int messageNum = 0; messageNum < FOLDER_MESSAGES; ++messageNum)
+	{
+		char nameStr[64];
+		string name, fileName;
+
+		if (isMH == true)
+		{
+			// Numbers aren't padded, so names don't sort like them
+			snprintf(nameStr, 64, "%u", messageNum + 1);
+			name = fileName = nameStr;
+		}
+		else
+		{
+			snprintf(nameStr, 64, "1300000%03u.M%uP1.example.com", messageNum, messageNum);
+			name = nameStr;
+			if (messageNum % 3 == 0)
+			{
+				fileName = "new/" + name;
+			}
+			else if (messageNum % 9 == 4)
+			{
+				fileName = "cur/" + name + ":2,ST";
+			}
+			else
+			{
+				fileName = "cur/" + name + ":2,S";
+			}
+		}
+		if (fileName.find(":2,ST") == string::npos)
+		{
+			names.push_back(name);
+		}
+		files.push_back(fileName);
+	}
+
+	for (vector<string>::const_iterator fileIter = files.begin(); fileIter != files.end(); ++fileIter)
+	{
+		string::size_type fileNum = fileIter - files.begin();
+		ofstream messageFile((dirPath + "/" + *fileIter).c_str(), ios::out|ios::trunc|ios::binary);
+
+		messageFile << "From: sender@example.com\n"
+			<< "Date: Mon, 10 Jan 2011 10:00:00 +0000\n";
+		if (fileNum % 10 != 1)
+		{
+			messageFile << "Subject: file " << *fileIter << "\n";
+		}
+		messageFile << "\nThis is " << *fileIter << ".\n";
+		messageFile.close();
+		if (messageFile.good() == false)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void removeFolder(const string &dirPath, bool isMH, const vector<string> &files)
+{
+	for (vector<string>::const_iterator fileIter = files.begin(); fileIter != files.end(); ++fileIter)
+	{
+		unlink((dirPath + "/" + *fileIter).c_str());
+	}
+	if (isMH == false)
+	{
+		rmdir((dirPath + "/cur").c_str());
+		rmdir((dirPath + "/new").c_str());
+	}
+	rmdir(dirPath.c_str());
+}
+
+// Extracts all documents of a folder with the given number of threads
+static bool extractFolder(const string &dirPath, const string &mimeType,
+	const string &threadsCount, vector<string> &documents, vector<string> &ipaths)
+{
+	MaildirFilter filter(mimeType);
+
+	filter.set_property(Filter::OPERATING_MODE, "index");
+	filter.set_property(Filter::MAXIMUM_THREADS, threadsCount);
+	if (filter.set_document_file(dirPath) == false)
+	{
+		return false;
+	}
+	while (filter.next_document() == true)
+	{
+		const map<string, string> &metaData = filter.get_meta_data();
+		map<string, string>::const_iterator ipathIter = metaData.find("ipath");
+
+		documents.push_back(getDocument(filter));
+		ipaths.push_back((ipathIter == metaData.end()) ? string("") : ipathIter->second);
+	}
+
+	return true;
+}
+
+/** Checks extracting a folder with several threads gives the same results as one,
+ * that ipaths name the messages that aren't trashed, and skipping to one of these.
+ */
+static bool checkFolder(const string &dirPath, const string &mimeType)
+{
+	vector<string> files, names, documents, ipaths, shardedDocuments, shardedIpaths;
+	bool isMH = (mimeType == "application/x-mh");
+
+	cout << "Checking " << mimeType << " folders" << endl;
+
+	if (buildFolder(dirPath, isMH, files, names) == false)
+	{
+		cerr << "Couldn't write " << dirPath << endl;
+		removeFolder(dirPath, isMH, files);
+		return false;
+	}
+
+	bool passed = ((extractFolder(dirPath, mimeType, "1", documents, ipaths) == true) &&
+		(extractFolder(dirPath, mimeType, "4", shardedDocuments, shardedIpaths) == true));
+	if (passed == false)
+	{
+		cerr << "Couldn't extract " << dirPath << endl;
+	}
+	else if ((documents != shardedDocuments) ||
+		(ipaths != shardedIpaths))
+	{
+		cerr << "Documents differ with shards" << endl;
+		passed = false;
+	}
+	else if (ipaths.size() != names.size())
+	{
+		cerr << "Found " << ipaths.size() << " documents instead of " << names.size() << endl;
+		passed = false;
+	}
+
+	for (vector<string>::size_type docNum = 0; (passed == true) && (docNum < ipaths.size()); ++docNum)
+	{
+		if (ipaths[docNum] != "f=" + names[docNum] + "&p=0")
+		{
+			cerr << "Document " << docNum << ": expected " << names[docNum] << ", got "
+				<< ipaths[docNum] << endl;
+			passed = false;
+		}
+	}
+
+	// Skip to a message, then carry on from there
+	if (passed == true)
+	{
+		vector<string>::size_type docNum = ipaths.size() / 2;
+		MaildirFilter filter(mimeType);
+
+		filter.set_property(Filter::OPERATING_MODE, "index");
+		if ((filter.set_document_file(dirPath) == false) ||
+			(filter.skip_to_document(ipaths[docNum]) == false) ||
+			(getDocument(filter) != documents[docNum]) ||
+			(filter.next_document() == false) ||
+			(getDocument(filter) != documents[docNum + 1]))
+		{
+			cerr << "Couldn't skip to " << ipaths[docNum] << endl;
+			passed = false;
+		}
+	}
+
+	// Trashed messages can't be skipped to
+	if ((passed == true) &&
+		(isMH == false))
+	{
+		MaildirFilter filter(mimeType);
+
+		if ((filter.set_document_file(dirPath) == false) ||
+			(filter.skip_to_document("f=1300000004.M4P1.example.com&p=0") == true))
+		{
+			cerr << "Skipped to a trashed message" << endl;
+			passed = false;
+		}
+	}
+	removeFolder(dirPath, isMH, files);
+
+	if (passed == true)
+	{
+		cout << documents.size() << " documents are the same with shards" << endl;
+	}
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	string filePath("/tmp/mbox-test.mbox");
+	vector<string> modes;
+	vector<off_t> offsets;
+
+	if (argc > 1)
+	{
+		filePath = argv[1];
+	}
+	if (argc > 2)
+	{
+		modes.push_back(argv[2]);
+	}
+	else
+	{
+		// GMime parses the whole mailbox, while metadata mode only reads headers
+		modes.push_back("index");
+		modes.push_back("metadata");
+	}
+
+	if (buildMailbox(filePath, offsets) == false)
+	{
+		cerr << "Couldn't write " << filePath << endl;
+		return EXIT_FAILURE;
+	}
+
+	bool passed = true;
+
+	for (vector<string>::const_iterator modeIter = modes.begin();
+		(passed == true) && (modeIter != modes.end()); ++modeIter)
+	{
+		passed = checkMailbox(filePath, offsets, *modeIter);
+	}
+
+	unlink(filePath.c_str());
+
+	// Shards are only used when parsing with GMime
+	if ((passed == true) &&
+		(find(modes.begin(), modes.end(), "index") != modes.end()))
+	{
+		passed = checkShards(filePath + ".shards");
+		if (passed == true)
+		{
+			passed = checkRewrittenMailbox(filePath + ".rewritten");
+		}
+		if (passed == true)
+		{
+			passed = checkFolder(filePath + ".maildir", "application/x-maildir");
+		}
+		if (passed == true)
+		{
+			passed = checkFolder(filePath + ".mh", "application/x-mh");
+		}
+	}
+
+	if (passed == false)
+	{
+		return EXIT_FAILURE;
+	}
+	cout << "Ipaths past 4 GB are as expected" << endl;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,115 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <iostream>
+#include <string>
+
+#include "XmlFilter.h"
+
+using namespace std;
+using namespace Dijon;
+
+static const char *PARAGRAPH_TEXT = "with  styled  text, <escaped> markup & caf\xc3\xa9  raw <data>";
+
+static double getTime(void)
+{
+	struct timeval timeNow;
+
+	gettimeofday(&timeNow, NULL);
+
+	return (double)timeNow.tv_sec + (double)timeNow.tv_usec / 1000000.0;
+}
+
+// Builds an OpenDocument-style content.xml, and returns how many paragraphs it has
+static unsigned int buildDocument(string &xml, string::size_type minSize)
+{
+	unsigned int paragraphsCount = 0;
+
+	xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<office:document-content xmlns:office=\"urn:oasis:names:tc:opendocument:xmlns:office:1.0\" "
+		"xmlns:text=\"urn:oasis:names:tc:opendocument:xmlns:text:1.0\" office:version=\"1.2\">"
+		"<office:body><office:text>";
+	while (xml.length() < minSize)
+	{
+		char paragraph[512];
+
+		snprintf(paragraph, 512, "<text:p text:style-name=\"P%u\">Paragraph%u with "
+			"<text:span text:style-name=\"T1\">styled</text:span> text, "
+			"&lt;escaped&gt; markup &amp; caf&#233;<text:s/>"
+			"<!-- <text:p>comment</text:p> --><![CDATA[raw <data>]]></text:p>\n",
+			paragraphsCount % 16, paragraphsCount);
+		xml += paragraph;
+		++paragraphsCount;
+	}
+	xml += "</office:text></office:body></office:document-content>\n";
+
+	return paragraphsCount;
+}
+
+int main(int argc, char **argv)
+{
+	string::size_type xmlSize = 20 * 1024 * 1024;
+	string xml;
+
+	if (argc > 1)
+	{
+		xmlSize = (string::size_type)atol(argv[1]);
+	}
+	unsigned int paragraphsCount = buildDocument(xml, xmlSize);
+
+	XmlFilter filter("text/xml");
+
+	double startTime = getTime();
+	if ((filter.set_document_data(xml.c_str(), (unsigned int)xml.length()) == false) ||
+		(filter.next_document() == false))
+	{
+		cerr << "Couldn't parse the document" << endl;
+		return EXIT_FAILURE;
+	}
+	double parseTime = getTime() - startTime;
+
+	const dstring &content = filter.get_content();
+	string text(content.c_str(), content.length());
+	unsigned int foundCount = 0;
+
+	// Each paragraph's text should be there, with a space for each tag, and no markup
+	for (string::size_type pos = text.find(PARAGRAPH_TEXT);
+		pos != string::npos; pos = text.find(PARAGRAPH_TEXT, pos + 1))
+	{
+		++foundCount;
+	}
+
+	cout << xml.length() << " bytes of XML, " << paragraphsCount << " paragraphs" << endl;
+	cout << "Parsed in " << parseTime << " s, "
+		<< (double)xml.length() / parseTime / 1048576.0 << " MB/s, "
+		<< text.length() << " bytes of text" << endl;
+
+	if ((foundCount != paragraphsCount) ||
+		(text.find("text:p") != string::npos) ||
+		(text.find("comment") != string::npos))
+	{
+		cerr << "Unexpected text, found " << foundCount << " paragraphs" << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "Text is as expected" << endl;
+
+	return EXIT_SUCCESS;
+}
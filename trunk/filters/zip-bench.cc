@@ -0,0 +1,296 @@
+/*
+ *  Copyright 2011 Fabrice Colin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <set>
+
+#include "ZipFilter.h"
+#include "ExternalFilter.h"
+#include "XmlFilter.h"
+
+using namespace std;
+using namespace Dijon;
+
+static const char *ODT_TYPE = "application/vnd.oasis.opendocument.text";
+
+static double getTime(void)
+{
+	struct timeval timeNow;
+
+	gettimeofday(&timeNow, NULL);
+
+	return (double)timeNow.tv_sec + (double)timeNow.tv_usec / 1000000.0;
+}
+
+static void writeShort(string &buffer, unsigned int value)
+{
+	buffer += (char)(value & 0xff);
+	buffer += (char)((value >> 8) & 0xff);
+}
+
+static void writeLong(string &buffer, unsigned long value)
+{
+	writeShort(buffer, (unsigned int)(value & 0xffff));
+	writeShort(buffer, (unsigned int)((value >> 16) & 0xffff));
+}
+
+// Adds a member to the archive, and its entry to the central directory
+static bool addMember(string &archive, string &directory, const string &name,
+	const string &data, bool isDeflated)
+{
+	string compressed(data);
+	unsigned long crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)data.c_str(), (uInt)data.length());
+
+	if (isDeflated == true)
+	{
+		z_stream zipStream;
+
+		memset(&zipStream, 0, sizeof(z_stream));
+		// Members are raw deflate streams
+		if (deflateInit2(&zipStream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+			8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			return false;
+		}
+		compressed.resize(deflateBound(&zipStream, (uLong)data.length()));
+		zipStream.next_in = (Bytef *)data.c_str();
+		zipStream.avail_in = (uInt)data.length();
+		zipStream.next_out = (Bytef *)&compressed[0];
+		zipStream.avail_out = (uInt)compressed.length();
+		int status = deflate(&zipStream, Z_FINISH);
+		compressed.resize(zipStream.total_out);
+		deflateEnd(&zipStream);
+		if (status != Z_STREAM_END)
+		{
+			return false;
+		}
+	}
+
+	string header;
+	unsigned long headerOffset = (unsigned long)archive.length();
+
+	// Version, flags, method, time and date, CRC and sizes
+	writeShort(header, 20);
+	writeShort(header, 0);
+	writeShort(header, (isDeflated == true) ? Z_DEFLATED : 0);
+	writeLong(header, 0);
+	writeLong(header, crc);
+	writeLong(header, (unsigned long)compressed.length());
+	writeLong(header, (unsigned long)data.length());
+	writeShort(header, (unsigned int)name.length());
+	writeShort(header, 0);
+
+	archive += "PK\x03\x04";
+	archive += header;
+	archive += name;
+	archive += compressed;
+
+	directory += "PK\x01\x02";
+	writeShort(directory, 20);
+	directory += header;
+	// Comment, disk, attributes and local header's offset
+	writeShort(directory, 0);
+	writeShort(directory, 0);
+	writeShort(directory, 0);
+	writeLong(directory, 0);
+	writeLong(directory, headerOffset);
+	directory += name;
+
+	return true;
+}
+
+// Writes an OpenDocument text file, with a stored and two deflated members
+static bool buildDocument(const string &filePath, unsigned int documentNum,
+	unsigned int paragraphsCount)
+{
+	string content("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<office:document-content xmlns:office=\"urn:oasis:names:tc:opendocument:xmlns:office:1.0\" "
+		"xmlns:text=\"urn:oasis:names:tc:opendocument:xmlns:text:1.0\" office:version=\"1.2\">"
+		"<office:body><office:text>");
+	string archive, directory;
+
+	for (unsigned int paragraphNum = 0; paragraphNum < paragraphsCount; ++paragraphNum)
+	{
+		char paragraph[512];
+
+		snprintf(paragraph, 512, "<text:p text:style-name=\"P%u\">Document %u paragraph %u with "
+			"<text:span text:style-name=\"T1\">styled</text:span> text, "
+			"&lt;escaped&gt; markup &amp; caf&#233;</text:p>\n",
+			paragraphNum % 16, documentNum, paragraphNum);
+		content += paragraph;
+	}
+	content += "</office:text></office:body></office:document-content>\n";
+
+	if ((addMember(archive, directory, "mimetype", ODT_TYPE, false) == false) ||
+		(addMember(archive, directory, "content.xml", content, true) == false) ||
+		(addMember(archive, directory, "styles.xml", "<office:document-styles/>\n", true) == false))
+	{
+		return false;
+	}
+
+	unsigned long directoryOffset = (unsigned long)archive.length();
+
+	archive += directory;
+	// End of central directory record
+	archive += "PK\x05\x06";
+	writeShort(archive, 0);
+	writeShort(archive, 0);
+	writeShort(archive, 3);
+	writeShort(archive, 3);
+	writeLong(archive, (unsigned long)directory.length());
+	writeLong(archive, directoryOffset);
+	writeShort(archive, 0);
+
+	ofstream file(filePath.c_str(), ios::out|ios::trunc|ios::binary);
+
+	file << archive;
+	file.close();
+
+	return file.good();
+}
+
+// Extracts the document's text with ZipFilter
+static bool extractInProcess(const string &filePath, string &text)
+{
+	ZipFilter filter(ODT_TYPE);
+
+	if ((filter.set_document_file(filePath) == false) ||
+		(filter.next_document() == false))
+	{
+		return false;
+	}
+
+	const dstring &content = filter.get_content();
+	text.assign(content.c_str(), content.length());
+
+	return true;
+}
+
+// Extracts the document's text with unzip, then parses its XML output
+static bool extractExternally(const string &filePath, string &text)
+{
+	ExternalFilter filter(ODT_TYPE);
+
+	if ((filter.set_document_file(filePath) == false) ||
+		(filter.next_document() == false))
+	{
+		return false;
+	}
+
+	const dstring &xml = filter.get_content();
+	XmlFilter xmlFilter("application/xml");
+
+	if ((xmlFilter.set_document_data(xml.c_str(), (unsigned int)xml.length()) == false) ||
+		(xmlFilter.next_document() == false))
+	{
+		return false;
+	}
+
+	const dstring &content = xmlFilter.get_content();
+	text.assign(content.c_str(), content.length());
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int documentsCount = 200, paragraphsCount = 200;
+	string configFile("external-filters.xml");
+	vector<string> filePaths;
+	set<string> types;
+
+	if (argc > 1)
+	{
+		documentsCount = (unsigned int)atoi(argv[1]);
+	}
+	if (argc > 2)
+	{
+		configFile = argv[2];
+	}
+
+	ExternalFilter::initialize(configFile, types);
+	if (types.find(ODT_TYPE) == types.end())
+	{
+		cerr << configFile << " doesn't have a command for " << ODT_TYPE << endl;
+		return EXIT_FAILURE;
+	}
+
+	for (unsigned int documentNum = 0; documentNum < documentsCount; ++documentNum)
+	{
+		char filePath[128];
+
+		snprintf(filePath, 128, "/tmp/zip-bench-%u.odt", documentNum);
+		filePaths.push_back(filePath);
+		if (buildDocument(filePath, documentNum, paragraphsCount) == false)
+		{
+			cerr << "Couldn't write " << filePath << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	vector<string> inProcessTexts(filePaths.size()), externalTexts(filePaths.size());
+	bool passed = true;
+
+	double startTime = getTime();
+	for (vector<string>::size_type fileNum = 0; (passed == true) && (fileNum < filePaths.size()); ++fileNum)
+	{
+		passed = extractInProcess(filePaths[fileNum], inProcessTexts[fileNum]);
+	}
+	double inProcessTime = getTime() - startTime;
+
+	startTime = getTime();
+	for (vector<string>::size_type fileNum = 0; (passed == true) && (fileNum < filePaths.size()); ++fileNum)
+	{
+		passed = extractExternally(filePaths[fileNum], externalTexts[fileNum]);
+	}
+	double externalTime = getTime() - startTime;
+
+	for (vector<string>::const_iterator pathIter = filePaths.begin(); pathIter != filePaths.end(); ++pathIter)
+	{
+		unlink(pathIter->c_str());
+	}
+	ExternalFilter::shutdown();
+
+	if (passed == false)
+	{
+		cerr << "Couldn't extract all documents" << endl;
+		return EXIT_FAILURE;
+	}
+
+	cout << documentsCount << " OpenDocument files of " << paragraphsCount << " paragraphs" << endl;
+	cout << "unzip and XmlFilter: " << externalTime << " s" << endl;
+	cout << "ZipFilter: " << inProcessTime << " s" << endl;
+
+	if (inProcessTexts != externalTexts)
+	{
+		cerr << "Texts differ" << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "Texts are identical" << endl;
+
+	return EXIT_SUCCESS;
+}